@@ -0,0 +1,145 @@
+#include "admit.h"
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+
+//hash chains of the per-address table
+#define ADMIT_HASH 1024
+//an address not seen for this long has full buckets again and is forgotten
+#define ADMIT_FORGET_MS (60 * 1000)
+
+/**
+ * Token buckets of one client address. Tokens are kept in thousandths
+ * so a bucket refills by its rate per millisecond; they go negative
+ * when a stream takes more than there is.
+ */
+struct client {
+	char addr[INET6_ADDRSTRLEN];
+	int64_t bytes;
+	int64_t packets;
+	uint64_t at;
+	struct client *next;
+};
+
+struct admit_stats admit_stats;
+
+static struct client *clients[ADMIT_HASH];
+//connections on different workers share the buckets of their address
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned hash_addr(const char *addr)
+{
+	unsigned h = 2166136261u;
+
+	while(*addr != '\0')
+		h = (h ^ (unsigned char)*addr++) * 16777619u;
+	return h % ADMIT_HASH;
+}
+
+static void refill(int64_t *tokens, size_t rate, uint64_t ms)
+{
+	int64_t full = (int64_t)rate * 1000;
+
+	*tokens += (int64_t)(ms * rate);
+	if(*tokens > full)
+		*tokens = full;
+}
+
+//milliseconds until @tokens gets back to @need at @rate
+static uint64_t wait_for(int64_t tokens, int64_t need, size_t rate)
+{
+	return tokens >= need ? 0 : (uint64_t)(need - tokens + rate - 1) / rate;
+}
+
+/*********************************************************************
+Find the buckets of @addr, starting it off with full ones. Clients in
+the chain that were not seen for ADMIT_FORGET_MS are dropped on the way,
+so the table only holds the recently busy ones.
+**********************************************************************/
+static struct client *client_get(const char *addr, uint64_t now)
+{
+	struct client **pc = &clients[hash_addr(addr)], *c;
+
+	while((c = *pc) != NULL)
+	{
+		if(strcmp(c->addr, addr) == 0)
+			return c;
+		//another worker may have moved it past our now already
+		if(now > c->at && now - c->at > ADMIT_FORGET_MS)
+		{
+			*pc = c->next;
+			free(c);
+			continue;
+		}
+		pc = &c->next;
+	}
+	if((c = calloc(1, sizeof(*c))) == NULL)
+		return NULL;
+	snprintf(c->addr, sizeof(c->addr), "%s", addr);
+	c->bytes = (int64_t)CFG.rate_bytes * 1000;
+	c->packets = (int64_t)CFG.rate_packets * 1000;
+	c->at = now;
+	c->next = *pc;
+	*pc = c;
+	return c;
+}
+
+int admit_limited(void)
+{
+	return CFG.rate_bytes != 0 || CFG.rate_packets != 0;
+}
+
+static uint64_t client_take(struct client *c, size_t bytes, size_t packets, int debt, uint64_t now)
+{
+	uint64_t wait = 0, w;
+
+	//read before another worker took the lock and moved it on
+	if(now < c->at)
+		now = c->at;
+	refill(&c->bytes, CFG.rate_bytes, now - c->at);
+	refill(&c->packets, CFG.rate_packets, now - c->at);
+	c->at = now;
+
+	int64_t nbytes = (int64_t)bytes * 1000, npackets = (int64_t)packets * 1000;
+	if(!debt)
+	{
+		if(CFG.rate_bytes && (w = wait_for(c->bytes, nbytes, CFG.rate_bytes)) > wait)
+			wait = w;
+		if(CFG.rate_packets && (w = wait_for(c->packets, npackets, CFG.rate_packets)) > wait)
+			wait = w;
+		if(wait > 0)
+			return wait;
+	}
+	if(CFG.rate_bytes)
+	{
+		c->bytes -= nbytes;
+		wait = wait_for(c->bytes, 0, CFG.rate_bytes);
+	}
+	if(CFG.rate_packets)
+	{
+		c->packets -= npackets;
+		if((w = wait_for(c->packets, 0, CFG.rate_packets)) > wait)
+			wait = w;
+	}
+	return wait;
+}
+
+uint64_t admit_take(const char *addr, size_t bytes, size_t packets, int debt, uint64_t now)
+{
+	struct client *c;
+	uint64_t wait = 0;
+
+	if(!admit_limited())
+		return 0;
+	pthread_mutex_lock(&clients_lock);
+	//out of memory: let it through rather than stall the client
+	if((c = client_get(addr, now)) != NULL)
+		wait = client_take(c, bytes, packets, debt, now);
+	pthread_mutex_unlock(&clients_lock);
+	return wait;
+}
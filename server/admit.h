@@ -0,0 +1,40 @@
+#ifndef AESD_ADMIT_H
+#define AESD_ADMIT_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * What admission control turned away or held back since the start, for
+ * AESDSOCKET_STATS. @throttled counts the times a client was paused and
+ * @throttled_ms how long for; @dropped_* are datagrams over the limits.
+ */
+struct admit_stats {
+	_Atomic uint64_t accepted;
+	_Atomic uint64_t rejected;
+	_Atomic uint64_t throttled;
+	_Atomic uint64_t throttled_ms;
+	_Atomic uint64_t dropped_packets;
+	_Atomic uint64_t dropped_bytes;
+};
+
+extern struct admit_stats admit_stats;
+
+/**
+ * Take @param bytes and @param packets from the token buckets of the
+ * client address @param addr, which refill at --rate-bytes and
+ * --rate-packets per second and hold at most a second's worth. With
+ * @param debt they are taken even if the buckets run dry, for data that
+ * was already read; without, nothing is taken unless all of it fits.
+ * @return 0 if it fitted, otherwise the milliseconds until the buckets
+ * are out of debt or would hold it.
+ */
+uint64_t admit_take(const char *addr, size_t bytes, size_t packets, int debt, uint64_t now);
+
+/**
+ * @return non-zero if any rate limit is set.
+ */
+int admit_limited(void);
+
+#endif
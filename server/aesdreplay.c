@@ -0,0 +1,451 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+/*********************************************************************
+aesdreplay drives a running aesdsocket with the traffic of a trace
+written by --capture: connections are opened and closed and packets
+sent at the recorded times, scaled by -s, or as fast as the server
+takes them with -s 0. Packets are filled with 'x' up to their recorded
+length, commands are sent as recorded. Replies are read and counted so
+the server never waits on a full socket.
+**********************************************************************/
+
+//bytes read per recv(), and the longest datagram sent
+#define CHUNK (64 * 1024)
+//queued bytes across all connections before the trace is held back
+#define PENDING_MAX (4 * 1024 * 1024)
+
+struct client {
+	int fd;
+	//the trace closed it: shut down writing once the output is sent
+	int closing;
+	char *out;
+	size_t out_len;
+	size_t out_off;
+	size_t out_cap;
+};
+
+struct totals {
+	unsigned long long connections;
+	unsigned long long failed;
+	unsigned long long packets;
+	unsigned long long sent;
+	unsigned long long queries;
+	unsigned long long datagrams;
+	unsigned long long received;
+	uint64_t behind;
+};
+
+static struct client *clients;
+static size_t nclients;
+static size_t active;
+static size_t pending;
+static struct totals totals;
+static char filler[CHUNK];
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options] TRACE\n"
+		"  -a, --addr=HOST      server address (127.0.0.1)\n"
+		"  -p, --port=PORT      server TCP port (9000)\n"
+		"  -u, --udp-port=PORT  server UDP port, datagrams are skipped without\n"
+		"  -s, --speed=FACTOR   replay speed, 1 keeps the recorded timing,\n"
+		"                       0 goes as fast as possible (1)\n"
+		"  -w, --wait=SECS      once the trace is over, give up on replies\n"
+		"                       after SECS without any (5)\n",
+		prog);
+}
+
+static char *load_trace(const char *path, size_t *len)
+{
+	struct stat sb;
+	char *data = NULL;
+	size_t got = 0;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd == -1 || fstat(fd, &sb) == -1)
+		goto fail;
+	if((data = malloc(sb.st_size + 1)) == NULL)
+		goto fail;
+	while(got < (size_t)sb.st_size)
+	{
+		ssize_t rd = read(fd, data + got, sb.st_size - got);
+		if(rd == -1 && errno == EINTR)
+			continue;
+		if(rd <= 0)
+			goto fail;
+		got += rd;
+	}
+	close(fd);
+	if(got < sizeof(struct capture_hdr) || memcmp(data, CAPTURE_MAGIC, 8) != 0)
+	{
+		fprintf(stderr, "%s: not a capture trace\n", path);
+		free(data);
+		return NULL;
+	}
+	*len = got;
+	return data;
+fail:
+	perror(path);
+	if(fd != -1)
+		close(fd);
+	free(data);
+	return NULL;
+}
+
+static int resolve(const char *host, const char *port, int type, struct addrinfo **res)
+{
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = type };
+	int rc = getaddrinfo(host, port, &hints, res);
+
+	if(rc != 0)
+	{
+		fprintf(stderr, "%s:%s: %s\n", host, port, gai_strerror(rc));
+		return -1;
+	}
+	return 0;
+}
+
+static struct client *client_get(uint32_t id)
+{
+	if(id >= nclients)
+	{
+		size_t n = nclients ? nclients : 64;
+		while(n <= id)
+			n *= 2;
+		struct client *nc = realloc(clients, n * sizeof(*nc));
+		if(nc == NULL)
+			return NULL;
+		memset(nc + nclients, 0, (n - nclients) * sizeof(*nc));
+		for(size_t i = nclients; i < n; i++)
+			nc[i].fd = -1;
+		clients = nc;
+		nclients = n;
+	}
+	return &clients[id];
+}
+
+static int client_queue(struct client *c, const char *data, size_t len)
+{
+	if(c->out_len + len > c->out_cap)
+	{
+		size_t cap = c->out_cap ? c->out_cap : CHUNK;
+		while(cap < c->out_len + len)
+			cap *= 2;
+		char *out = realloc(c->out, cap);
+		if(out == NULL)
+			return -1;
+		c->out = out;
+		c->out_cap = cap;
+	}
+	memcpy(c->out + c->out_len, data, len);
+	c->out_len += len;
+	pending += len;
+	return 0;
+}
+
+//a packet of @len bytes as recorded, its contents made up
+static int client_packet(struct client *c, size_t len)
+{
+	while(len > 1)
+	{
+		size_t n = len - 1 < sizeof(filler) ? len - 1 : sizeof(filler);
+		if(client_queue(c, filler, n) == -1)
+			return -1;
+		len -= n;
+	}
+	return len ? client_queue(c, "\n", 1) : 0;
+}
+
+static void client_close(struct client *c)
+{
+	close(c->fd);
+	c->fd = -1;
+	pending -= c->out_len - c->out_off;
+	free(c->out);
+	c->out = NULL;
+	c->out_len = c->out_off = c->out_cap = 0;
+	active--;
+}
+
+static int client_open(struct client *c, const struct addrinfo *ai)
+{
+	int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, 0);
+
+	if(fd == -1)
+		return -1;
+	if(connect(fd, ai->ai_addr, ai->ai_addrlen) == -1 ||
+	   fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+	c->fd = fd;
+	c->closing = 0;
+	active++;
+	return 0;
+}
+
+//send what is queued, then half-close if the trace closed the connection
+static void client_flush(struct client *c)
+{
+	while(c->out_off < c->out_len)
+	{
+		ssize_t sd = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+		if(sd == -1)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return;
+			perror("send");
+			client_close(c);
+			return;
+		}
+		c->out_off += sd;
+		pending -= sd;
+	}
+	c->out_off = c->out_len = 0;
+	if(c->closing)
+		shutdown(c->fd, SHUT_WR);
+}
+
+/*********************************************************************
+Carry out one record. Records for a connection that could not be opened
+are skipped; a packet goes out behind whatever its connection has queued
+so the order within a connection is the recorded one.
+**********************************************************************/
+static void apply(const struct capture_rec *r, const char *text, const struct addrinfo *tcp,
+		  int udp_fd)
+{
+	struct client *c = r->kind == CAPTURE_DATAGRAM ? NULL : client_get(r->conn);
+
+	if(r->kind != CAPTURE_DATAGRAM && c == NULL)
+	{
+		perror("replay");
+		exit(1);
+	}
+	switch(r->kind)
+	{
+	case CAPTURE_OPEN:
+		totals.connections++;
+		if(c->fd != -1)
+			client_close(c);
+		if(client_open(c, tcp) == -1)
+		{
+			perror("connect");
+			totals.failed++;
+		}
+		break;
+	case CAPTURE_CLOSE:
+		if(c->fd == -1)
+			break;
+		c->closing = 1;
+		client_flush(c);
+		break;
+	case CAPTURE_PACKET:
+	case CAPTURE_QUERY:
+		if(c->fd == -1)
+			break;
+		if((r->kind == CAPTURE_QUERY ? client_queue(c, text, r->len) : client_packet(c, r->len)) == -1)
+		{
+			perror("replay");
+			exit(1);
+		}
+		if(r->kind == CAPTURE_QUERY)
+			totals.queries++;
+		else
+			totals.packets++;
+		totals.sent += r->len;
+		client_flush(c);
+		break;
+	case CAPTURE_DATAGRAM:
+		if(udp_fd == -1 || r->len == 0 || r->len > sizeof(filler))
+			break;
+		//a datagram the server would drop is lost here too
+		filler[r->len - 1] = '\n';
+		if(send(udp_fd, filler, r->len, MSG_DONTWAIT) == (ssize_t)r->len)
+		{
+			totals.datagrams++;
+			totals.sent += r->len;
+		}
+		filler[r->len - 1] = 'x';
+		break;
+	}
+}
+
+//send and read on the @n connections polled, @ids has their numbers
+static void drain(const struct pollfd *pfds, const uint32_t *ids, size_t n, uint64_t *heard)
+{
+	static char scratch[CHUNK];
+
+	for(size_t i = 0; i < n; i++)
+	{
+		struct client *c = &clients[ids[i]];
+		short ev = pfds[i].revents;
+
+		if(ev & POLLOUT)
+			client_flush(c);
+		if(c->fd == -1 || !(ev & (POLLIN | POLLHUP | POLLERR)))
+			continue;
+		ssize_t rd = recv(c->fd, scratch, sizeof(scratch), 0);
+		if(rd > 0)
+		{
+			totals.received += rd;
+			*heard = now_us();
+		}
+		else if(rd == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+			client_close(c);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option long_options[] = {
+		{ "addr",	required_argument,	NULL, 'a' },
+		{ "port",	required_argument,	NULL, 'p' },
+		{ "udp-port",	required_argument,	NULL, 'u' },
+		{ "speed",	required_argument,	NULL, 's' },
+		{ "wait",	required_argument,	NULL, 'w' },
+		{ NULL, 0, NULL, 0 },
+	};
+	const char *host = "127.0.0.1", *port = "9000", *udp_port = NULL;
+	double speed = 1;
+	uint64_t wait = 5 * 1000000;
+	int opt;
+
+	while((opt = getopt_long(argc, argv, "a:p:u:s:w:", long_options, NULL)) != -1)
+	{
+		switch(opt)
+		{
+		case 'a': host = optarg; break;
+		case 'p': port = optarg; break;
+		case 'u': udp_port = optarg; break;
+		case 's': speed = atof(optarg); break;
+		case 'w': wait = strtoull(optarg, NULL, 10) * 1000000; break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if(optind != argc - 1 || speed < 0)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	size_t len;
+	char *trace = load_trace(argv[optind], &len);
+	struct addrinfo *tcp, *udp = NULL;
+	int udp_fd = -1;
+	if(trace == NULL || resolve(host, port, SOCK_STREAM, &tcp) == -1)
+		return 1;
+	if(udp_port != NULL)
+	{
+		if(resolve(host, udp_port, SOCK_DGRAM, &udp) == -1)
+			return 1;
+		udp_fd = socket(udp->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if(udp_fd == -1 || connect(udp_fd, udp->ai_addr, udp->ai_addrlen) == -1)
+		{
+			perror("udp");
+			return 1;
+		}
+	}
+	memset(filler, 'x', sizeof(filler));
+
+	size_t pos = sizeof(struct capture_hdr);
+	struct pollfd *pfds = NULL;
+	uint32_t *ids = NULL;
+	size_t pfds_cap = 0;
+	uint64_t start = now_us(), heard = start;
+	for(;;)
+	{
+		uint64_t now = now_us(), t = now - start, due = 0;
+
+		//what is due, unless the server is too far behind to take it
+		while(pos + sizeof(struct capture_rec) <= len && pending < PENDING_MAX)
+		{
+			struct capture_rec r;
+			memcpy(&r, trace + pos, sizeof(r));
+			size_t text = r.kind == CAPTURE_QUERY ? r.len : 0;
+			if(pos + sizeof(r) + text > len)
+			{
+				fprintf(stderr, "trace cut short\n");
+				pos = len;
+				break;
+			}
+			due = speed > 0 ? (uint64_t)(r.at / speed) : 0;
+			if(due > t)
+				break;
+			if(t - due > totals.behind)
+				totals.behind = t - due;
+			apply(&r, trace + pos + sizeof(r), tcp, udp_fd);
+			pos += sizeof(r) + text;
+		}
+		int over = pos + sizeof(struct capture_rec) > len;
+		if(over && (active == 0 || now - heard > wait))
+			break;
+
+		if(active > pfds_cap)
+		{
+			pfds_cap = active * 2;
+			pfds = realloc(pfds, pfds_cap * sizeof(*pfds));
+			ids = realloc(ids, pfds_cap * sizeof(*ids));
+			if(pfds == NULL || ids == NULL)
+			{
+				perror("replay");
+				return 1;
+			}
+		}
+		size_t n = 0;
+		for(size_t id = 0; id < nclients; id++)
+		{
+			if(clients[id].fd == -1)
+				continue;
+			ids[n] = id;
+			pfds[n].fd = clients[id].fd;
+			pfds[n].events = POLLIN | (clients[id].out_len > clients[id].out_off ? POLLOUT : 0);
+			n++;
+		}
+		int timeout = 100;
+		if(!over && pending < PENDING_MAX && due > t && (due - t) / 1000 < 100)
+			timeout = (due - t + 999) / 1000;
+		if(poll(pfds, n, timeout) == -1 && errno != EINTR)
+		{
+			perror("poll");
+			return 1;
+		}
+		drain(pfds, ids, n, &heard);
+	}
+
+	double secs = (now_us() - start) / 1e6;
+	printf("%llu connections (%llu failed), %llu packets, %llu commands, %llu datagrams, "
+	       "%llu bytes sent, %llu bytes received in %.3f s, at most %.3f s behind the trace\n",
+	       totals.connections, totals.failed, totals.packets, totals.queries, totals.datagrams,
+	       totals.sent, totals.received, secs, totals.behind / 1e6);
+	freeaddrinfo(tcp);
+	if(udp != NULL)
+		freeaddrinfo(udp);
+	free(trace);
+	return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -11,229 +12,627 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <time.h>
 
-#define BACKLOG (10)
-#define PORT "9000"
-#define MY_MAX_SIZE 500
+#include "admit.h"
+#include "capture.h"
+#include "config.h"
+#include "channel.h"
+#include "conn.h"
+#include "cpu.h"
+#include "log.h"
+#include "mem.h"
+#include "query.h"
+#include "shm.h"
+#include "source.h"
+#include "udp.h"
+#include "upgrade.h"
+#include "worker.h"
+
+#define MAX_EVENTS 64
+//how long the new binary may take to come up before the upgrade is abandoned
+#define UPGRADE_READY_SECS 10
 
-struct addrinfo *p;
 int socketfd;
-int new_fd;
-int fd;
+struct udp udp = { .fd = -1 };
+
+//a listening socket, @path is set for AF_UNIX ones
+struct listener {
+	enum source source;
+	int fd;
+	int type;
+	int shm;
+	const char *path;
+};
+struct listener tcp = { .source = SOURCE_LISTENER, .fd = -1, .type = SOCK_STREAM };
+struct listener unix_stream = { .source = SOURCE_LISTENER, .fd = -1, .type = SOCK_STREAM };
+struct listener unix_seqpacket = { .source = SOURCE_LISTENER, .fd = -1, .type = SOCK_SEQPACKET };
+struct listener shm_listener = { .source = SOURCE_LISTENER, .fd = -1, .type = SOCK_STREAM, .shm = 1 };
+volatile sig_atomic_t exit_requested;
+volatile sig_atomic_t reload_requested;
+volatile sig_atomic_t upgrade_requested;
+int saved_argc;
+char **saved_argv;
 
 
 void handler()
 {
-	printf("\ncaught signal, exiting");
+	exit_requested = 1;
+}
+
+void reload_handler()
+{
+	reload_requested = 1;
+}
+
+void upgrade_handler()
+{
+	upgrade_requested = 1;
+}
+
+static const char *const durability_names[] = { "none", "commit", "journal" };
+
+//pick up the reloadable options after a SIGHUP
+static void check_reload(void)
+{
+	if(!reload_requested)
+		return;
+	reload_requested = 0;
+	if(config_reload(saved_argc, saved_argv) == -1)
+	{
+		log_warn("config reload failed, keeping the current options");
+		return;
+	}
+	atomic_store(&log_threshold, CFG.log_level);
+	channel_reconfigure();
+	log_info("config reloaded: recv-size %zu, spill-threshold %zu, max-packet %zu, durability %s",
+	       CFG.recv_size, CFG.spill_threshold, CFG.max_packet,
+	       durability_names[CFG.durability]);
+}
+
+//the socket to the new server while upgrading, watched by the loop
+//until the new server reports @ready
+struct upgrade {
+	enum source source;
+	int sock;
+	int ready;
+	time_t deadline;
+};
+struct upgrade upgrade = { .source = SOURCE_UPGRADE, .sock = -1 };
+//handed over by the previous server, set up once the logs are open
+int udp_fd = -1;
+struct upgrade_item *handed;
+size_t handed_count;
+
+/*********************************************************************
+Pass listening socket @l to the new server. It stays open there, so it
+has to come out of @epfd before it is closed here or epoll would go on
+reporting it; the same goes for everything handed over.
+**********************************************************************/
+static void hand_listener(int epfd, struct listener *l, enum upgrade_kind kind)
+{
+	struct upgrade_item it = { .kind = kind, .nfds = 1, .fds = { l->fd } };
+
+	if(l->fd == -1)
+		return;
+	epoll_ctl(epfd, EPOLL_CTL_DEL, l->fd, NULL);
+	if(upgrade_send(upgrade.sock, &it, NULL, 0) == -1)
+		log_error("upgrade: %m");
+	//the socket file now belongs to the new server
+	close(l->fd);
+	l->fd = -1;
+}
+
+//start the new binary after a SIGUSR2, the loop goes on until it is up
+static void check_upgrade(int epfd)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &upgrade };
+
+	if(!upgrade_requested || upgrade.sock != -1)
+		return;
+	upgrade_requested = 0;
+	if((upgrade.sock = upgrade_exec(saved_argv)) == -1)
+	{
+		log_warn("upgrade failed, carrying on");
+		return;
+	}
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, upgrade.sock, &ev) == -1)
+	{
+		log_error("upgrade: %m");
+		upgrade_abandon(upgrade.sock);
+		upgrade.sock = -1;
+		return;
+	}
+	upgrade.deadline = time(NULL) + UPGRADE_READY_SECS;
+}
+
+/*********************************************************************
+Once per round of the loop, after its events, while upgrading. When the
+new server has reported ready (@readable), give it the listening
+sockets, UDP, the shared-memory rings and the capture trace, then every
+connection of this thread; the workers pass theirs on their next round.
+@return 1 once everything is handed over and the loop should end.
+**********************************************************************/
+static int upgrade_step(int epfd, int readable)
+{
+	if(upgrade.sock == -1)
+		return 0;
+	if(upgrade.ready)
+		return worker_handoff(upgrade.sock) == 0;
+	if(!readable)
+	{
+		if(time(NULL) < upgrade.deadline)
+			return 0;
+		log_error("upgrade: new server did not come up in %d seconds", UPGRADE_READY_SECS);
+		upgrade_abandon(upgrade.sock);
+		upgrade.sock = -1;
+		log_warn("upgrade failed, carrying on");
+		return 0;
+	}
+	//nothing more is read from it, an EOF must not wake the loop
+	epoll_ctl(epfd, EPOLL_CTL_DEL, upgrade.sock, NULL);
+	if(upgrade_ready(upgrade.sock) == -1)
+	{
+		upgrade.sock = -1;
+		log_warn("upgrade failed, carrying on");
+		return 0;
+	}
+	upgrade.ready = 1;
+	hand_listener(epfd, &tcp, UPGRADE_TCP);
+	hand_listener(epfd, &unix_stream, UPGRADE_UNIX);
+	hand_listener(epfd, &unix_seqpacket, UPGRADE_SEQPACKET);
+	hand_listener(epfd, &shm_listener, UPGRADE_SHM_LISTENER);
+	if(udp.fd != -1)
+	{
+		struct upgrade_item it = { .kind = UPGRADE_UDP, .nfds = 1, .fds = { udp.fd } };
+		epoll_ctl(epfd, EPOLL_CTL_DEL, udp.fd, NULL);
+		if(upgrade_send(upgrade.sock, &it, NULL, 0) == -1)
+			log_error("upgrade: %m");
+		udp_close(&udp);
+	}
+	shm_handoff(epfd, upgrade.sock);
+	//no connections are accepted here any more, so the ids are all used
+	struct upgrade_item it = { .kind = UPGRADE_CAPTURE, .nfds = 1 };
+	if((it.fds[0] = capture_state(&it.capture_started, &it.capture_next_id)) != -1 &&
+	   upgrade_send(upgrade.sock, &it, NULL, 0) == -1)
+		log_error("upgrade: %m");
+	conn_handoff(upgrade.sock);
+	return worker_handoff(upgrade.sock) == 0;
+}
+
+//collect what the previous server hands over, until it closed its logs
+static int receive_handover(int sock)
+{
+	struct upgrade_item it;
+	int rc;
+
+	while((rc = upgrade_recv(sock, &it)) == 1)
+	{
+		switch(it.kind)
+		{
+		case UPGRADE_TCP:
+			tcp.fd = it.fds[0];
+			break;
+		case UPGRADE_UNIX:
+			unix_stream.fd = it.fds[0];
+			break;
+		case UPGRADE_SEQPACKET:
+			unix_seqpacket.fd = it.fds[0];
+			break;
+		case UPGRADE_SHM_LISTENER:
+			shm_listener.fd = it.fds[0];
+			break;
+		case UPGRADE_UDP:
+			udp_fd = it.fds[0];
+			break;
+		case UPGRADE_CAPTURE:
+			capture_adopt(it.fds[0], it.capture_started, it.capture_next_id);
+			break;
+		default:
+		{
+			struct upgrade_item *n = realloc(handed, (handed_count + 1) * sizeof(*n));
+			if(n == NULL)
+				return -1;
+			handed = n;
+			handed[handed_count++] = it;
+			break;
+		}
+		}
+	}
+	close(sock);
+	if(rc == -1)
+	{
+		log_error("upgrade: %m");
+		return -1;
+	}
+	log_info("upgrade: took over %zu connections and rings", handed_count);
+	return 0;
+}
+
+//give a connection to a worker, or serve it here without workers
+static void serve_client(int epfd, const struct upgrade_item *it)
+{
+	if(worker_assign(it) == -1)
+		conn_adopt(epfd, it);
+}
+
+static void adopt_handover(int epfd, struct channel *def)
+{
+	size_t i;
+
+	for(i = 0; i < handed_count; i++)
+	{
+		if(handed[i].kind == UPGRADE_CONN)
+			serve_client(epfd, &handed[i]);
+		else
+			shm_adopt(epfd, handed[i].fds, def);
+	}
+	free(handed);
+	handed = NULL;
+	handed_count = 0;
+}
+
+//turn a client away before anything is set up for it
+static void reject_client(int fd, const char *why)
+{
+	char msg[128];
+	int len = snprintf(msg, sizeof(msg), QUERY_PREFIX "ERROR:%s\n", why);
+
+	if(send(fd, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL) == -1)
+		log_debug("reject: %m");
 	close(fd);
-	close(socketfd);
-	close(new_fd);	
-	freeaddrinfo(p);
-	remove("/var/tmp/aesdsocketdata.txt");
+	admit_stats.rejected++;
+}
+
+//accept every pending connection on the listening socket @fd
+static void accept_clients(int epfd, int fd, int seqpacket)
+{
+	for(;;)
+	{
+		struct sockaddr_storage client_addr;	
+		socklen_t addr_size = sizeof(client_addr);
+		void *addr;
+
+		int new_fd = accept4(fd, (struct sockaddr *)&client_addr, &addr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(new_fd == -1)
+		{
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				log_error("accept: %m");
+			return;
+		}
+		if(CFG.max_connections && conn_count() >= CFG.max_connections)
+		{
+			reject_client(new_fd, "too many connections");
+			log_warn("connection limit %zu reached, turning clients away", CFG.max_connections);
+			continue;
+		}
+		if(mem_tight())
+		{
+			reject_client(new_fd, "out of memory");
+			log_warn("memory budget %zu nearly used up, turning clients away", CFG.memory_budget);
+			continue;
+		}
+		admit_stats.accepted++;
 
+		struct upgrade_item it = { .kind = UPGRADE_CONN, .nfds = 1, .fds = { new_fd },
+					   .seqpacket = seqpacket };
+		if(client_addr.ss_family == AF_UNIX)
+		{
+			snprintf(it.addr, sizeof(it.addr), "local");
+			serve_client(epfd, &it);
+			continue;
+		}
+		if(client_addr.ss_family == AF_INET6)
+			addr = &((struct sockaddr_in6 *)&client_addr)->sin6_addr;
+		else
+			addr = &((struct sockaddr_in *)&client_addr)->sin_addr;
+		inet_ntop(client_addr.ss_family, addr, it.addr, sizeof(it.addr));
+		log_info("Connected with the IP: %s", it.addr);
+		serve_client(epfd, &it);
+	}
 }
 
-int main()
+/*********************************************************************
+Bind the AF_UNIX listener @l at @path. A socket file left behind by a
+previous run is removed first, the file is removed again on exit. A
+listener handed over by an upgrade is only watched.
+**********************************************************************/
+static int unix_listen(int epfd, struct listener *l, const char *path)
 {
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = l };
+
+	l->path = path;
+	if(l->fd != -1)
+		goto watch;
+	if(snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", path) >= (int)sizeof(sun.sun_path))
+	{
+		log_error("%s: socket path too long", path);
+		return -1;
+	}
+	if((l->fd = socket(AF_UNIX, l->type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+	{
+		log_error("unix socket: %m");
+		return -1;
+	}
+	unlink(path);
+	if(bind(l->fd, (struct sockaddr *)&sun, sizeof(sun)) != 0)
+	{
+		log_error("unix bind: %m");
+		return -1;
+	}
+	if(listen(l->fd, CFG.backlog) == -1)
+	{
+		log_error("unix listen: %m");
+		return -1;
+	}
+watch:
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, l->fd, &ev) == -1)
+	{
+		log_error("unix listen: %m");
+		return -1;
+	}
+	return 0;
+}
+
+static void unix_close(struct listener *l)
+{
+	if(l->fd == -1)
+		return;
+	close(l->fd);
+	unlink(l->path);
+}
+
+//set up the TCP listener, unless the previous server handed it over
+static int tcp_listen(void)
+{
+	if(tcp.fd != -1)
+		return 0;
+
 	struct addrinfo hints;
 	struct addrinfo *res;
 	//clear the structure instance
 	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_INET;	//any protocol: IPv4 or IPv6
+	hints.ai_family = CFG.bind_addr[0] ? AF_UNSPEC : AF_INET;	//IPv4 unless an address is given
 	hints.ai_socktype = SOCK_STREAM;	//TCP
 	hints.ai_flags = AI_PASSIVE;    //assign address
 
 	//starting the connection with the client using the series of functions
-	if(getaddrinfo(NULL, PORT, &hints, &res) != 0)
+	int gai;
+	if((gai = getaddrinfo(CFG.bind_addr[0] ? CFG.bind_addr : NULL, CFG.port, &hints, &res)) != 0)
 	{
-		perror("\ngetaddrinfo");
+		log_error("getaddrinfo: %s", gai_strerror(gai));
 		return -1;
 	}	
 
-	//converting the IP address into string
-	char ipstr[30];
-	for(p = res; p != NULL; p = res->ai_next)
-	{
-		void *addr;
-		struct sockaddr_in *ipv4 = (struct sockaddr_in *)p->ai_addr;
-    	addr = &(ipv4->sin_addr);
-		inet_ntop(p->ai_family, addr, ipstr, sizeof(ipstr));
-	}
-
 	//calling the socket function
-	//int socketfd;
-
-	if((socketfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol)) == -1)
+	if((socketfd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, res->ai_protocol)) == -1)
 	{
-		perror("\nsocket");
+		log_error("socket: %m");
 		return -1;
 	}
+	int one = 1;
+	setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
 
 	//bind to a connection
 	if(bind(socketfd, res->ai_addr, res->ai_addrlen) != 0)
 	{
-		perror("\nbind");
+		log_error("bind: %m");
 		return -1;
 	}
 
 	//listen to a connection request from a client
-	if(listen(socketfd, BACKLOG) == -1)
+	if(listen(socketfd, CFG.backlog) == -1)
 	{
-		perror("\nlisten");
-		return -1;	
+		log_error("listen: %m");
+		return -1;
 	}
 
 	freeaddrinfo(res);
+	tcp.fd = socketfd;
+	return 0;
+}
+
+//pin this thread to --acceptor-cpus
+static int pin_acceptor(void)
+{
+	cpu_set_t set;
 
-	//accept the connection with the client
-	struct sockaddr_storage client_addr;	
-	socklen_t addr_size = sizeof(client_addr);
-	//int new_fd;
+	if(CFG.acceptor_cpus[0] == '\0')
+		return 0;
+	cpu_parse(CFG.acceptor_cpus, &set);
+	if(cpu_pin(&set) == -1)
+	{
+		log_error("acceptor-cpus %s: %m", CFG.acceptor_cpus);
+		return -1;
+	}
+	return 0;
+}
 
-	//allocating memory to the buffers to be used
-	//char *buf = (char *) malloc(MY_MAX_SIZE);
-	char *rem_buf = (char *) malloc(MY_MAX_SIZE);
-	
-	int i;
-	//int fd;
+int main(int argc, char *argv[])
+{
+	if(config_load(&CFG, argc, argv) == -1)
+		return -1;
+	//before the log thread starts, it is one of the background ones
+	if(CFG.background_cpus[0] != '\0')
+	{
+		cpu_set_t set;
+
+		cpu_parse(CFG.background_cpus, &set);
+		cpu_set_background(&set);
+	}
+	atomic_store(&log_threshold, CFG.log_level);
+	if(log_open(CFG.log_target) == -1)
+	{
+		fprintf(stderr, "log %s: %s\n", CFG.log_target, strerror(errno));
+		return -1;
+	}
+	//also flushes what the early returns below logged
+	atexit(log_close);
+	saved_argc = argc;
+	saved_argv = argv;
+
+	//started by a running server for an upgrade: take over its sockets,
+	//and its capture trace, which goes on rather than starting over
+	int handover = upgrade_accept();
+	if(handover != -1 && receive_handover(handover) == -1)
+		return -1;
+	if(CFG.capture_path[0] != '\0' && capture_fd == -1 && capture_open(CFG.capture_path) == -1)
+	{
+		log_error("capture %s: %m", CFG.capture_path);
+		return -1;
+	}
+	atexit(capture_close);
+	if(tcp_listen() == -1)
+		return -1;
+
+
+	//open the default channel up front so a damaged log is found before
+	//any client connects, named channels are opened on first use
+	struct channel *def = channel_get("");
+	if(def == NULL)
+	{
+		log_error("file open: %m");
+		return -1;
+	}
+
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &tcp };
+	if(epfd == -1 || epoll_ctl(epfd, EPOLL_CTL_ADD, tcp.fd, &ev) == -1)
+	{
+		log_error("epoll: %m");
+		return -1;
+	}
+	if(CFG.udp_port[0] != '\0' || udp_fd != -1)
+	{
+		if(udp_open(&udp, udp_fd, CFG.bind_addr, CFG.udp_port, def) == -1)
+			return -1;
+		ev.data.ptr = &udp;
+		if(epoll_ctl(epfd, EPOLL_CTL_ADD, udp.fd, &ev) == -1)
+		{
+			log_error("epoll: %m");
+			return -1;
+		}
+	}
+	if(CFG.unix_path[0] != '\0' && unix_listen(epfd, &unix_stream, CFG.unix_path) == -1)
+		return -1;
+	if(CFG.unix_seqpacket_path[0] != '\0' &&
+	   unix_listen(epfd, &unix_seqpacket, CFG.unix_seqpacket_path) == -1)
+		return -1;
+	if(CFG.shm_path[0] != '\0' && unix_listen(epfd, &shm_listener, CFG.shm_path) == -1)
+		return -1;
+	if(worker_start(CFG.workers) == -1)
+		return -1;
+	//only now, threads started before would take on the pinning
+	if(pin_acceptor() == -1)
+		return -1;
+	adopt_handover(epfd, def);
 
 	/*********************************************************************
-	The loop receives, writes to the file, reads from the file, and sends
-	the data back to the client. This goes on untill SIGINT signal is not
-	given by the user.
+	The loop accepts clients and lets each connection receive, write to
+	the file and replay the file back as its socket becomes ready. This
+	goes on untill SIGINT or SIGTERM is given by the user.
 	**********************************************************************/
 	signal(SIGINT, handler);
 	signal(SIGTERM, handler);
-	while(1)
+	struct sigaction sa = { .sa_handler = reload_handler };
+	sigaction(SIGHUP, &sa, NULL);
+	sa.sa_handler = upgrade_handler;
+	sigaction(SIGUSR2, &sa, NULL);
+	size_t waiting = 0;
+	while(!exit_requested)
 	{
-		char *buf = (char *) malloc(MY_MAX_SIZE);
-		char *send_buf = (char *) malloc(MY_MAX_SIZE);
-		//accept the connection from the client
-		if((new_fd = accept(socketfd, (struct sockaddr *)&client_addr, &addr_size)) == -1 )
-		{
-			perror("\naccept");
-			return -1;	
-		}
-		else
-		{
-			printf("Connected with the IP: ");
-			puts(ipstr);
-		}
+		struct epoll_event events[MAX_EVENTS];
 
-		//remove("/var/tmp/aesdsocketdata.txt");
-		//open the file
-		fd = open("/var/tmp/aesdsocketdata.txt", O_RDWR | O_CREAT | O_APPEND, 0777);
-		if(fd == -1)
+		//the signal may have come in outside epoll_wait(), look every round
+		check_reload();
+		//nothing of the options is held here either
+		config_release(worker_config_seen());
+		check_upgrade(epfd);
+		int timeout = conn_expire();
+		//while upgrading, look for the deadline and then the workers
+		//regularly; while replays wait for their turn, only pick up what
+		//is ready
+		if(upgrade.sock != -1 && (timeout == -1 || timeout > (upgrade.ready ? 10 : 100)))
+			timeout = upgrade.ready ? 10 : 100;
+		if(waiting)
+			timeout = 0;
+		int i, ready = 0, n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+		if(n == -1)
 		{
-			perror("\nfile open");
-			return(-1);
-		} 
-		
-		//receive from the client
-		int rc, count=0;
-		if((rc=recv(new_fd, buf, MY_MAX_SIZE, 0)) == -1)
-			{
-				perror("\nreceive");	
-				close(new_fd);
-				close(socketfd);
-				return -1;
-			}
-		else
-		{
-			printf("\nrc: %d\n, received buffers: ", rc);
-			puts(buf);
+			if(errno == EINTR)
+				continue;
+			log_error("epoll_wait: %m");
+			break;
 		}
-
-		//search for the \n character (if present, write, else reallocate the buffer extra size)
-		int n=1;
-		for(i=0; i<MY_MAX_SIZE; i++)
+		for(i = 0; i < n; i++)
 		{
-			if(*(buf + (MY_MAX_SIZE*(n-1)) + i) == '\n')
+			void *ptr = events[i].data.ptr;
+			struct listener *l = ptr;
+
+			switch(*(enum source *)ptr)
 			{
-				//write to the file
-				if((write(fd, buf, (MY_MAX_SIZE*(n-1))+i+1)) == -1)
-				{
-					perror("\nwrite");
-					close(new_fd);
-					close(socketfd);
-					return -1;
-				}
+			case SOURCE_LISTENER:
+				if(l->shm)
+					shm_accept(epfd, l->fd, def);
 				else
-				{
-					printf("\ncontent written to file:\n");
-					puts(buf);
-					//write(fd, "\n", 1); 
-					break;
-				}
-			}
-			else
-			{
-				if(i == (MY_MAX_SIZE-1))
-				{
-					printf("\n\nbuffer full, reloading the buffer\n\n");
-					n++;
-					i=0;
-					buf = realloc(buf, (MY_MAX_SIZE*n));
-					if((rc=recv(new_fd, buf+(MY_MAX_SIZE*(n-1)), MY_MAX_SIZE, 0)) == -1)
-					{
-						perror("\nreceive");	
-						close(new_fd);
-						close(socketfd);
-						return -1;
-					}
-					else
-					{
-						printf("\nrc: %d\n, received buffers: \n", rc);
-						puts(buf);
-					}
-				}
-			}
-		}
-			//strcpy(rem_buf, buf+i+1);
-
-		//read from the file to send back the content
-		off_t file_size = lseek(fd, 0, SEEK_END);
-		lseek(fd, 0, SEEK_SET);
-		int rd,sd;
-
-		/************************************************
-		if file size < MAX buf size
-			read the whole file size
-		else if the file size > MAx buf size
-			read MAX buf size at a time until EOF is reached
-		**************************************************/
-		while(1)
-		{
-			if(file_size <= MY_MAX_SIZE)
-			{
-				//read the data
-				rd = read(fd, send_buf, file_size);
-				//send the data
-				sd = send(new_fd, send_buf, file_size, 0);
+					accept_clients(epfd, l->fd, l->type == SOCK_SEQPACKET);
+				break;
+			case SOURCE_UDP:
+				udp_drain(ptr);
+				break;
+			case SOURCE_SHM:
+				if(shm_event(ptr) == -1)
+					shm_free(ptr);
+				break;
+			case SOURCE_CONN:
+				if(conn_event(ptr, events[i].events) == -1)
+					conn_free(ptr);
+				break;
+			case SOURCE_WORKER:
+				//only registered with the workers' own loops
+				break;
+			case SOURCE_UPGRADE:
+				//handled after the round, connections with events
+				//further down would be gone
+				ready = 1;
 				break;
 			}
-			else if(file_size > MY_MAX_SIZE)
-			{	
-				//printf("\nwhen file size is greater than max size\n");
-				//read the data
-				rd = read(fd, send_buf, MY_MAX_SIZE);
-				if(rd == 0)
-					break;
-				//send the data
-				if(rd < MY_MAX_SIZE)
-					sd = send(new_fd, send_buf, rd, 0);
-				else
-					sd = send(new_fd, send_buf, MY_MAX_SIZE, 0);
-				printf("\ncontents send:\n");
-				puts(send_buf);
-			}
-		}		
-		
-		free(buf);
-		free(send_buf);
+		}
+		//new packets and short replies went first, now a round of replay
+		waiting = conn_schedule();
+		if(upgrade_step(epfd, ready))
+			break;
 	}
-	//remove("/var/tmp/aesdsocketdata.txt");
-
 
+	if(upgrade.sock != -1 && !upgrade.ready)
+	{
+		upgrade_abandon(upgrade.sock);
+		upgrade.sock = -1;
+	}
+	if(upgrade.sock != -1)
+		log_info("upgrade: handed over, exiting");
+	else
+		log_info("caught signal, exiting");
+	worker_stop();
+	conn_free_all();
+	if(tcp.fd != -1)
+		close(tcp.fd);
+	udp_close(&udp);
+	unix_close(&unix_stream);
+	unix_close(&unix_seqpacket);
+	shm_free_all();
+	unix_close(&shm_listener);
+	close(epfd);
+	//the new server carries on with the logs
+	channel_close_all(CFG.keep_data || upgrade.sock != -1);
+	if(upgrade.sock != -1)
+	{
+		//the new server carries on with the trace once the socket closes
+		capture_close();
+		close(upgrade.sock);
+	}
 	return 0;
 }
\ No newline at end of file
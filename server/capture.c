@@ -0,0 +1,151 @@
+#include "capture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+//records are collected here and written a block at a time
+#define CAPTURE_BUF (64 * 1024)
+
+int capture_fd = -1;
+
+static char buf[CAPTURE_BUF];
+static size_t buf_len;
+static uint64_t started;
+//numbers connections, carried over by an upgrade
+static _Atomic uint32_t next_id;
+//workers record their connections concurrently
+static pthread_mutex_t buf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_us(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int write_all(int fd, const char *data, size_t len)
+{
+	while(len > 0)
+	{
+		ssize_t wr = write(fd, data, len);
+		if(wr == -1)
+		{
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += wr;
+		len -= wr;
+	}
+	return 0;
+}
+
+static void capture_flush(void)
+{
+	if(buf_len > 0 && write_all(capture_fd, buf, buf_len) == -1)
+	{
+		//a trace with holes would replay wrong, stop instead
+		log_error("capture: %m, stopped");
+		close(capture_fd);
+		capture_fd = -1;
+	}
+	buf_len = 0;
+}
+
+int capture_open(const char *path)
+{
+	struct capture_hdr hdr;
+
+	//appended to, a server taking over after an upgrade writes to it too
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+	if(fd == -1)
+		return -1;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic));
+	hdr.started = now_us(CLOCK_REALTIME);
+	if(write_all(fd, (const char *)&hdr, sizeof(hdr)) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+	started = now_us(CLOCK_MONOTONIC);
+	capture_fd = fd;
+	return 0;
+}
+
+int capture_state(uint64_t *start, uint32_t *id)
+{
+	*start = started;
+	*id = atomic_load(&next_id);
+	return capture_fd;
+}
+
+void capture_adopt(int fd, uint64_t start, uint32_t id)
+{
+	started = start;
+	atomic_store(&next_id, id);
+	capture_fd = fd;
+}
+
+uint32_t capture_conn_id(void)
+{
+	return atomic_fetch_add(&next_id, 1) + 1;
+}
+
+void capture_close(void)
+{
+	pthread_mutex_lock(&buf_lock);
+	if(capture_fd != -1)
+		capture_flush();
+	if(capture_fd != -1)
+		close(capture_fd);
+	capture_fd = -1;
+	pthread_mutex_unlock(&buf_lock);
+}
+
+static void capture_put(enum capture_kind kind, uint32_t conn, const char *data, size_t len)
+{
+	struct capture_rec rec = { .at = now_us(CLOCK_MONOTONIC) - started, .conn = conn,
+				   .len = len > UINT32_MAX ? UINT32_MAX : len, .kind = kind };
+	size_t text = kind == CAPTURE_QUERY ? rec.len : 0;
+
+	if(capture_fd == -1)
+		return;
+	if(buf_len + sizeof(rec) + text > sizeof(buf))
+	{
+		capture_flush();
+		if(capture_fd == -1)
+			return;
+		//a command longer than the buffer goes out on its own
+		if(sizeof(rec) + text > sizeof(buf))
+		{
+			if(write_all(capture_fd, (const char *)&rec, sizeof(rec)) == -1 ||
+			   write_all(capture_fd, data, text) == -1)
+			{
+				log_error("capture: %m, stopped");
+				close(capture_fd);
+				capture_fd = -1;
+			}
+			return;
+		}
+	}
+	memcpy(buf + buf_len, &rec, sizeof(rec));
+	if(text > 0)
+		memcpy(buf + buf_len + sizeof(rec), data, text);
+	buf_len += sizeof(rec) + text;
+}
+
+void capture_write(enum capture_kind kind, uint32_t conn, const char *data, size_t len)
+{
+	pthread_mutex_lock(&buf_lock);
+	capture_put(kind, conn, data, len);
+	pthread_mutex_unlock(&buf_lock);
+}
@@ -0,0 +1,90 @@
+#ifndef AESD_CAPTURE_H
+#define AESD_CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*********************************************************************
+Traffic capture, written with --capture and played back by aesdreplay.
+A trace is a capture_hdr followed by capture_rec records in the order
+things happened, in host byte order. Packet contents are not kept, only
+their lengths, except for commands: a QUERY record is followed by the
+@len bytes of the command so a replay can send it again.
+**********************************************************************/
+
+#define CAPTURE_MAGIC "AESDCAP1"
+
+enum capture_kind {
+	CAPTURE_OPEN = 1,	//a client connected
+	CAPTURE_CLOSE,		//the connection went away
+	CAPTURE_PACKET,		//a packet of @len bytes (including its '\n') arrived
+	CAPTURE_QUERY,		//a command arrived, its text follows
+	CAPTURE_DATAGRAM,	//a packet arrived over UDP, @conn is 0
+};
+
+struct capture_hdr {
+	char magic[8];
+	//CLOCK_REALTIME microseconds when the capture started
+	uint64_t started;
+};
+
+/**
+ * One event: @at is microseconds since the capture started, @conn the
+ * connection it belongs to, numbered from 1 as they are accepted.
+ */
+struct capture_rec {
+	uint64_t at;
+	uint32_t conn;
+	uint32_t len;
+	uint32_t kind;
+	uint32_t reserved;
+};
+
+//the trace file, -1 when not capturing
+extern int capture_fd;
+
+/**
+ * Start writing a trace to @param path, replacing what is there.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int capture_open(const char *path);
+
+/**
+ * What an upgrade hands to the new server so the trace goes on in the
+ * same file: sets @param started to when the capture started (on
+ * CLOCK_MONOTONIC, which both servers share) and @param next_id to the
+ * id the next connection gets.
+ * @return the trace file, -1 when not capturing.
+ */
+int capture_state(uint64_t *started, uint32_t *next_id);
+
+/**
+ * Carry on the trace of the previous server in its file @param fd,
+ * with @param started and @param next_id from capture_state().
+ */
+void capture_adopt(int fd, uint64_t started, uint32_t next_id);
+
+/**
+ * @return the id of a newly accepted connection.
+ */
+uint32_t capture_conn_id(void);
+
+/**
+ * Write out what is buffered and stop capturing.
+ */
+void capture_close(void);
+
+void capture_write(enum capture_kind kind, uint32_t conn, const char *data, size_t len);
+
+/**
+ * Record an event when capturing; @param data is the command text of a
+ * CAPTURE_QUERY and ignored otherwise. Records are buffered and written
+ * in large blocks, so capturing costs the server little.
+ */
+static inline void capture_event(enum capture_kind kind, uint32_t conn, const char *data, size_t len)
+{
+	if(capture_fd != -1)
+		capture_write(kind, conn, data, len);
+}
+
+#endif
@@ -0,0 +1,152 @@
+#include "channel.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "log.h"
+
+static struct channel *channels;
+static size_t nchannels;
+//guards the channel list only, each channel has its own lock
+static pthread_mutex_t channels_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int channel_valid_name(const char *name)
+{
+	size_t len = strlen(name);
+
+	//these would share their file with one of the default channel's
+	if(len == 0 || len > CHANNEL_NAME_MAX || strcmp(name, "idx") == 0 || strcmp(name, "crc") == 0 ||
+	   strcmp(name, "seg") == 0 || strcmp(name, "lz") == 0)
+		return 0;
+	//the name becomes part of a file name
+	return strspn(name, "abcdefghijklmnopqrstuvwxyz"
+			    "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+			    "0123456789_-") == len;
+}
+
+static struct channel *channel_open(const char *name)
+{
+	struct channel *ch = calloc(1, sizeof(*ch));
+
+	if(ch == NULL)
+		return NULL;
+	snprintf(ch->name, sizeof(ch->name), "%s", name);
+	if(name[0] == '\0')
+		snprintf(ch->path, sizeof(ch->path), "%s", CFG.data_file);
+	else if(snprintf(ch->path, sizeof(ch->path), "%s.%s", CFG.data_file, name) >= (int)sizeof(ch->path))
+	{
+		free(ch);
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	if(store_open(&ch->st, ch->path,
+		      (CFG.checksums ? STORE_CHECKSUMS : 0) | (CFG.compress ? STORE_COMPRESS : 0)) == -1)
+	{
+		free(ch);
+		return NULL;
+	}
+	if(feed_init(&ch->feed, CFG.feed_size, ch->st.committed) == -1)
+	{
+		store_close(&ch->st);
+		free(ch);
+		return NULL;
+	}
+	if(store_journal(&ch->st, CFG.durability == DURABILITY_JOURNAL) == -1)
+	{
+		feed_destroy(&ch->feed);
+		store_close(&ch->st);
+		free(ch);
+		return NULL;
+	}
+	if(rcache_resize(&ch->cache, CFG.replay_cache) == -1)
+		log_error("replay cache for %s: %m", ch->path);
+	pthread_mutex_init(&ch->lock, NULL);
+	ch->st.sync = CFG.durability == DURABILITY_COMMIT;
+	channel_retain(ch);
+	return ch;
+}
+
+struct channel *channel_get(const char *name)
+{
+	struct channel *ch;
+
+	pthread_mutex_lock(&channels_lock);
+	for(ch = channels; ch != NULL; ch = ch->next)
+	{
+		if(strcmp(ch->name, name) == 0)
+			goto out;
+	}
+	if(name[0] != '\0' && !channel_valid_name(name))
+	{
+		errno = EINVAL;
+		goto out;
+	}
+	//the default channel does not count against the limit
+	if(name[0] != '\0' && CFG.max_channels && nchannels >= CFG.max_channels)
+	{
+		errno = EMFILE;
+		goto out;
+	}
+	if((ch = channel_open(name)) != NULL)
+	{
+		ch->next = channels;
+		channels = ch;
+		if(name[0] != '\0')
+		{
+			nchannels++;
+			log_info("opened channel '%s' at %s", name, ch->path);
+		}
+	}
+out:
+	pthread_mutex_unlock(&channels_lock);
+	return ch;
+}
+
+void channel_close_all(int keep)
+{
+	pthread_mutex_lock(&channels_lock);
+	while(channels != NULL)
+	{
+		struct channel *ch = channels;
+		channels = ch->next;
+		feed_destroy(&ch->feed);
+		rcache_destroy(&ch->cache);
+		store_close(&ch->st);
+		if(!keep)
+			store_unlink(&ch->st);
+		pthread_mutex_destroy(&ch->lock);
+		free(ch);
+	}
+	nchannels = 0;
+	pthread_mutex_unlock(&channels_lock);
+}
+
+void channel_reconfigure(void)
+{
+	struct channel *ch;
+
+	pthread_mutex_lock(&channels_lock);
+	for(ch = channels; ch != NULL; ch = ch->next)
+	{
+		channel_lock(ch);
+		ch->st.sync = CFG.durability == DURABILITY_COMMIT;
+		if(store_journal(&ch->st, CFG.durability == DURABILITY_JOURNAL) == -1)
+			log_error("journal for %s: %m", ch->path);
+		if(rcache_resize(&ch->cache, CFG.replay_cache) == -1)
+			log_error("replay cache for %s: %m", ch->path);
+		channel_retain(ch);
+		channel_unlock(ch);
+	}
+	pthread_mutex_unlock(&channels_lock);
+}
+
+void channel_retain(struct channel *ch)
+{
+	size_t keep = config_retention(&CFG, ch->name);
+
+	if(keep && store_trim(&ch->st, keep) == -1)
+		log_error("retention: %m");
+}
@@ -0,0 +1,68 @@
+#ifndef AESD_CHANNEL_H
+#define AESD_CHANNEL_H
+
+#include <limits.h>
+#include <pthread.h>
+
+#include "feed.h"
+#include "rcache.h"
+#include "store.h"
+
+#define CHANNEL_NAME_MAX 64
+
+/**
+ * An independent log inside one server. The default channel has an empty
+ * name and lives in the configured data file, a named channel lives next
+ * to it as <data-file>.<name>. Each channel has its own store, index,
+ * subscriber feed, replay cache and retention, and @lock guards all of
+ * them so channels never contend with each other.
+ */
+struct channel {
+	char name[CHANNEL_NAME_MAX + 1];
+	char path[PATH_MAX];
+	pthread_mutex_t lock;
+	struct store st;
+	struct feed feed;
+	struct rcache cache;
+	struct channel *next;
+};
+
+/**
+ * @return non-zero if @param name is usable as a channel name.
+ */
+int channel_valid_name(const char *name);
+
+/**
+ * Find the channel called @param name, opening (and recovering) its log
+ * on first use.
+ * @return the channel, or NULL with errno set on failure.
+ */
+struct channel *channel_get(const char *name);
+
+/**
+ * Close every channel, removing their logs unless @param keep is set.
+ */
+void channel_close_all(int keep);
+
+/**
+ * Re-apply options that changed on reload to every open channel.
+ */
+void channel_reconfigure(void);
+
+/**
+ * Drop old packets once @param ch grows past its retention limit.
+ * Called with the channel locked.
+ */
+void channel_retain(struct channel *ch);
+
+static inline void channel_lock(struct channel *ch)
+{
+	pthread_mutex_lock(&ch->lock);
+}
+
+static inline void channel_unlock(struct channel *ch)
+{
+	pthread_mutex_unlock(&ch->lock);
+}
+
+#endif
@@ -0,0 +1,628 @@
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "log.h"
+
+#define BACKLOG (10)
+#define PORT "9000"
+#define MY_MAX_SIZE 500
+#define DATA_FILE "/var/tmp/aesdsocketdata.txt"
+//bytes of a partial packet kept in memory before it is spilled to disk
+#define SPILL_THRESHOLD (64 * 1024)
+//recently committed bytes kept in memory for subscribers
+#define FEED_SIZE (1024 * 1024)
+#define SUBSCRIBER_MAX_LAG (4 * 1024 * 1024)
+#define MAX_CHANNELS 64
+//datagrams taken per recvmmsg() call and the largest one accepted
+#define UDP_BATCH 64
+#define UDP_SIZE 4096
+//data bytes of each producer's shared-memory ring
+#define SHM_SIZE (1024 * 1024)
+//reply bytes a connection sends per turn before the next one gets to
+#define REPLAY_QUANTUM (64 * 1024)
+//seconds a client may stay silent, take to finish a packet and leave its
+//replies unread
+#define IDLE_TIMEOUT 300
+#define HEADER_TIMEOUT 30
+#define STALL_TIMEOUT 60
+//clients served at once, further ones are turned away at accept
+#define MAX_CONNECTIONS 1000
+
+//the options as loaded at startup, until the first reload
+static struct config loaded;
+struct config *_Atomic config_current = &loaded;
+//reloads so far, see config_release()
+static _Atomic uint64_t generation;
+
+static const struct option long_options[] = {
+	{ "config",		required_argument,	NULL, 'c' },
+	{ "port",		required_argument,	NULL, 'p' },
+	{ "bind",		required_argument,	NULL, 'b' },
+	{ "backlog",		required_argument,	NULL, 0 },
+	{ "data-file",		required_argument,	NULL, 'f' },
+	{ "keep",		no_argument,		NULL, 'k' },
+	{ "storage",		required_argument,	NULL, 0 },
+	{ "recv-size",		required_argument,	NULL, 0 },
+	{ "spill-threshold",	required_argument,	NULL, 't' },
+	{ "max-packet",		required_argument,	NULL, 0 },
+	{ "replay-quantum",	required_argument,	NULL, 0 },
+	{ "zerocopy",		required_argument,	NULL, 0 },
+	{ "replay-cache",	required_argument,	NULL, 0 },
+	{ "idle-timeout",	required_argument,	NULL, 0 },
+	{ "header-timeout",	required_argument,	NULL, 0 },
+	{ "stall-timeout",	required_argument,	NULL, 0 },
+	{ "max-connections",	required_argument,	NULL, 0 },
+	{ "memory-budget",	required_argument,	NULL, 0 },
+	{ "rate-bytes",		required_argument,	NULL, 0 },
+	{ "rate-packets",	required_argument,	NULL, 0 },
+	{ "durability",		required_argument,	NULL, 0 },
+	{ "feed-size",		required_argument,	NULL, 0 },
+	{ "subscriber-max-lag",	required_argument,	NULL, 0 },
+	{ "subscriber-policy",	required_argument,	NULL, 0 },
+	{ "max-channels",	required_argument,	NULL, 0 },
+	{ "retention",		required_argument,	NULL, 0 },
+	{ "udp-port",		required_argument,	NULL, 'u' },
+	{ "udp-batch",		required_argument,	NULL, 0 },
+	{ "udp-size",		required_argument,	NULL, 0 },
+	{ "udp-ack",		no_argument,		NULL, 0 },
+	{ "unix",		required_argument,	NULL, 0 },
+	{ "unix-seqpacket",	required_argument,	NULL, 0 },
+	{ "shm",		required_argument,	NULL, 0 },
+	{ "shm-size",		required_argument,	NULL, 0 },
+	{ "checksums",		no_argument,		NULL, 0 },
+	{ "compress",		no_argument,		NULL, 0 },
+	{ "log",		required_argument,	NULL, 0 },
+	{ "log-level",		required_argument,	NULL, 0 },
+	{ "capture",		required_argument,	NULL, 0 },
+	{ "workers",		required_argument,	NULL, 0 },
+	{ "worker-cpus",	required_argument,	NULL, 0 },
+	{ "acceptor-cpus",	required_argument,	NULL, 0 },
+	{ "background-cpus",	required_argument,	NULL, 0 },
+	{ NULL, 0, NULL, 0 },
+};
+
+void config_usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -c, --config=FILE          read options from FILE (name = value per line)\n"
+		"  -p, --port=PORT            TCP port to listen on (" PORT ")\n"
+		"  -b, --bind=ADDR            address to bind (all IPv4 addresses)\n"
+		"      --backlog=N            listen() backlog (%d)\n"
+		"  -f, --data-file=PATH       packet log (" DATA_FILE ")\n"
+		"  -k, --keep                 keep the packet log on exit\n"
+		"      --storage=file         storage backend\n"
+		"      --recv-size=BYTES      socket read and replay chunk size (%d) *\n"
+		"  -t, --spill-threshold=BYTES  partial packet kept in memory (%d) *\n"
+		"      --max-packet=BYTES     drop clients sending longer packets, 0 = no limit *\n"
+		"      --replay-quantum=BYTES  reply bytes a connection sends per turn when\n"
+		"                             several are replaying (%d) *\n"
+		"      --zerocopy=BYTES       send replies of at least BYTES with MSG_ZEROCOPY,\n"
+		"                             0 = always copy *\n"
+		"      --replay-cache=BYTES   log bytes per channel kept in memory for replies,\n"
+		"                             0 = read the log every time *\n"
+		"      --idle-timeout=SECS    close clients that send nothing, 0 = never (%d) *\n"
+		"      --header-timeout=SECS  close clients that leave a packet unfinished (%d) *\n"
+		"      --stall-timeout=SECS   close clients that stop reading replies (%d) *\n"
+		"      --max-connections=N    clients served at once, 0 = no limit (%d) *\n"
+		"      --memory-budget=BYTES  buffers and caches may take at most BYTES,\n"
+		"                             0 = no limit *\n"
+		"      --rate-bytes=BYTES     bytes per second one client address may send,\n"
+		"                             0 = no limit *\n"
+		"      --rate-packets=N       packets per second one client address may send,\n"
+		"                             0 = no limit *\n"
+		"      --durability=POLICY    none, commit (fdatasync per packet) or journal\n"
+		"                             (direct I/O write-ahead journal) *\n"
+		"      --feed-size=BYTES      recent packets kept in memory for subscribers (%d)\n"
+		"      --subscriber-max-lag=BYTES  backlog before the policy applies, 0 = no limit (%d) *\n"
+		"      --subscriber-policy=POLICY  drop (skip ahead) or disconnect a lagging subscriber *\n"
+		"      --max-channels=N       named channels that may be open, 0 = no limit (%d) *\n"
+		"      --retention=[CHANNEL:]BYTES  keep only the newest BYTES of every channel,\n"
+		"                             or of CHANNEL (repeatable), 0 = keep everything *\n"
+		"  -u, --udp-port=PORT        also take packets as UDP datagrams on PORT (off)\n"
+		"      --udp-batch=N          datagrams read per system call (%d)\n"
+		"      --udp-size=BYTES       longest datagram accepted (%d)\n"
+		"      --udp-ack              answer every datagram with its end offset\n"
+		"      --unix=PATH            also listen on a UNIX stream socket at PATH\n"
+		"      --unix-seqpacket=PATH  also listen on a UNIX seqpacket socket at PATH,\n"
+		"                             every record is one packet\n"
+		"      --shm=PATH             hand out shared-memory rings to producers\n"
+		"                             connecting to the UNIX socket at PATH\n"
+		"      --shm-size=BYTES       ring size per producer, a power of two (%d)\n"
+		"      --checksums            keep a CRC32C per packet, checked on recovery\n"
+		"                             and before packets are replayed\n"
+		"      --compress             keep full 256 KiB log segments LZ4 compressed\n"
+		"      --log=TARGET           stdout, syslog or a file to append to (stdout)\n"
+		"      --log-level=LEVEL      error, warn, info or debug (info) *\n"
+		"      --capture=PATH         record connections and packet times and sizes\n"
+		"                             to PATH, for aesdreplay\n"
+		"      --workers=N            serve connections on N threads, 0 = on the\n"
+		"                             accepting thread (0)\n"
+		"      --worker-cpus=LIST     pin worker threads to the CPUs of LIST (e.g. 0-3,8),\n"
+		"                             one each in turn; connections go to the worker\n"
+		"                             on the CPU their packets arrive on\n"
+		"      --acceptor-cpus=LIST   pin the accepting thread to LIST\n"
+		"      --background-cpus=LIST  pin the log and index threads to LIST\n"
+		"options marked * are re-read from the config file on SIGHUP\n",
+		prog, BACKLOG, MY_MAX_SIZE, SPILL_THRESHOLD, REPLAY_QUANTUM,
+		IDLE_TIMEOUT, HEADER_TIMEOUT, STALL_TIMEOUT, MAX_CONNECTIONS, FEED_SIZE, SUBSCRIBER_MAX_LAG, MAX_CHANNELS,
+		UDP_BATCH, UDP_SIZE, SHM_SIZE);
+}
+
+static void config_defaults(struct config *c)
+{
+	memset(c, 0, sizeof(*c));
+	snprintf(c->port, sizeof(c->port), "%s", PORT);
+	snprintf(c->data_file, sizeof(c->data_file), "%s", DATA_FILE);
+	c->backlog = BACKLOG;
+	c->storage = STORAGE_FILE;
+	c->recv_size = MY_MAX_SIZE;
+	c->spill_threshold = SPILL_THRESHOLD;
+	c->max_packet = 0;
+	c->replay_quantum = REPLAY_QUANTUM;
+	c->idle_timeout = IDLE_TIMEOUT;
+	c->header_timeout = HEADER_TIMEOUT;
+	c->stall_timeout = STALL_TIMEOUT;
+	c->max_connections = MAX_CONNECTIONS;
+	c->durability = DURABILITY_NONE;
+	c->feed_size = FEED_SIZE;
+	c->subscriber_max_lag = SUBSCRIBER_MAX_LAG;
+	c->subscriber_policy = SUBSCRIBER_DROP;
+	c->max_channels = MAX_CHANNELS;
+	c->udp_batch = UDP_BATCH;
+	c->udp_size = UDP_SIZE;
+	c->shm_size = SHM_SIZE;
+	snprintf(c->log_target, sizeof(c->log_target), "stdout");
+	c->log_level = LEVEL_INFO;
+}
+
+size_t config_retention(const struct config *c, const char *channel)
+{
+	int i;
+
+	for(i = 0; i < c->retention_rule_count; i++)
+	{
+		if(strcmp(c->retention_rules[i].channel, channel) == 0)
+			return c->retention_rules[i].bytes;
+	}
+	return c->retention;
+}
+
+//parse a byte count with an optional k/m/g suffix
+static int parse_size(const char *val, size_t *out)
+{
+	char *end;
+	int shift = 0;
+
+	//strtoull() would take "-1" as the largest value
+	while(isspace((unsigned char)*val))
+		val++;
+	if(*val == '-')
+		return -1;
+	errno = 0;
+	unsigned long long n = strtoull(val, &end, 0);
+	if(errno || end == val)
+		return -1;
+	switch(tolower((unsigned char)*end))
+	{
+	case 'g':
+		shift += 10;
+		//fall through
+	case 'm':
+		shift += 10;
+		//fall through
+	case 'k':
+		shift += 10;
+		end++;
+		break;
+	}
+	if(*end != '\0' || n > (unsigned long long)SIZE_MAX >> shift)
+		return -1;
+	*out = (size_t)n << shift;
+	return 0;
+}
+
+//a missing value, as for a flag given on the command line, means yes
+static int parse_bool(const char *val, int *out)
+{
+	if(val == NULL || strcmp(val, "1") == 0 || strcmp(val, "yes") == 0 || strcmp(val, "true") == 0)
+		*out = 1;
+	else if(strcmp(val, "0") == 0 || strcmp(val, "no") == 0 || strcmp(val, "false") == 0)
+		*out = 0;
+	else
+		return -1;
+	return 0;
+}
+
+static int copy_str(char *dst, size_t len, const char *val)
+{
+	if(snprintf(dst, len, "%s", val) >= (int)len)
+		return -1;
+	return 0;
+}
+
+//a CPU list is checked here, it is parsed again where it is used
+static int copy_cpus(char *dst, size_t len, const char *val)
+{
+	cpu_set_t set;
+
+	if(cpu_parse(val, &set) == -1)
+		return -1;
+	return copy_str(dst, len, val);
+}
+
+//apply a single "name = value" option, @val is NULL for flags
+static int set_option(struct config *c, const char *name, const char *val)
+{
+	size_t n;
+
+	if(strcmp(name, "keep") == 0)
+		return parse_bool(val, &c->keep_data);
+	if(strcmp(name, "udp-ack") == 0)
+		return parse_bool(val, &c->udp_ack);
+	if(strcmp(name, "checksums") == 0)
+		return parse_bool(val, &c->checksums);
+	if(strcmp(name, "compress") == 0)
+		return parse_bool(val, &c->compress);
+	if(val == NULL)
+		return -1;
+
+	if(strcmp(name, "config") == 0)
+		return copy_str(c->config_file, sizeof(c->config_file), val);
+	if(strcmp(name, "port") == 0)
+		return copy_str(c->port, sizeof(c->port), val);
+	if(strcmp(name, "bind") == 0)
+		return copy_str(c->bind_addr, sizeof(c->bind_addr), val);
+	if(strcmp(name, "data-file") == 0)
+		return copy_str(c->data_file, sizeof(c->data_file), val);
+	if(strcmp(name, "backlog") == 0)
+	{
+		if(parse_size(val, &n) == -1 || n == 0 || n > 65535)
+			return -1;
+		c->backlog = n;
+		return 0;
+	}
+	if(strcmp(name, "storage") == 0)
+	{
+		if(strcmp(val, "file") == 0)
+			c->storage = STORAGE_FILE;
+		else
+			return -1;
+		return 0;
+	}
+	if(strcmp(name, "recv-size") == 0)
+	{
+		if(parse_size(val, &n) == -1 || n == 0)
+			return -1;
+		c->recv_size = n;
+		return 0;
+	}
+	if(strcmp(name, "spill-threshold") == 0)
+	{
+		if(parse_size(val, &n) == -1 || n == 0)
+			return -1;
+		c->spill_threshold = n;
+		return 0;
+	}
+	if(strcmp(name, "max-packet") == 0)
+		return parse_size(val, &c->max_packet);
+	if(strcmp(name, "replay-quantum") == 0)
+	{
+		if(parse_size(val, &n) == -1 || n == 0)
+			return -1;
+		c->replay_quantum = n;
+		return 0;
+	}
+	if(strcmp(name, "zerocopy") == 0)
+		return parse_size(val, &c->zerocopy);
+	if(strcmp(name, "replay-cache") == 0)
+		return parse_size(val, &c->replay_cache);
+	if(strcmp(name, "idle-timeout") == 0)
+		return parse_size(val, &c->idle_timeout);
+	if(strcmp(name, "header-timeout") == 0)
+		return parse_size(val, &c->header_timeout);
+	if(strcmp(name, "stall-timeout") == 0)
+		return parse_size(val, &c->stall_timeout);
+	if(strcmp(name, "max-connections") == 0)
+		return parse_size(val, &c->max_connections);
+	if(strcmp(name, "memory-budget") == 0)
+		return parse_size(val, &c->memory_budget);
+	if(strcmp(name, "rate-bytes") == 0)
+		return parse_size(val, &c->rate_bytes);
+	if(strcmp(name, "rate-packets") == 0)
+		return parse_size(val, &c->rate_packets);
+	if(strcmp(name, "log") == 0)
+		return copy_str(c->log_target, sizeof(c->log_target), val);
+	if(strcmp(name, "capture") == 0)
+		return copy_str(c->capture_path, sizeof(c->capture_path), val);
+	if(strcmp(name, "workers") == 0)
+	{
+		if(parse_size(val, &n) == -1 || n > 256)
+			return -1;
+		c->workers = n;
+		return 0;
+	}
+	if(strcmp(name, "worker-cpus") == 0)
+		return copy_cpus(c->worker_cpus, sizeof(c->worker_cpus), val);
+	if(strcmp(name, "acceptor-cpus") == 0)
+		return copy_cpus(c->acceptor_cpus, sizeof(c->acceptor_cpus), val);
+	if(strcmp(name, "background-cpus") == 0)
+		return copy_cpus(c->background_cpus, sizeof(c->background_cpus), val);
+	if(strcmp(name, "log-level") == 0)
+	{
+		if(strcmp(val, "error") == 0)
+			c->log_level = LEVEL_ERROR;
+		else if(strcmp(val, "warn") == 0)
+			c->log_level = LEVEL_WARN;
+		else if(strcmp(val, "info") == 0)
+			c->log_level = LEVEL_INFO;
+		else if(strcmp(val, "debug") == 0)
+			c->log_level = LEVEL_DEBUG;
+		else
+			return -1;
+		return 0;
+	}
+	if(strcmp(name, "durability") == 0)
+	{
+		if(strcmp(val, "none") == 0)
+			c->durability = DURABILITY_NONE;
+		else if(strcmp(val, "commit") == 0)
+			c->durability = DURABILITY_COMMIT;
+		else if(strcmp(val, "journal") == 0)
+			c->durability = DURABILITY_JOURNAL;
+		else
+			return -1;
+		return 0;
+	}
+	if(strcmp(name, "feed-size") == 0)
+	{
+		if(parse_size(val, &n) == -1 || n == 0)
+			return -1;
+		c->feed_size = n;
+		return 0;
+	}
+	if(strcmp(name, "subscriber-max-lag") == 0)
+		return parse_size(val, &c->subscriber_max_lag);
+	if(strcmp(name, "subscriber-policy") == 0)
+	{
+		if(strcmp(val, "drop") == 0)
+			c->subscriber_policy = SUBSCRIBER_DROP;
+		else if(strcmp(val, "disconnect") == 0)
+			c->subscriber_policy = SUBSCRIBER_DISCONNECT;
+		else
+			return -1;
+		return 0;
+	}
+	if(strcmp(name, "udp-port") == 0)
+		return copy_str(c->udp_port, sizeof(c->udp_port), val);
+	if(strcmp(name, "unix") == 0)
+		return copy_str(c->unix_path, sizeof(c->unix_path), val);
+	if(strcmp(name, "unix-seqpacket") == 0)
+		return copy_str(c->unix_seqpacket_path, sizeof(c->unix_seqpacket_path), val);
+	if(strcmp(name, "shm") == 0)
+		return copy_str(c->shm_path, sizeof(c->shm_path), val);
+	if(strcmp(name, "shm-size") == 0)
+	{
+		//records are addressed with a mask, and a page is the least mmap() gives
+		if(parse_size(val, &n) == -1 || n < 4096 || n > (1UL << 30) || (n & (n - 1)))
+			return -1;
+		c->shm_size = n;
+		return 0;
+	}
+	if(strcmp(name, "udp-batch") == 0)
+	{
+		if(parse_size(val, &n) == -1 || n == 0 || n > 1024)
+			return -1;
+		c->udp_batch = n;
+		return 0;
+	}
+	if(strcmp(name, "udp-size") == 0)
+	{
+		if(parse_size(val, &n) == -1 || n == 0 || n > 65535)
+			return -1;
+		c->udp_size = n;
+		return 0;
+	}
+	if(strcmp(name, "max-channels") == 0)
+		return parse_size(val, &c->max_channels);
+	if(strcmp(name, "retention") == 0)
+	{
+		const char *colon = strchr(val, ':');
+		struct retention_rule *r;
+
+		if(colon == NULL)
+			return parse_size(val, &c->retention);
+		if(c->retention_rule_count == MAX_RETENTION_RULES ||
+		   colon - val > (int)sizeof(r->channel) - 1)
+			return -1;
+		r = &c->retention_rules[c->retention_rule_count];
+		memcpy(r->channel, val, colon - val);
+		r->channel[colon - val] = '\0';
+		if(parse_size(colon + 1, &r->bytes) == -1)
+			return -1;
+		c->retention_rule_count++;
+		return 0;
+	}
+	return -1;
+}
+
+static char *trim(char *s)
+{
+	char *end;
+
+	while(isspace((unsigned char)*s))
+		s++;
+	end = s + strlen(s);
+	while(end > s && isspace((unsigned char)end[-1]))
+		*--end = '\0';
+	return s;
+}
+
+static int config_read_file(struct config *c, const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char *line = NULL;
+	size_t cap = 0;
+	int lineno = 0, ret = 0;
+
+	if(f == NULL)
+	{
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	while(getline(&line, &cap, f) != -1)
+	{
+		char *hash, *eq, *name, *val = NULL;
+
+		lineno++;
+		if((hash = strchr(line, '#')) != NULL)
+			*hash = '\0';
+		name = trim(line);
+		if(*name == '\0')
+			continue;
+		if((eq = strchr(name, '=')) != NULL)
+		{
+			*eq = '\0';
+			val = trim(eq + 1);
+			name = trim(name);
+		}
+		//a config file naming another config file would be confusing
+		if(strcmp(name, "config") == 0 || set_option(c, name, val) == -1)
+		{
+			fprintf(stderr, "%s:%d: invalid option '%s'\n", path, lineno, name);
+			ret = -1;
+		}
+	}
+	free(line);
+	fclose(f);
+	return ret;
+}
+
+static int config_parse(struct config *c, int argc, char *argv[])
+{
+	int opt, idx;
+
+	config_defaults(c);
+
+	//find the config file first so the command line can override it
+	optind = 1;
+	opterr = 0;
+	while((opt = getopt_long(argc, argv, "c:p:b:f:kt:u:", long_options, &idx)) != -1)
+	{
+		if(opt == 'c')
+			copy_str(c->config_file, sizeof(c->config_file), optarg);
+	}
+	if(c->config_file[0] != '\0' && config_read_file(c, c->config_file) == -1)
+		return -1;
+
+	optind = 1;
+	opterr = 1;
+	while((opt = getopt_long(argc, argv, "c:p:b:f:kt:u:", long_options, &idx)) != -1)
+	{
+		const char *name = NULL;
+		int i;
+
+		if(opt == '?')
+			return -1;
+		if(opt == 0)
+			name = long_options[idx].name;
+		for(i = 0; name == NULL && long_options[i].name != NULL; i++)
+		{
+			if(long_options[i].val == opt)
+				name = long_options[i].name;
+		}
+		if(name == NULL || set_option(c, name, optarg) == -1)
+		{
+			fprintf(stderr, "%s: invalid value for --%s\n", argv[0], name ? name : "?");
+			return -1;
+		}
+	}
+	if(optind < argc)
+	{
+		fprintf(stderr, "%s: unexpected argument '%s'\n", argv[0], argv[optind]);
+		return -1;
+	}
+	return 0;
+}
+
+int config_load(struct config *c, int argc, char *argv[])
+{
+	if(config_parse(c, argc, argv) == -1)
+	{
+		config_usage(argv[0]);
+		return -1;
+	}
+	return 0;
+}
+
+int config_reload(int argc, char *argv[])
+{
+	struct config *cur = &CFG, *c, n;
+
+	if(config_parse(&n, argc, argv) == -1)
+		return -1;
+	if((c = malloc(sizeof(*c))) == NULL)
+		return -1;
+	//what needs a restart keeps its current value
+	*c = *cur;
+	c->log_level = n.log_level;
+	c->recv_size = n.recv_size;
+	c->spill_threshold = n.spill_threshold;
+	c->max_packet = n.max_packet;
+	c->replay_quantum = n.replay_quantum;
+	c->zerocopy = n.zerocopy;
+	c->replay_cache = n.replay_cache;
+	c->idle_timeout = n.idle_timeout;
+	c->header_timeout = n.header_timeout;
+	c->stall_timeout = n.stall_timeout;
+	c->max_connections = n.max_connections;
+	c->memory_budget = n.memory_budget;
+	c->rate_bytes = n.rate_bytes;
+	c->rate_packets = n.rate_packets;
+	c->durability = n.durability;
+	c->subscriber_max_lag = n.subscriber_max_lag;
+	c->subscriber_policy = n.subscriber_policy;
+	c->max_channels = n.max_channels;
+	c->retention = n.retention;
+	memcpy(c->retention_rules, n.retention_rules, sizeof(n.retention_rules));
+	c->retention_rule_count = n.retention_rule_count;
+	c->replaced = cur;
+	c->generation = atomic_load(&generation) + 1;
+	//a thread that notes the new generation reads the new options from
+	//then on
+	atomic_store(&config_current, c);
+	atomic_store(&generation, c->generation);
+	return 0;
+}
+
+uint64_t config_generation(void)
+{
+	return atomic_load(&generation);
+}
+
+void config_release(uint64_t seen)
+{
+	struct config *c, *old;
+
+	//every thread got as far as @c, which leaves what it replaced unread
+	for(c = &CFG; c->replaced != NULL && c->generation > seen; c = c->replaced)
+		;
+	old = c->replaced;
+	c->replaced = NULL;
+	while(old != NULL)
+	{
+		c = old->replaced;
+		if(old != &loaded)
+			free(old);
+		old = c;
+	}
+}
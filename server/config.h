@@ -0,0 +1,147 @@
+#ifndef AESD_CONFIG_H
+#define AESD_CONFIG_H
+
+#include <limits.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum storage {
+	STORAGE_FILE,
+};
+
+enum subscriber_policy {
+	SUBSCRIBER_DROP,	//skip a lagging subscriber ahead to the newest packet
+	SUBSCRIBER_DISCONNECT,	//close a lagging subscriber
+};
+
+enum durability {
+	DURABILITY_NONE,	//leave writeback to the kernel
+	DURABILITY_COMMIT,	//fdatasync() every committed packet
+	DURABILITY_JOURNAL,	//write every packet to an O_DIRECT journal first
+};
+
+//per-channel override of the retention limit
+struct retention_rule {
+	char channel[64 + 1];
+	size_t bytes;
+};
+
+#define MAX_RETENTION_RULES 32
+
+/**
+ * Server options. Everything can be given on the command line as
+ * --name=value or in the config file as "name = value"; command-line
+ * values win. Only the fields below "reloadable" are picked up again
+ * when the server receives SIGHUP, the others need a restart.
+ */
+struct config {
+	char config_file[PATH_MAX];
+	char port[16];
+	char bind_addr[64];
+	int backlog;
+	char data_file[PATH_MAX];
+	int keep_data;
+	enum storage storage;
+	size_t feed_size;
+	char udp_port[16];
+	size_t udp_batch;
+	size_t udp_size;
+	int udp_ack;
+	char unix_path[108];
+	char unix_seqpacket_path[108];
+	char shm_path[108];
+	size_t shm_size;
+	int checksums;
+	int compress;
+	char log_target[PATH_MAX];
+	char capture_path[PATH_MAX];
+	size_t workers;
+	//CPU lists as given, "" when not
+	char worker_cpus[128];
+	char acceptor_cpus[128];
+	char background_cpus[128];
+
+	//reloadable
+	int log_level;
+	size_t recv_size;
+	size_t spill_threshold;
+	size_t max_packet;
+	size_t replay_quantum;
+	size_t zerocopy;
+	size_t replay_cache;
+	size_t idle_timeout;
+	size_t header_timeout;
+	size_t stall_timeout;
+	size_t max_connections;
+	size_t memory_budget;
+	size_t rate_bytes;
+	size_t rate_packets;
+	enum durability durability;
+	size_t subscriber_max_lag;
+	enum subscriber_policy subscriber_policy;
+	size_t max_channels;
+	size_t retention;
+	struct retention_rule retention_rules[MAX_RETENTION_RULES];
+	int retention_rule_count;
+
+	//the options this reload replaced, until no thread can be reading them
+	struct config *replaced;
+	//config_generation() once it was published
+	uint64_t generation;
+};
+
+/*********************************************************************
+The options in effect, read as CFG.name. A reload never writes to them:
+it builds a new struct config and publishes it with one atomic store, so
+a thread sees either the old options or the new ones and never a mix of
+both. Options that belong together, such as the retention rules and
+their count, are read through one &CFG taken once.
+
+A replaced config is freed once no thread can be reading it. Every
+reload counts one config_generation(); a thread that reads options
+notes the generation at points where it holds no pointer into them,
+its quiescent points, and the main thread, which reloads, frees what
+was replaced before the oldest generation any thread noted (see
+config_release()). Workers pass one every round of their loop and
+while they wait for events, so a pointer to the options must not be
+kept across that.
+**********************************************************************/
+extern struct config *_Atomic config_current;
+#define CFG (*atomic_load(&config_current))
+
+/**
+ * Fill @param c from the defaults, the config file and @param argv.
+ * @return 0 on success, -1 after printing a message on a bad option.
+ */
+int config_load(struct config *c, int argc, char *argv[]);
+
+/**
+ * Re-read the options and publish a copy of the current ones with the
+ * reloadable options replaced, see config_current.
+ * @return 0 on success, -1 (keeping the current options) on a bad option
+ * or with errno set if out of memory.
+ */
+int config_reload(int argc, char *argv[]);
+
+/**
+ * @return the number of reloads so far.
+ */
+uint64_t config_generation(void);
+
+/**
+ * Free the configs replaced up to reload @param seen, the oldest
+ * config_generation() any thread reading options may still be at.
+ * Main thread only.
+ */
+void config_release(uint64_t seen);
+
+void config_usage(const char *prog);
+
+/**
+ * @return the retention limit in bytes for @param channel in @param c,
+ * 0 if unlimited.
+ */
+size_t config_retention(const struct config *c, const char *channel);
+
+#endif
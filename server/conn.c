@@ -0,0 +1,1737 @@
+#define _GNU_SOURCE
+#include "conn.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "admit.h"
+#include "capture.h"
+#include "config.h"
+#include "coro.h"
+#include "log.h"
+#include "lz4.h"
+#include "mem.h"
+#include "probe.h"
+#include "query.h"
+#include "udp.h"
+#include "upgrade.h"
+#include "worker.h"
+
+//room left in front of a compressed block for its frame line
+#define FRAME_HDR_MAX 64
+//send buffer of a binary connection, reply_frame() grows it for longer
+//frames
+#define BINARY_SBUF_MIN (FRAME_HDR + 512)
+//room for the STATS counters, see stats_text()
+#define STATS_MAX 1024
+
+#define sub_conn(s) ((struct conn *)((char *)(s) - offsetof(struct conn, sub)))
+#define timer_conn(t) ((struct conn *)((char *)(t) - offsetof(struct conn, timer)))
+
+//the connections of the calling thread, which alone runs them: with
+//--workers every worker has its own list, timers and run queue
+static __thread struct conn *conns;
+static __thread struct wheel timers;
+//connections that used up their quantum with more left to send
+static __thread struct conn *run_queue;
+static __thread struct conn **run_tail;
+static __thread size_t run_count;
+//connections of all threads
+static _Atomic size_t nconns;
+
+static void conn_reader(void *arg);
+static void reader_yield(struct conn *c, int idle);
+
+static void run_queue_add(struct conn *c)
+{
+	if(c->queued)
+		return;
+	if(run_tail == NULL)
+		run_tail = &run_queue;
+	c->run_next = NULL;
+	c->run_pprev = run_tail;
+	*run_tail = c;
+	run_tail = &c->run_next;
+	c->queued = 1;
+	run_count++;
+}
+
+static void run_queue_remove(struct conn *c)
+{
+	if(!c->queued)
+		return;
+	*c->run_pprev = c->run_next;
+	if(c->run_next != NULL)
+		c->run_next->run_pprev = c->run_pprev;
+	else
+		run_tail = c->run_pprev;
+	c->queued = 0;
+	run_count--;
+}
+
+static int conn_busy(const struct conn *c)
+{
+	return c->sbuf_off < c->sbuf_len || c->zc.cur != NULL || rchain_busy(&c->chain) ||
+		c->out_head < c->out_count ||
+		(c->subscribed && c->sub.cursor < c->ch->feed.end);
+}
+
+/*********************************************************************
+When the connection times out, 0 if it cannot: a client owes either the
+reading of its replies, the rest of a packet it started or, unless it
+is a subscriber waiting for packets, anything at all. Nothing is owed
+while the connection waits for its turn in the run queue, or for its
+rate limit pause to end; that deadline comes with a NULL @why.
+**********************************************************************/
+static uint64_t conn_deadline(const struct conn *c, const char **why)
+{
+	if(c->queued)
+		return 0;
+	if(conn_busy(c))
+	{
+		*why = "stopped reading";
+		return CFG.stall_timeout ? c->active_at + CFG.stall_timeout * 1000 : 0;
+	}
+	if(c->paused_until)
+	{
+		*why = NULL;
+		return c->paused_until;
+	}
+	if(c->len > 0 || c->stage.fd != -1 || c->frame_got > 0)
+	{
+		*why = "left a packet unfinished";
+		return CFG.header_timeout ? c->packet_at + CFG.header_timeout * 1000 : 0;
+	}
+	*why = "was idle";
+	return CFG.idle_timeout && !c->subscribed && !c->eof ? c->active_at + CFG.idle_timeout * 1000 : 0;
+}
+
+static void conn_arm(struct conn *c)
+{
+	const char *why;
+	uint64_t at = conn_deadline(c, &why);
+
+	if(at == 0)
+	{
+		timer_cancel(&timers, &c->timer);
+		return;
+	}
+	if(timers.tick == 0)
+		wheel_init(&timers);
+	timer_set(&timers, &c->timer, at);
+}
+
+//grow or shrink a buffer of @c from @old to @len bytes, charged to the
+//budget and to the connection
+static void *conn_realloc(struct conn *c, enum mem_use use, void *p, size_t old, size_t len)
+{
+	void *n = mem_realloc(use, p, old, len);
+
+	if(n != NULL)
+		c->mem += len - old;
+	return n;
+}
+
+//make room for @len bytes in buffer @p of @cap bytes
+static int conn_fit(struct conn *c, enum mem_use use, char **p, size_t *cap, size_t len)
+{
+	char *n;
+
+	if(len <= *cap)
+		return 0;
+	if((n = conn_realloc(c, use, *p, *cap, len)) == NULL)
+		return -1;
+	*p = n;
+	*cap = len;
+	return 0;
+}
+
+//free the buffers of @c, giving their memory back to the budget
+static void conn_release(struct conn *c)
+{
+	mem_free(MEM_RECV, c->in, c->in_cap);
+	mem_free(MEM_PACKET, c->buf, c->cap);
+	mem_free(MEM_REPLY, c->out, c->out_cap * sizeof(*c->out));
+	mem_free(MEM_REPLY, c->sbuf, c->sbuf_cap);
+	mem_free(MEM_REPLY, c->zraw, SEGMENT_SIZE);
+	zcopy_free(&c->zc);
+	rchain_drop(&c->chain);
+	if(c->scanning)
+		query_scan_free(&c->scan);
+	query_free(&c->query);
+}
+
+//memory is short: give back the packet buffer between packets
+static void conn_trim(struct conn *c)
+{
+	if(c->buf == NULL || c->len > 0 || c->frame_got > 0)
+		return;
+	mem_free(MEM_PACKET, c->buf, c->cap);
+	c->mem -= c->cap;
+	c->buf = NULL;
+	c->cap = 0;
+}
+
+struct conn *conn_new(int epfd, int fd, const char *addr)
+{
+	struct conn *c = calloc(1, sizeof(*c));
+
+	if(c == NULL)
+		goto fail;
+	c->source = SOURCE_CONN;
+	c->id = capture_conn_id();
+	c->worker = worker_self();
+	c->fd = fd;
+	c->epfd = epfd;
+	c->stage.fd = -1;
+	c->deficit = CFG.replay_quantum;
+	c->active_at = timer_now();
+	if((c->ch = channel_get("")) == NULL)
+		goto fail;
+	snprintf(c->addr, sizeof(c->addr), "%s", addr);
+	if((c->in = conn_realloc(c, MEM_RECV, NULL, 0, CFG.recv_size)) != NULL)
+		c->in_cap = CFG.recv_size;
+	if((c->sbuf = conn_realloc(c, MEM_REPLY, NULL, 0, CFG.recv_size)) != NULL)
+		c->sbuf_cap = CFG.recv_size;
+	if(c->in == NULL || c->sbuf == NULL)
+		goto fail;
+	if((c->reader = coro_new(conn_reader, c)) == NULL)
+		goto fail;
+
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+		goto fail;
+	c->events = EPOLLIN;
+	conn_arm(c);
+
+	c->next = conns;
+	c->pprev = &conns;
+	if(conns != NULL)
+		conns->pprev = &c->next;
+	conns = c;
+	nconns++;
+	capture_event(CAPTURE_OPEN, c->id, NULL, 0);
+	PROBE1(accept, c->id);
+	return c;
+fail:
+	log_error("connection setup: %m");
+	if(c != NULL)
+	{
+		coro_free(c->reader);
+		conn_release(c);
+		free(c);
+	}
+	close(fd);
+	return NULL;
+}
+
+void conn_free(struct conn *c)
+{
+	log_info("Closed connection from %s", c->addr);
+	if(c->subscribed)
+	{
+		channel_lock(c->ch);
+		feed_unsubscribe(&c->sub);
+		channel_unlock(c->ch);
+	}
+	worker_unkick(c);
+	run_queue_remove(c);
+	timer_cancel(&timers, &c->timer);
+	*c->pprev = c->next;
+	if(c->next != NULL)
+		c->next->pprev = c->pprev;
+	nconns--;
+	capture_event(CAPTURE_CLOSE, c->id, NULL, 0);
+	PROBE1(close, c->id);
+	//closing the socket leaves it in the epoll set while another process
+	//holds it too, as a server being started for an upgrade does
+	epoll_ctl(c->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	stage_close(&c->stage);
+	coro_free(c->reader);
+	conn_release(c);
+	free(c);
+}
+
+void conn_free_all(void)
+{
+	while(conns != NULL)
+		conn_free(conns);
+}
+
+//make room for @need bytes of the current packet in memory
+static int conn_grow(struct conn *c, size_t need)
+{
+	if(need <= c->cap)
+		return 0;
+
+	size_t cap = c->cap ? c->cap : CFG.recv_size;
+	while(cap < need)
+		cap *= 2;
+	if(cap > CFG.spill_threshold)
+		cap = CFG.spill_threshold;
+	char *nbuf = conn_realloc(c, MEM_PACKET, c->buf, c->cap, cap);
+	if(nbuf == NULL)
+		return -1;
+	c->buf = nbuf;
+	c->cap = cap;
+	return 0;
+}
+
+//keep @len more bytes of the current packet, spilling to disk when needed
+static int conn_hold(struct conn *c, const char *data, size_t len)
+{
+	if(CFG.max_packet && c->len + c->stage.len + len > CFG.max_packet)
+	{
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if(c->stage.fd != -1)
+		return stage_write(&c->stage, data, len);
+
+	//past the threshold or the memory budget the packet goes to disk
+	if(c->len + len > CFG.spill_threshold || conn_grow(c, c->len + len) == -1)
+	{
+		log_debug("packet of %zu bytes does not fit in memory, spilling to disk", c->len + len);
+		if(stage_open(&c->stage, &c->ch->st) == -1)
+			return -1;
+		if(stage_write(&c->stage, c->buf, c->len) == -1)
+			return -1;
+		c->len = 0;
+		return stage_write(&c->stage, data, len);
+	}
+	memcpy(c->buf + c->len, data, len);
+	c->len += len;
+	return 0;
+}
+
+//store a packet held in memory and hand it to the subscribers
+static int commit_packet(struct conn *c, const char *data, size_t len)
+{
+	struct channel *ch = c->ch;
+
+	channel_lock(ch);
+	PROBE2(append_start, c->id, len);
+	if(store_append(&ch->st, data, len) == -1)
+	{
+		channel_unlock(ch);
+		return -1;
+	}
+	PROBE2(append_end, c->id, ch->st.committed);
+	feed_publish(&ch->feed, data, len);
+	channel_retain(ch);
+	channel_unlock(ch);
+	feed_notify(ch);
+	return 0;
+}
+
+//the packet ends with the @len bytes at @data (including the '\n'),
+//returns 1 instead of storing it when the packet is a query
+static int conn_commit(struct conn *c, const char *data, size_t len, struct query *q)
+{
+	struct channel *ch = c->ch;
+
+	if(c->stage.fd != -1)
+	{
+		capture_event(CAPTURE_PACKET, c->id, NULL, c->stage.len + len);
+		channel_lock(ch);
+		off_t before = ch->st.committed;
+		PROBE2(append_start, c->id, c->stage.len + len);
+		int rc = store_commit_stage(&ch->st, &c->stage, data, len);
+		if(rc == 0)
+		{
+			PROBE2(append_end, c->id, ch->st.committed);
+			feed_skip(&ch->feed, ch->st.committed - before);
+			channel_retain(ch);
+		}
+		channel_unlock(ch);
+		stage_close(&c->stage);
+		if(rc == 0)
+			feed_notify(ch);
+		return rc;
+	}
+	if(c->len == 0)
+	{
+		if(query_parse(q, data, len))
+		{
+			capture_event(CAPTURE_QUERY, c->id, data, len);
+			return 1;
+		}
+		capture_event(CAPTURE_PACKET, c->id, NULL, len);
+		return commit_packet(c, data, len);
+	}
+	if(conn_hold(c, data, len) == -1)
+		return -1;
+	if(c->stage.fd != -1)
+	{
+		//the tail itself pushed the packet over the threshold
+		return conn_commit(c, "", 0, q);
+	}
+	size_t plen = c->len;
+	c->len = 0;
+	if(query_parse(q, c->buf, plen))
+	{
+		capture_event(CAPTURE_QUERY, c->id, c->buf, plen);
+		return 1;
+	}
+	capture_event(CAPTURE_PACKET, c->id, NULL, plen);
+	return commit_packet(c, c->buf, plen);
+}
+
+//queue log bytes [from, to) as the next part of the reply
+static int queue_range(void *arg, off_t from, off_t to)
+{
+	struct conn *c = arg;
+
+	if(c->out_count == 0)
+		PROBE2(replay_start, c->id, to - from);
+	if(c->out_count == c->out_cap)
+	{
+		size_t cap = c->out_cap ? c->out_cap * 2 : 4;
+		struct range *n = conn_realloc(c, MEM_REPLY, c->out, c->out_cap * sizeof(*n), cap * sizeof(*n));
+		if(n == NULL)
+			return -1;
+		c->out = n;
+		c->out_cap = cap;
+	}
+	c->out[c->out_count].from = from;
+	c->out[c->out_count].to = to;
+	c->out_count++;
+	if(from != RANGE_END)
+		c->replay_bytes += to - from;
+	return 0;
+}
+
+//reply with a fixed message instead of log data, the send buffer grows
+//to hold all of it
+static int reply_text(struct conn *c, const char *msg)
+{
+	size_t len = strlen(msg);
+
+	if(conn_fit(c, MEM_REPLY, &c->sbuf, &c->sbuf_cap, len) == -1)
+		return -1;
+	memcpy(c->sbuf, msg, len);
+	c->sbuf_off = 0;
+	c->sbuf_len = len;
+	return 0;
+}
+
+//reply with one binary frame carrying @len bytes of @payload
+static int reply_frame(struct conn *c, enum frame_op op, const char *payload, size_t len)
+{
+	if(conn_fit(c, MEM_REPLY, &c->sbuf, &c->sbuf_cap, FRAME_HDR + len) == -1)
+		return -1;
+	frame_put(c->sbuf, op, len);
+	memcpy(c->sbuf + FRAME_HDR, payload, len);
+	c->sbuf_off = 0;
+	c->sbuf_len = FRAME_HDR + len;
+	return 0;
+}
+
+//reply with a frame holding a packet number and a log offset, it always
+//fits in the BINARY_SBUF_MIN bytes of a binary connection
+static void reply_pos(struct conn *c, enum frame_op op, uint64_t packet, uint64_t off)
+{
+	char payload[16];
+
+	frame_put64(payload, packet);
+	frame_put64(payload + 8, off);
+	reply_frame(c, op, payload, sizeof(payload));
+}
+
+//switch replies to LZ4 frames, the send buffer grows to hold a segment's
+static int conn_compress(struct conn *c, int on)
+{
+	size_t cap = FRAME_HDR_MAX + lz4_bound(SEGMENT_SIZE);
+	char *sbuf;
+
+	if(!on || c->compressed)
+	{
+		c->compressed = on;
+		return 0;
+	}
+	if(c->zraw == NULL && (c->zraw = conn_realloc(c, MEM_REPLY, NULL, 0, SEGMENT_SIZE)) == NULL)
+		return -1;
+	if(c->sbuf_cap < cap)
+	{
+		if((sbuf = conn_realloc(c, MEM_REPLY, c->sbuf, c->sbuf_cap, cap)) == NULL)
+			return -1;
+		c->sbuf = sbuf;
+		c->sbuf_cap = cap;
+	}
+	c->compressed = 1;
+	return 0;
+}
+
+/*********************************************************************
+Put the @len log bytes at @off into @c->sbuf as one frame, the line
+AESDSOCKET_LZ4:<len>:<block length> and the LZ4 block. A sealed segment
+goes out as the block already on disk, anything else is compressed here.
+@return @len, -1 on error.
+**********************************************************************/
+static ssize_t zip_frame(struct conn *c, struct store *st, off_t off, size_t len)
+{
+	char *block = c->sbuf + FRAME_HDR_MAX, line[FRAME_HDR_MAX];
+	size_t cap = c->sbuf_cap - FRAME_HDR_MAX, got = 0;
+	ssize_t blen = store_read_block(st, off, len, block, cap);
+
+	if(blen == -1)
+		return -1;
+	if(blen == 0)
+	{
+		while(got < len)
+		{
+			ssize_t rd = store_read(st, c->zraw + got, len - got, off + got);
+			if(rd <= 0)
+			{
+				if(rd == 0)
+					errno = EIO;
+				return -1;
+			}
+			got += rd;
+		}
+		blen = lz4_compress(c->zraw, len, block, cap);
+	}
+	int n = snprintf(line, sizeof(line), QUERY_PREFIX "LZ4:%zu:%zd\n", len, blen);
+	c->sbuf_off = FRAME_HDR_MAX - n;
+	memcpy(c->sbuf + c->sbuf_off, line, n);
+	c->sbuf_len = FRAME_HDR_MAX + blen;
+	return len;
+}
+
+//move the connection, and its subscription, to another channel
+static int switch_channel(struct conn *c, const char *name)
+{
+	struct channel *ch = channel_get(name);
+
+	if(ch == NULL)
+	{
+		log_error("channel: %m");
+		return reply_text(c, errno == EMFILE ? QUERY_PREFIX "ERROR:too many channels\n" :
+				  QUERY_PREFIX "ERROR:bad channel\n");
+	}
+	if(ch == c->ch)
+		return 0;
+	if(c->subscribed)
+	{
+		channel_lock(c->ch);
+		feed_unsubscribe(&c->sub);
+		channel_unlock(c->ch);
+		channel_lock(ch);
+		feed_subscribe(&ch->feed, &c->sub);
+		channel_unlock(ch);
+	}
+	log_info("%s switched to channel '%s'", c->addr, ch->name);
+	c->ch = ch;
+	return 0;
+}
+
+//switch to binary framing, the send buffer grows to hold any reply frame
+static int conn_binary(struct conn *c)
+{
+	char *sbuf;
+
+	if(c->sbuf_cap < BINARY_SBUF_MIN)
+	{
+		if((sbuf = conn_realloc(c, MEM_REPLY, c->sbuf, c->sbuf_cap, BINARY_SBUF_MIN)) == NULL)
+			return -1;
+		c->sbuf = sbuf;
+		c->sbuf_cap = BINARY_SBUF_MIN;
+	}
+	//DATA frames carry raw packets
+	c->compressed = 0;
+	c->binary = 1;
+	return 0;
+}
+
+//the counters reported by AESDSOCKET_STATS and the STATS frame, at most
+//STATS_MAX - 1 bytes of them even with every counter at its largest
+static int stats_text(char *buf, size_t len)
+{
+	return snprintf(buf, len, "connections=%zu accepted=%llu rejected=%llu "
+			"throttled=%llu throttled_ms=%llu dropped_packets=%llu dropped_bytes=%llu "
+			"mem=%zu mem_budget=%zu mem_peak=%zu mem_recv=%zu mem_packet=%zu mem_reply=%zu "
+			"mem_cache=%zu mem_refused=%llu mem_paused=%llu cache_hits=%llu cache_misses=%llu "
+			"udp_dropped=%llu",
+			atomic_load(&nconns), (unsigned long long)admit_stats.accepted,
+			(unsigned long long)admit_stats.rejected, (unsigned long long)admit_stats.throttled,
+			(unsigned long long)admit_stats.throttled_ms,
+			(unsigned long long)admit_stats.dropped_packets,
+			(unsigned long long)admit_stats.dropped_bytes,
+			atomic_load(&mem_stats.total), CFG.memory_budget, atomic_load(&mem_stats.peak),
+			atomic_load(&mem_stats.used[MEM_RECV]), atomic_load(&mem_stats.used[MEM_PACKET]),
+			atomic_load(&mem_stats.used[MEM_REPLY]), atomic_load(&mem_stats.used[MEM_CACHE]),
+			(unsigned long long)atomic_load(&mem_stats.refused),
+			(unsigned long long)atomic_load(&mem_stats.paused),
+			(unsigned long long)atomic_load(&rcache_stats.hits),
+			(unsigned long long)atomic_load(&rcache_stats.misses),
+			(unsigned long long)atomic_load(&udp_stats.dropped));
+}
+
+//stop reading from a client for @wait ms
+static void conn_delay(struct conn *c, uint64_t wait)
+{
+	c->paused_until = timer_now() + wait;
+	//the pause is ours, it does not count against finishing the packet
+	c->packet_at += wait;
+}
+
+//stop reading from a client that went over its rate limits for @wait ms
+static void conn_pause(struct conn *c, uint64_t wait)
+{
+	if(wait == 0)
+		return;
+	//the wheel cannot wake it any sooner, the buckets make up for it
+	if(wait < TIMER_TICK_MS)
+		wait = TIMER_TICK_MS;
+	conn_delay(c, wait);
+	admit_stats.throttled++;
+	admit_stats.throttled_ms += wait;
+}
+
+/*********************************************************************
+GREP and REGEX read the whole log, so they run a block per step with
+the channel unlocked in between, appends and the other connections of
+the channel do not wait for the scan. The bytes searched are charged
+to the deficit like those of a reply, once the turn is used up the
+reader waits in the run queue for the next one. Matches are queued as
+they are found and go out while the scan goes on.
+**********************************************************************/
+static int scan_run(struct conn *c)
+{
+	struct channel *ch = c->ch;
+	ssize_t n;
+
+	do
+	{
+		while(c->deficit <= 0)
+		{
+			run_queue_add(c);
+			reader_yield(c, 0);
+		}
+		channel_lock(ch);
+		n = query_scan_step(&c->scan, &ch->st);
+		channel_unlock(ch);
+		c->deficit -= n;
+	} while(n > 0);
+	c->scanning = 0;
+	query_scan_free(&c->scan);
+	return n;
+}
+
+static int scan_query(struct conn *c, const struct query *q)
+{
+	int rc;
+
+	channel_lock(c->ch);
+	rc = query_scan_start(&c->scan, q, &c->ch->st, queue_range, c);
+	channel_unlock(c->ch);
+	if(rc == -1)
+		return -1;
+	c->scanning = 1;
+	return scan_run(c);
+}
+
+//queue the reply to a query packet instead of storing it
+static int answer_query(struct conn *c, struct query *q)
+{
+	struct channel *ch = c->ch;
+	int rc = 0;
+
+	switch(q->type)
+	{
+	case QUERY_INVALID:
+		rc = reply_text(c, QUERY_PREFIX "ERROR:bad command\n");
+		break;
+	case QUERY_SUBSCRIBE:
+		if(!c->subscribed)
+		{
+			channel_lock(ch);
+			log_info("%s subscribed at offset %llu", c->addr, (unsigned long long)ch->feed.end);
+			feed_subscribe(&ch->feed, &c->sub);
+			channel_unlock(ch);
+			c->subscribed = 1;
+		}
+		break;
+	case QUERY_CHANNEL:
+		rc = switch_channel(c, q->pattern);
+		break;
+	case QUERY_STATS:
+	{
+		char stats[STATS_MAX], msg[STATS_MAX + 32];
+		stats_text(stats, sizeof(stats));
+		snprintf(msg, sizeof(msg), QUERY_PREFIX "STATS:%s\n", stats);
+		rc = reply_text(c, msg);
+		break;
+	}
+	case QUERY_BINARY:
+		//pushed packets go out unframed
+		if(c->subscribed)
+		{
+			rc = reply_text(c, QUERY_PREFIX "ERROR:bad command\n");
+			break;
+		}
+		if(conn_binary(c) == -1)
+		{
+			log_error("binary: %m");
+			rc = reply_text(c, QUERY_PREFIX "ERROR:out of memory\n");
+			break;
+		}
+		channel_lock(ch);
+		reply_pos(c, FRAME_OK, ch->st.idx.count, ch->st.committed);
+		channel_unlock(ch);
+		break;
+	case QUERY_COMPRESS:
+		if(conn_compress(c, q->a) == -1)
+		{
+			log_error("compress: %m");
+			rc = reply_text(c, QUERY_PREFIX "ERROR:out of memory\n");
+		}
+		break;
+	case QUERY_GREP:
+	case QUERY_REGEX:
+		rc = scan_query(c, q);
+		break;
+	default:
+		channel_lock(ch);
+		rc = query_run(q, &ch->st, queue_range, c);
+		channel_unlock(ch);
+		break;
+	}
+	query_free(q);
+	return rc;
+}
+
+//first packet boundary at or after log offset @off
+static uint64_t packet_boundary(const struct pindex *ix, uint64_t off)
+{
+	size_t i = index_find(ix, off);
+
+	if(i == ix->count || index_start(ix, i) == off)
+		return off;
+	return ix->ends[i];
+}
+
+/*********************************************************************
+Fill the send buffer with DATA frames for the packets of @r. A packet
+too big for the buffer goes out over several fills, its header with the
+first of them; @c->frame_end is where the packet on the wire ends. With
+checksums on, a packet that fails its check goes out as an ERROR frame.
+@return 0 on success, -1 with errno set on a read error.
+**********************************************************************/
+static int frame_fill(struct conn *c, struct store *st, struct range *r)
+{
+	while(r->from < r->to)
+	{
+		size_t room = c->sbuf_cap - c->sbuf_len;
+
+		if(c->frame_end <= r->from)
+		{
+			size_t i = index_find(&st->idx, r->from);
+			if(i == st->idx.count)
+			{
+				errno = ERANGE;
+				return -1;
+			}
+			off_t end = (off_t)st->idx.ends[i] < r->to ? (off_t)st->idx.ends[i] : r->to;
+			if(st->checksums)
+			{
+				if(store_verify(st, end) == -1)
+					return -1;
+				if(store_bad(st, r->from, end) != -1)
+				{
+					char msg[64];
+					int n = snprintf(msg, sizeof(msg), "bad checksum in packet %zu", i);
+					if(room < FRAME_HDR + (size_t)n)
+						break;
+					frame_put(c->sbuf + c->sbuf_len, FRAME_ERROR, n);
+					memcpy(c->sbuf + c->sbuf_len + FRAME_HDR, msg, n);
+					c->sbuf_len += FRAME_HDR + n;
+					r->from = end;
+					continue;
+				}
+			}
+			if(room <= FRAME_HDR)
+				break;
+			frame_put(c->sbuf + c->sbuf_len, FRAME_DATA, end - r->from);
+			c->sbuf_len += FRAME_HDR;
+			room -= FRAME_HDR;
+			c->frame_end = end;
+		}
+		size_t want = (size_t)(c->frame_end - r->from) < room ? (size_t)(c->frame_end - r->from) : room;
+		if(want == 0)
+			break;
+		ssize_t rd = store_read(st, c->sbuf + c->sbuf_len, want, r->from);
+		if(rd <= 0)
+			return -1;
+		c->sbuf_len += rd;
+		r->from += rd;
+	}
+	return 0;
+}
+
+/*********************************************************************
+Send whatever the client is owed: queued replies first, then packets
+committed since its subscription cursor. Pushed packets go out straight
+from the feed ring, only a subscriber that fell behind the ring reads
+the log again. Once the sent bytes use up @c->deficit the connection
+goes to the run queue, so one long replay cannot hold up the others.
+Called with the channel locked.
+@return 1 when everything was sent, 0 if the socket is full or the turn
+is over, -1 on error.
+**********************************************************************/
+static int conn_flush_locked(struct conn *c)
+{
+	struct store *st = &c->ch->st;
+	struct feed *feed = &c->ch->feed;
+
+	for(;;)
+	{
+		if(c->sbuf_off < c->sbuf_len)
+		{
+			ssize_t sd = send(c->fd, c->sbuf + c->sbuf_off, c->sbuf_len - c->sbuf_off, MSG_NOSIGNAL);
+			if(sd == -1)
+				goto send_error;
+			c->sbuf_off += sd;
+			c->deficit -= sd;
+			c->active_at = timer_now();
+			continue;
+		}
+		if(rchain_busy(&c->chain))
+		{
+			ssize_t sd = rchain_send(&c->chain, c->fd);
+			if(sd == -1)
+				goto send_error;
+			c->deficit -= sd;
+			c->active_at = timer_now();
+			continue;
+		}
+		if(c->zc.cur != NULL)
+		{
+			ssize_t sd = zcopy_send(&c->zc, c->fd);
+			if(sd == -1)
+				goto send_error;
+			c->deficit -= sd;
+			c->active_at = timer_now();
+			continue;
+		}
+		c->sbuf_off = c->sbuf_len = 0;
+		if(c->deficit <= 0 && conn_busy(c))
+		{
+			//the chunk on the wire may overdraw, the next turns pay it back
+			run_queue_add(c);
+			return 0;
+		}
+
+		if(c->out_head < c->out_count)
+		{
+			struct range *r = &c->out[c->out_head];
+			if(r->from == RANGE_END)
+			{
+				char next[8];
+				frame_put64(next, c->cursor);
+				reply_frame(c, FRAME_END, next, sizeof(next));
+				c->out_head++;
+				continue;
+			}
+			if(r->from < st->head)
+			{
+				//dropped by retention while the reply was queued
+				if(c->frame_end > r->from)
+				{
+					//the DATA frame on the wire cannot be finished
+					log_warn("%s: replay overtaken by retention", c->addr);
+					return -1;
+				}
+				r->from = st->head;
+				if(r->from >= r->to)
+				{
+					c->out_head++;
+					continue;
+				}
+			}
+			if(c->binary)
+			{
+				if(frame_fill(c, st, r) == -1)
+				{
+					log_error("read: %m");
+					return -1;
+				}
+				if(r->from >= r->to)
+				{
+					c->out_head++;
+					c->frame_end = 0;
+				}
+				continue;
+			}
+			//replies go out of the replay cache as they are, else long ones
+			//are read into chunks the kernel sends from as they are
+			int cached = !c->compressed && c->ch->cache.slots > 0;
+			int zc = !cached && !c->compressed && CFG.zerocopy &&
+				r->to - r->from >= (off_t)CFG.zerocopy && zcopy_usable(&c->zc, c->fd);
+			size_t cap = zc ? ZCOPY_CHUNK : c->sbuf_cap;
+			//every send is a record of its own on SOCK_SEQPACKET, keep them
+			//the size clients expect
+			if(cached && !c->seqpacket)
+			{
+				//a turn's worth at once, the quantum is what keeps it fair
+				cap = c->deficit > (ssize_t)cap ? (size_t)c->deficit : cap;
+				if(cap > RCACHE_CHAIN * RCACHE_BLOCK)
+					cap = RCACHE_CHAIN * RCACHE_BLOCK;
+			}
+			size_t want = r->to - r->from < (off_t)cap ? r->to - r->from : cap;
+			if(c->compressed)
+			{
+				//frames follow segments, so sealed ones can go out as stored
+				off_t end = (r->from / SEGMENT_SIZE + 1) * SEGMENT_SIZE;
+				want = (r->to < end ? r->to : end) - r->from;
+			}
+			if(st->checksums)
+			{
+				ssize_t bad;
+
+				if(store_verify(st, r->from + want) == -1)
+				{
+					log_error("verify: %m");
+					return -1;
+				}
+				if((bad = store_bad(st, r->from, r->from + want)) != -1)
+				{
+					off_t start = index_start(&st->idx, bad);
+					if(start > r->from)
+						want = start - r->from;
+					else
+					{
+						//send a marker in place of a corrupt packet
+						char msg[64];
+						snprintf(msg, sizeof(msg), QUERY_PREFIX "ERROR:bad checksum in packet %zd\n", bad);
+						if(reply_text(c, msg) == -1)
+							return -1;
+						r->from = st->idx.ends[bad];
+						if(r->from >= r->to)
+							c->out_head++;
+						continue;
+					}
+				}
+			}
+			if(cached)
+			{
+				ssize_t n = rcache_chain(&c->ch->cache, st, feed, &c->chain, r->from, r->from + want);
+				if(n > 0)
+				{
+					r->from += n;
+					if(r->from >= r->to)
+						c->out_head++;
+					continue;
+				}
+				//the cache could not take it, read the log instead
+				if(want > c->sbuf_cap)
+					want = c->sbuf_cap;
+			}
+			if(zc && zcopy_get(&c->zc) == NULL)
+			{
+				zc = 0;
+				if(want > c->sbuf_cap)
+					want = c->sbuf_cap;
+			}
+			ssize_t rd = c->compressed ? zip_frame(c, st, r->from, want) :
+				store_read(st, zc ? c->zc.cur->buf : c->sbuf, want, r->from);
+			if(rd <= 0)
+			{
+				log_error("read: %m");
+				return -1;
+			}
+			if(zc)
+				c->zc.cur->len = rd;
+			else if(!c->compressed)
+				c->sbuf_len = rd;
+			r->from += rd;
+			if(r->from >= r->to)
+				c->out_head++;
+			continue;
+		}
+		if(c->out_count > 0)
+		{
+			PROBE2(replay_end, c->id, c->replay_bytes);
+			c->replay_bytes = 0;
+		}
+		c->out_head = c->out_count = 0;
+
+		if(c->subscribed && c->sub.cursor < feed->end)
+		{
+			uint64_t limit = feed->end;
+			const char *data;
+			size_t n;
+
+			if(c->sub.skip)
+			{
+				//finish the packet on the wire, then jump to the newest data
+				limit = packet_boundary(&st->idx, c->sub.cursor);
+				if(limit == c->sub.cursor)
+				{
+					c->sub.cursor = feed->end;
+					c->sub.skip = 0;
+					continue;
+				}
+			}
+			n = feed_peek(feed, c->sub.cursor, &data);
+			if(n > limit - c->sub.cursor)
+				n = limit - c->sub.cursor;
+			if(n > 0)
+			{
+				if(n > (size_t)c->deficit)
+					n = c->deficit;
+				ssize_t sd = send(c->fd, data, n, MSG_NOSIGNAL);
+				if(sd == -1)
+					goto send_error;
+				c->sub.cursor += sd;
+				c->deficit -= sd;
+				c->active_at = timer_now();
+				continue;
+			}
+			if(c->sub.cursor < (uint64_t)st->head)
+			{
+				//retention dropped what the feed no longer holds
+				c->sub.cursor = st->head;
+				continue;
+			}
+			size_t want = limit - c->sub.cursor < c->sbuf_cap ? limit - c->sub.cursor : c->sbuf_cap;
+			ssize_t rd = store_read(st, c->sbuf, want, c->sub.cursor);
+			if(rd <= 0)
+			{
+				log_error("read: %m");
+				return -1;
+			}
+			c->sbuf_len = rd;
+			c->sub.cursor += rd;
+			continue;
+		}
+		//an idle connection gets its next reply started right away, a scan
+		//still pays for what it searched
+		if(!c->scanning)
+			c->deficit = CFG.replay_quantum;
+		return 1;
+	}
+send_error:
+	if(errno == EAGAIN || errno == EWOULDBLOCK)
+		return 0;
+	if(errno == EINTR)
+		return conn_flush_locked(c);
+	return -1;
+}
+
+static int conn_flush(struct conn *c)
+{
+	channel_lock(c->ch);
+	int rc = conn_flush_locked(c);
+	channel_unlock(c->ch);
+	return rc;
+}
+
+//watch for whatever the connection is waiting on, nothing while it
+//waits for its turn
+static int conn_update(struct conn *c)
+{
+	uint32_t events = c->queued ? 0 : conn_busy(c) ? EPOLLOUT : c->eof || c->paused_until ? 0 : EPOLLIN;
+
+	conn_arm(c);
+	if(events == c->events)
+		return 0;
+	struct epoll_event ev = { .events = events, .data.ptr = c };
+	if(epoll_ctl(c->epfd, EPOLL_CTL_MOD, c->fd, &ev) == -1)
+		return -1;
+	c->events = events;
+	return 0;
+}
+
+/*********************************************************************
+Apply the lag policy to every subscriber and push the new packet to the
+ones that can take it right away. Failing subscribers are shut down
+rather than freed here, the epoll loop reaps them, since the connection
+that committed the packet may be a subscriber itself.
+**********************************************************************/
+void feed_notify(struct channel *ch)
+{
+	struct feed_sub *s;
+
+	channel_lock(ch);
+	for(s = ch->feed.subs; s != NULL; s = s->next)
+	{
+		struct conn *c = sub_conn(s);
+		uint64_t lag = ch->feed.end - s->cursor;
+
+		if(CFG.subscriber_max_lag && lag > CFG.subscriber_max_lag && !s->skip)
+		{
+			if(CFG.subscriber_policy == SUBSCRIBER_DISCONNECT)
+			{
+				log_warn("subscriber %s is %llu bytes behind, disconnecting",
+				       c->addr, (unsigned long long)lag);
+				shutdown(c->fd, SHUT_RDWR);
+				continue;
+			}
+			log_warn("subscriber %s is %llu bytes behind, dropping backlog",
+			       c->addr, (unsigned long long)lag);
+			s->skip = 1;
+		}
+		//another thread's connection, its owner sends it the packets
+		if(c->worker != worker_self())
+		{
+			worker_kick(c);
+			continue;
+		}
+		if(conn_flush_locked(c) == -1 || conn_update(c) == -1)
+			shutdown(c->fd, SHUT_RDWR);
+	}
+	channel_unlock(ch);
+}
+
+//drop @n processed bytes from the front of the input buffer
+static void conn_consume(struct conn *c, size_t n)
+{
+	c->in_off += n;
+	if(c->in_off == c->in_len)
+		c->in_off = c->in_len = 0;
+}
+
+/*********************************************************************
+A frame header is complete: check the payload length and make room for
+the payload. An APPEND gets a buffer for its whole packet up front, or
+a stage when it is over the spill threshold, so the payload lands where
+it is stored without being scanned or copied around.
+**********************************************************************/
+static int frame_begin(struct conn *c)
+{
+	uint32_t len = frame_len(c->frame_hdr);
+
+	c->frame_left = len;
+	c->frame_last = '\n';
+	if((unsigned char)c->frame_hdr[0] != FRAME_APPEND)
+	{
+		if(len > FRAME_ARGS_MAX)
+		{
+			log_warn("%s: frame payload of %u bytes, dropping client", c->addr, len);
+			errno = EPROTO;
+			return -1;
+		}
+		len = FRAME_ARGS_MAX;
+	}
+	else if(CFG.max_packet && len > CFG.max_packet)
+	{
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if((size_t)len + 1 > CFG.spill_threshold)
+		return stage_open(&c->stage, &c->ch->st);
+	if((size_t)len + 1 > c->cap)
+	{
+		char *nbuf = conn_realloc(c, MEM_PACKET, c->buf, c->cap, len + 1);
+		if(nbuf == NULL)
+		{
+			//over the memory budget a packet can still go to disk
+			if((unsigned char)c->frame_hdr[0] == FRAME_APPEND)
+				return stage_open(&c->stage, &c->ch->st);
+			return -1;
+		}
+		c->buf = nbuf;
+		c->cap = len + 1;
+	}
+	return 0;
+}
+
+//carry out the frame read whole into @c->buf (or the stage)
+static int frame_run(struct conn *c)
+{
+	struct channel *ch = c->ch;
+	uint64_t arg = c->len >= 8 ? frame_get64(c->buf) : 0;
+	int rc = 0;
+
+	switch((unsigned char)c->frame_hdr[0])
+	{
+	case FRAME_APPEND:
+	{
+		struct query q;
+
+		//like a datagram, the packet gets its '\n' if it lacks one
+		if(c->stage.fd != -1)
+			rc = conn_commit(c, "\n", c->frame_last != '\n', &q);
+		else
+		{
+			if(c->len == 0 || c->buf[c->len - 1] != '\n')
+				c->buf[c->len++] = '\n';
+			capture_event(CAPTURE_PACKET, c->id, NULL, c->len);
+			rc = commit_packet(c, c->buf, c->len);
+		}
+		c->len = 0;
+		if(rc == -1)
+			return -1;
+		channel_lock(ch);
+		//the payload may hold '\n' of its own, only the index knows the
+		//boundary so it has to survive a restart
+		index_checkpoint(&ch->st.idx);
+		reply_pos(c, FRAME_OK, ch->st.idx.count - 1, ch->st.committed);
+		channel_unlock(ch);
+		return 0;
+	}
+	case FRAME_SEEK:
+		if(c->len < 8)
+		{
+			reply_frame(c, FRAME_ERROR, "bad SEEK", 8);
+			break;
+		}
+		channel_lock(ch);
+		c->cursor = arg < ch->st.idx.count ? arg : ch->st.idx.count;
+		reply_pos(c, FRAME_OK, c->cursor, index_start(&ch->st.idx, c->cursor));
+		channel_unlock(ch);
+		break;
+	case FRAME_REPLAY:
+	{
+		channel_lock(ch);
+		uint64_t count = ch->st.idx.count;
+		if(c->cursor > count)
+			c->cursor = count;
+		uint64_t last = c->len >= 8 && arg < count - c->cursor ? c->cursor + arg : count;
+		if(c->cursor < last)
+			rc = queue_range(c, index_start(&ch->st.idx, c->cursor), ch->st.idx.ends[last - 1]);
+		c->cursor = last;
+		if(rc == 0)
+			rc = queue_range(c, RANGE_END, RANGE_END);
+		channel_unlock(ch);
+		break;
+	}
+	case FRAME_STATS:
+	{
+		char stats[STATS_MAX];
+		int n = stats_text(stats, sizeof(stats));
+		rc = reply_frame(c, FRAME_STATS_REPLY, stats, n);
+		break;
+	}
+	default:
+		reply_frame(c, FRAME_ERROR, "bad opcode", 10);
+		break;
+	}
+	c->len = 0;
+	return rc;
+}
+
+/*********************************************************************
+A SOCK_SEQPACKET record is one whole packet, so it is read in one go
+(growing the input buffer to fit) and gets its '\n' added when the
+client left it off. Stream sockets just read what is there.
+**********************************************************************/
+static ssize_t conn_recv(struct conn *c)
+{
+	if(!c->seqpacket)
+		return recv(c->fd, c->in, c->in_cap, 0);
+
+	ssize_t len = recv(c->fd, NULL, 0, MSG_PEEK | MSG_TRUNC);
+	if(len <= 0)
+		return len;
+	if(CFG.max_packet && (size_t)len > CFG.max_packet)
+	{
+		errno = EMSGSIZE;
+		return -1;
+	}
+	if((size_t)len + 1 > c->in_cap)
+	{
+		char *in = conn_realloc(c, MEM_RECV, c->in, c->in_cap, len + 1);
+		if(in == NULL)
+			return -1;
+		c->in = in;
+		c->in_cap = len + 1;
+	}
+	len = recv(c->fd, c->in, len, 0);
+	if(len > 0 && !c->binary && c->in[len - 1] != '\n')
+		c->in[len++] = '\n';
+	return len;
+}
+
+/*********************************************************************
+The input side of a connection runs as a coroutine, reading packets or
+frames as straight-line code. It hands control back to conn_event()
+after every packet so the reply can be flushed, and whenever it has to
+wait: for the socket, which it reads at most once per readiness event,
+or for its turn, as the next packet waits for the previous reply and a
+client over its rate limits waits for the pause to end.
+**********************************************************************/
+
+//back to conn_event(), @idle when the reader waits for the socket
+static void reader_yield(struct conn *c, int idle)
+{
+	c->reader_idle = idle;
+	coro_yield();
+}
+
+static void reader_wait_turn(struct conn *c)
+{
+	while(conn_busy(c) || c->paused_until)
+		reader_yield(c, 0);
+}
+
+//the reader is giving up on the client after a failed @what
+static void reader_fail(struct conn *c, const char *what)
+{
+	if(errno == EMSGSIZE)
+		log_warn("packet exceeds max-packet %zu, dropping client", CFG.max_packet);
+	else
+		log_error("%s: %m", what);
+	c->failed = 1;
+}
+
+/*********************************************************************
+Receive into @buf, or the input buffer if it is NULL, once the socket is
+readable and it is the connection's turn. Charges the bytes to the rate
+limits, which may pause the client before they are looked at.
+@return the bytes read, 0 once the client closed, -1 on an error.
+**********************************************************************/
+static ssize_t reader_recv(struct conn *c, char *buf, size_t len)
+{
+	ssize_t rc;
+
+	for(;;)
+	{
+		reader_wait_turn(c);
+		if(!c->may_read)
+		{
+			reader_yield(c, 1);
+			continue;
+		}
+		c->may_read = 0;
+		rc = buf != NULL ? recv(c->fd, buf, len, 0) : conn_recv(c);
+		if(rc != -1 || (errno != EAGAIN && errno != EINTR))
+			break;
+	}
+	if(rc == 0)
+		c->eof = 1;
+	else if(rc == -1)
+		reader_fail(c, "receive");
+	else
+	{
+		log_debug("rc: %zd", rc);
+		PROBE2(recv, c->id, rc);
+		c->active_at = timer_now();
+		conn_pause(c, admit_take(c->addr, rc, 0, 1, c->active_at));
+		reader_wait_turn(c);
+	}
+	return rc;
+}
+
+//read the next packet up to its '\n' and store or answer it
+static int read_packet(struct conn *c)
+{
+	char *start, *nl;
+	struct query *q = &c->query;
+	ssize_t rc;
+
+	for(;;)
+	{
+		if(c->in_len == 0)
+		{
+			if((rc = reader_recv(c, NULL, 0)) <= 0)
+				return rc;
+			c->in_len = rc;
+		}
+		start = c->in + c->in_off;
+		if((nl = memchr(start, '\n', c->in_len - c->in_off)) != NULL)
+			break;
+		//all of it belongs to a packet that goes on in the next read
+		size_t n = c->in_len - c->in_off;
+		if(c->len == 0 && c->stage.fd == -1)
+			c->packet_at = timer_now();
+		c->in_off = c->in_len = 0;
+		if(conn_hold(c, start, n) == -1)
+			return -1;
+	}
+	PROBE2(frame_complete, c->id, c->len + c->stage.len + (nl - start + 1));
+	conn_consume(c, nl - start + 1);
+	conn_pause(c, admit_take(c->addr, 0, 1, 1, timer_now()));
+
+	rc = conn_commit(c, start, nl - start + 1, q);
+	if(rc == 1)
+		rc = answer_query(c, q);
+	else if(rc == 0 && !c->subscribed)
+	{
+		channel_lock(c->ch);
+		rc = queue_range(c, c->ch->st.head, c->ch->st.committed);
+		channel_unlock(c->ch);
+	}
+	return rc == -1 ? -1 : 1;
+}
+
+/*********************************************************************
+Binary counterpart of read_packet(): read a frame header, then its
+payload, and carry the frame out. The packet rate is charged as a frame
+starts, just as a text packet is charged when its '\n' shows up. The
+rest of an APPEND payload is read straight into the packet when nothing
+else is buffered.
+**********************************************************************/
+static int read_frame(struct conn *c)
+{
+	ssize_t rc;
+	size_t n;
+
+	while(c->frame_got < FRAME_HDR)
+	{
+		if(c->in_len == 0)
+		{
+			if((rc = reader_recv(c, NULL, 0)) <= 0)
+				return rc;
+			c->in_len = rc;
+		}
+		if(c->frame_got == 0)
+		{
+			c->packet_at = timer_now();
+			conn_pause(c, admit_take(c->addr, 0, 1, 1, c->packet_at));
+		}
+		n = c->in_len - c->in_off;
+		if(n > FRAME_HDR - c->frame_got)
+			n = FRAME_HDR - c->frame_got;
+		memcpy(c->frame_hdr + c->frame_got, c->in + c->in_off, n);
+		c->frame_got += n;
+		conn_consume(c, n);
+	}
+	//the payload of a frame handed over by an upgrade is under way
+	if(c->frame_left == 0 && frame_begin(c) == -1)
+		return -1;
+	while(c->frame_left > 0)
+	{
+		if(c->in_len == 0 && !c->seqpacket && (unsigned char)c->frame_hdr[0] == FRAME_APPEND &&
+		   c->stage.fd == -1)
+		{
+			if((rc = reader_recv(c, c->buf + c->len, c->frame_left)) <= 0)
+				return rc;
+			c->len += rc;
+			c->frame_left -= rc;
+			c->frame_last = c->buf[c->len - 1];
+			continue;
+		}
+		if(c->in_len == 0)
+		{
+			if((rc = reader_recv(c, NULL, 0)) <= 0)
+				return rc;
+			c->in_len = rc;
+		}
+		const char *p = c->in + c->in_off;
+		n = c->in_len - c->in_off;
+		if(n > c->frame_left)
+			n = c->frame_left;
+		if(conn_hold(c, p, n) == -1)
+			return -1;
+		c->frame_last = p[n - 1];
+		c->frame_left -= n;
+		conn_consume(c, n);
+	}
+	c->frame_got = 0;
+	PROBE2(frame_complete, c->id, frame_len(c->frame_hdr));
+	return frame_run(c) == -1 ? -1 : 1;
+}
+
+//the coroutine of @arg, until the client closes or fails
+static void conn_reader(void *arg)
+{
+	struct conn *c = arg;
+	int rc = 1;
+
+	//a scan handed over by an upgrade goes on where it was
+	if(c->scanning)
+	{
+		rc = scan_run(c) == -1 ? -1 : 1;
+		query_free(&c->query);
+	}
+	while(rc == 1)
+	{
+		//packets wait for the previous reply so replies stay in order
+		reader_wait_turn(c);
+		if((rc = c->binary ? read_frame(c) : read_packet(c)) != 1)
+			break;
+		reader_yield(c, 0);
+	}
+	if(rc == -1 && !c->failed)
+		reader_fail(c, "write");
+}
+
+int conn_event(struct conn *c, uint32_t events)
+{
+	//zero-copy completions are reported as errors too
+	if((events & EPOLLERR) && zcopy_reap(&c->zc, c->fd) == -1)
+		return -1;
+	if((events & EPOLLHUP) && c->eof)
+		return -1;
+	if(conn_flush(c) == -1)
+		return -1;
+	if(c->paused_until && timer_now() >= c->paused_until)
+		c->paused_until = 0;
+	if(!c->paused_until && mem_tight() && mem_hog(c->mem + c->zc.mem, atomic_load(&nconns)))
+	{
+		//memory is short and this client holds more than its share
+		conn_delay(c, TIMER_TICK_MS);
+		atomic_fetch_add(&mem_stats.paused, 1);
+	}
+
+	c->may_read = (events & (EPOLLIN | EPOLLHUP)) != 0;
+	//an idle reader has nothing to do unless the socket is readable, one
+	//in the run queue waits for its turn
+	while(!conn_busy(c) && !c->queued && !c->paused_until && !c->eof && !coro_done(c->reader) &&
+	      (c->may_read || !c->reader_idle))
+	{
+		coro_resume(c->reader);
+		if(c->failed)
+			return -1;
+		if(conn_flush(c) == -1)
+			return -1;
+		if(mem_tight())
+			conn_trim(c);
+	}
+	c->may_read = 0;
+
+	//subscribers may half-close and keep listening
+	if(c->eof && !conn_busy(c) && !c->subscribed)
+		return -1;
+	return conn_update(c);
+}
+
+size_t conn_schedule(void)
+{
+	size_t n = run_count;
+
+	//connections that run out again go to the back, after this round
+	while(n-- > 0 && run_queue != NULL)
+	{
+		struct conn *c = run_queue;
+
+		run_queue_remove(c);
+		c->deficit += CFG.replay_quantum;
+		if(conn_event(c, 0) == -1)
+			conn_free(c);
+	}
+	return run_count;
+}
+
+int conn_expire(void)
+{
+	uint64_t now = timer_now();
+	struct timer *t;
+
+	while((t = wheel_expired(&timers, now)) != NULL)
+	{
+		struct conn *c = timer_conn(t);
+		const char *why;
+		uint64_t at = conn_deadline(c, &why);
+
+		//moved on without the timer being armed again
+		if(at == 0 || at > now)
+		{
+			conn_arm(c);
+			continue;
+		}
+		if(why == NULL)
+		{
+			//the pause is over, pick up the input
+			if(conn_event(c, EPOLLIN) == -1)
+				conn_free(c);
+			continue;
+		}
+		log_info("%s %s for too long, closing", c->addr, why);
+		conn_free(c);
+	}
+	return wheel_timeout(&timers, now);
+}
+
+size_t conn_count(void)
+{
+	return atomic_load(&nconns);
+}
+
+/*********************************************************************
+Pass @c to the new server with what it is in the middle of and close it
+here. Between two yields of its reader that is all in the connection:
+the input not split into packets yet, the partial packet or frame, the
+reply bytes on their way out (the send buffer, then the cached blocks,
+then the zero-copy chunk, the order they go in) and the replies still
+owed, the subscription cursor and a GREP or REGEX being scanned. The
+reader itself is not carried over, the new server starts a fresh one
+that picks up from there.
+**********************************************************************/
+static void conn_pass(int sock, struct conn *c)
+{
+	struct upgrade_item it = { .kind = UPGRADE_CONN, .nfds = 1, .fds = { c->fd },
+				   .seqpacket = c->seqpacket, .subscribed = c->subscribed,
+				   .compressed = c->compressed, .binary = c->binary,
+				   .cursor = c->cursor, .frame_got = c->frame_got,
+				   .frame_left = c->frame_left, .frame_last = c->frame_last,
+				   .frame_end = c->frame_end, .sub_cursor = c->sub.cursor,
+				   .sub_skip = c->sub.skip };
+	struct iovec data[RCACHE_CHAIN + 6];
+	int i, cnt = 0;
+
+	snprintf(it.channel, sizeof(it.channel), "%s", c->ch->name);
+	snprintf(it.addr, sizeof(it.addr), "%s", c->addr);
+	memcpy(it.frame_hdr, c->frame_hdr, FRAME_HDR);
+	if(c->stage.fd != -1)
+	{
+		it.fds[it.nfds++] = c->stage.fd;
+		it.stage_len = c->stage.len;
+		it.stage_crc = c->stage.crc;
+		it.stage_checksums = c->stage.checksums;
+	}
+	it.in_len = c->in_len - c->in_off;
+	data[cnt++] = (struct iovec){ .iov_base = c->in + c->in_off, .iov_len = it.in_len };
+	it.packet_len = c->len;
+	data[cnt++] = (struct iovec){ .iov_base = c->buf, .iov_len = c->len };
+	it.unsent_len = c->sbuf_len - c->sbuf_off;
+	data[cnt++] = (struct iovec){ .iov_base = c->sbuf + c->sbuf_off, .iov_len = it.unsent_len };
+	for(i = c->chain.pos; i < c->chain.count; i++)
+	{
+		it.unsent_len += c->chain.iov[i].iov_len;
+		data[cnt++] = c->chain.iov[i];
+	}
+	if(c->zc.cur != NULL)
+	{
+		it.unsent_len += c->zc.cur->len - c->zc.cur->off;
+		data[cnt++] = (struct iovec){ .iov_base = c->zc.cur->buf + c->zc.cur->off,
+					      .iov_len = c->zc.cur->len - c->zc.cur->off };
+	}
+	it.ranges = c->out_count - c->out_head;
+	data[cnt++] = (struct iovec){ .iov_base = c->out + c->out_head,
+				      .iov_len = it.ranges * sizeof(*c->out) };
+	if(c->scanning)
+	{
+		it.scan_type = c->query.type;
+		it.scan_pos = c->scan.pos;
+		it.scan_piece = c->scan.piece;
+		it.scan_end = c->scan.end;
+		it.scan_from = c->scan.em.from;
+		it.scan_to = c->scan.em.to;
+		it.pattern_len = c->query.pattern_len;
+		data[cnt++] = (struct iovec){ .iov_base = c->query.pattern, .iov_len = c->query.pattern_len };
+	}
+	if(upgrade_send(sock, &it, data, cnt) == -1)
+		log_error("connection handoff: %m");
+	conn_free(c);
+}
+
+void conn_handoff(int sock)
+{
+	while(conns != NULL)
+		conn_pass(sock, conns);
+}
+
+void conn_kicked(struct conn *c)
+{
+	if(conn_event(c, 0) == -1)
+		conn_free(c);
+}
+
+//pick up where the previous server left @c, see conn_pass()
+static int conn_resume(struct conn *c, const struct upgrade_item *it)
+{
+	const char *p = it->data;
+	struct range r;
+	uint32_t i;
+
+	if(conn_fit(c, MEM_RECV, &c->in, &c->in_cap, it->in_len) == -1)
+		return -1;
+	memcpy(c->in, p, it->in_len);
+	c->in_len = it->in_len;
+	p += it->in_len;
+
+	memcpy(c->frame_hdr, it->frame_hdr, FRAME_HDR);
+	c->frame_got = it->frame_got;
+	c->frame_end = it->frame_end;
+	//a payload under way goes on into a buffer made for its frame
+	if(c->frame_got == FRAME_HDR && c->stage.fd == -1 && frame_begin(c) == -1)
+		return -1;
+	c->frame_left = it->frame_left;
+	c->frame_last = it->frame_last;
+	c->packet_at = timer_now();
+	if(it->packet_len > 0 && conn_hold(c, p, it->packet_len) == -1)
+		return -1;
+	p += it->packet_len;
+
+	if(conn_fit(c, MEM_REPLY, &c->sbuf, &c->sbuf_cap, it->unsent_len) == -1)
+		return -1;
+	memcpy(c->sbuf, p, it->unsent_len);
+	c->sbuf_len = it->unsent_len;
+	p += it->unsent_len;
+	for(i = 0; i < it->ranges; i++)
+	{
+		memcpy(&r, p, sizeof(r));
+		p += sizeof(r);
+		if(queue_range(c, r.from, r.to) == -1)
+			return -1;
+	}
+
+	if(it->scan_type == QUERY_INVALID)
+		return 0;
+	if(query_load(&c->query, it->scan_type, p, it->pattern_len) == -1)
+		return -1;
+	channel_lock(c->ch);
+	int rc = query_scan_start(&c->scan, &c->query, &c->ch->st, queue_range, c);
+	channel_unlock(c->ch);
+	if(rc == -1)
+		return -1;
+	c->scan.pos = it->scan_pos;
+	c->scan.piece = it->scan_piece;
+	c->scan.end = it->scan_end;
+	c->scan.em.from = it->scan_from;
+	c->scan.em.to = it->scan_to;
+	c->scanning = 1;
+	return 0;
+}
+
+void conn_adopt(int epfd, const struct upgrade_item *it)
+{
+	struct conn *c = conn_new(epfd, it->fds[0], it->addr);
+	struct channel *ch;
+
+	if(c == NULL)
+	{
+		if(it->nfds > 1)
+			close(it->fds[1]);
+		free(it->data);
+		return;
+	}
+	if(it->nfds > 1)
+	{
+		c->stage.fd = it->fds[1];
+		c->stage.len = it->stage_len;
+		c->stage.crc = it->stage_crc;
+		c->stage.checksums = it->stage_checksums;
+	}
+	c->seqpacket = it->seqpacket;
+	if(it->compressed && conn_compress(c, 1) == -1)
+		log_error("compress: %m");
+	if(it->binary && conn_binary(c) == -1)
+		log_error("binary: %m");
+	c->cursor = it->cursor;
+	if((ch = channel_get(it->channel)) != NULL)
+		c->ch = ch;
+	if(it->subscribed)
+	{
+		channel_lock(c->ch);
+		feed_subscribe(&c->ch->feed, &c->sub);
+		//what it had not been sent yet is read back from the log
+		if(it->sub_cursor < c->sub.cursor)
+		{
+			c->sub.cursor = it->sub_cursor;
+			c->sub.skip = it->sub_skip;
+		}
+		channel_unlock(c->ch);
+		c->subscribed = 1;
+	}
+	if(conn_resume(c, it) == -1)
+	{
+		log_error("%s: taking over: %m", c->addr);
+		conn_free(c);
+	}
+	//it may have replies to send or input to carry out
+	else if(conn_event(c, 0) == -1)
+		conn_free(c);
+	free(it->data);
+}
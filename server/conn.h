@@ -0,0 +1,208 @@
+#ifndef AESD_CONN_H
+#define AESD_CONN_H
+
+#include <arpa/inet.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "channel.h"
+#include "feed.h"
+#include "frame.h"
+#include "query.h"
+#include "source.h"
+#include "store.h"
+#include "timer.h"
+#include "zcopy.h"
+
+//a run of log bytes still to be sent to a client; in binary mode a
+//range starting at RANGE_END stands for the END frame closing a replay
+#define RANGE_END ((off_t)-1)
+struct range {
+	off_t from;
+	off_t to;
+};
+
+/*********************************************************************
+One client connection driven by the epoll loop. Input is split into
+packets by a coroutine of its own as it arrives, a packet whose reply is still being sent holds
+back the ones after it so replies go out in order. While replies or
+pushed packets are pending the socket is only watched for writability,
+which also throttles clients that do not read their replies. Replies are
+sent a quantum at a time, a connection that used up its share waits in
+the run queue for the next round of conn_schedule().
+**********************************************************************/
+struct conn {
+	enum source source;
+	//names the connection in a capture trace
+	uint32_t id;
+	//bytes of buffers charged to the memory budget for it
+	size_t mem;
+	int fd;
+	int epfd;
+	uint32_t events;
+	char addr[INET6_ADDRSTRLEN];
+	int eof;
+	//every SOCK_SEQPACKET record is a packet of its own
+	int seqpacket;
+	//where packets are stored and queries run, see AESDSOCKET_CHANNEL
+	struct channel *ch;
+
+	//reads and carries out packets, see conn_reader(): @may_read lets it
+	//read the socket once, @reader_idle is set while it waits to,
+	//@failed once it gave up on the client
+	struct coro *reader;
+	int may_read;
+	int reader_idle;
+	int failed;
+
+	//received bytes not split into packets yet
+	char *in;
+	size_t in_cap;
+	size_t in_off;
+	size_t in_len;
+
+	//the partial packet, spilled to the stage past the threshold
+	char *buf;
+	size_t len;
+	size_t cap;
+	struct stage stage;
+
+	//replies in the order they are owed, and the bytes being sent
+	struct range *out;
+	size_t out_head;
+	size_t out_count;
+	size_t out_cap;
+	//log bytes queued since the reply started, for the replay_end probe
+	uint64_t replay_bytes;
+	char *sbuf;
+	size_t sbuf_cap;
+	size_t sbuf_off;
+	size_t sbuf_len;
+	//with --zerocopy, long replies go out of chunks of their own
+	struct zcopy zc;
+	//with --replay-cache, replies go out of the channel's cache
+	struct rchain chain;
+
+	//the last command read, and the GREP or REGEX it runs over the log a
+	//block per step while @scanning, see scan_query()
+	struct query query;
+	struct query_scan scan;
+	int scanning;
+
+	//set by AESDSOCKET_COMPRESS:LZ4, replies then go out as frames built
+	//in sbuf from the raw bytes in zraw
+	int compressed;
+	char *zraw;
+
+	//bytes it may still send before its turn is over, and its place in
+	//the run queue while it waits for the next one
+	ssize_t deficit;
+	int queued;
+	struct conn *run_next;
+	struct conn **run_pprev;
+
+	//closes the connection when the client is silent, slow to finish a
+	//packet or not reading, counted from @active_at or @packet_at (ms)
+	struct timer timer;
+	uint64_t active_at;
+	uint64_t packet_at;
+	//input is not read before this (ms) while the client is over its
+	//rate limits, 0 when it is not
+	uint64_t paused_until;
+
+	//set by AESDSOCKET_BINARY, everything is then framed, see frame.h:
+	//@frame_hdr collects the header of the frame coming in and
+	//@frame_left counts its payload bytes still to come, @frame_last is
+	//the last one seen; @frame_end is where the DATA frame going out
+	//ends and @cursor the packet the next REPLAY starts at
+	int binary;
+	char frame_hdr[FRAME_HDR];
+	size_t frame_got;
+	uint64_t frame_left;
+	char frame_last;
+	off_t frame_end;
+	uint64_t cursor;
+
+	//set once the client sent AESDSOCKET_SUBSCRIBE
+	int subscribed;
+	struct feed_sub sub;
+
+	//the worker running it, NULL for the main thread, and its place in
+	//the worker's list of subscribers to push new packets to
+	struct worker *worker;
+	struct conn *kick_next;
+	struct conn **kick_pprev;
+
+	struct conn *next;
+	struct conn **pprev;
+};
+
+/**
+ * Take over the non-blocking socket @param fd and register it with
+ * @param epfd, @param addr is the peer address for log messages. The
+ * connection starts out on the default channel.
+ * @return the connection, or NULL (with @param fd closed) on failure.
+ */
+struct conn *conn_new(int epfd, int fd, const char *addr);
+
+/**
+ * Handle the epoll @param events reported for @param c.
+ * @return 0 to keep the connection, -1 once it should be freed.
+ */
+int conn_event(struct conn *c, uint32_t events);
+
+void conn_free(struct conn *c);
+
+/**
+ * Close every open connection, used on shutdown.
+ */
+void conn_free_all(void);
+
+/**
+ * Run one round of deficit round robin over the run queue: every waiting
+ * connection gets another --replay-quantum bytes and sends what it may.
+ * @return the number of connections still waiting for a turn.
+ */
+size_t conn_schedule(void);
+
+/**
+ * Close the connections whose timeout passed.
+ * @return milliseconds until the next one may, -1 if none is armed; an
+ * epoll_wait() timeout.
+ */
+int conn_expire(void);
+
+/**
+ * @return the number of open connections.
+ */
+size_t conn_count(void);
+
+struct upgrade_item;
+
+/**
+ * Pass every connection of the calling thread to the new server over
+ * the upgrade socket @param sock, with whatever it is in the middle of,
+ * and close it here.
+ */
+void conn_handoff(int sock);
+
+/**
+ * Take over a connection handed over by the previous server or, with
+ * --workers, by the main thread; its data is freed.
+ */
+void conn_adopt(int epfd, const struct upgrade_item *it);
+
+/**
+ * Push packets just committed to @param ch out to its subscribers. Call
+ * it after every commit, with the channel unlocked.
+ */
+void feed_notify(struct channel *ch);
+
+/**
+ * Push subscriber @param c the packets another thread committed, see
+ * worker_kick().
+ */
+void conn_kicked(struct conn *c);
+
+#endif
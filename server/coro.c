@@ -0,0 +1,204 @@
+#define _GNU_SOURCE
+#include "coro.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+struct coro {
+	void (*fn)(void *);
+	void *arg;
+	int done;
+	//the mapping, guard page first
+	char *stack;
+#if defined(__x86_64__)
+	//stack pointers saved while switched away from
+	void *sp;
+	void *caller_sp;
+#else
+	ucontext_t ctx;
+	ucontext_t caller;
+#endif
+};
+
+static __thread struct coro *current;
+static __thread char *pool[CORO_POOL];
+static __thread size_t pooled;
+
+static size_t guard_size(void)
+{
+	return sysconf(_SC_PAGESIZE);
+}
+
+static char *stack_get(void)
+{
+	char *s;
+
+	if(pooled > 0)
+		return pool[--pooled];
+	s = mmap(NULL, guard_size() + CORO_STACK, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if(s == MAP_FAILED)
+		return NULL;
+	//running off the end faults instead of overwriting the heap
+	if(mprotect(s, guard_size(), PROT_NONE) == -1)
+	{
+		munmap(s, guard_size() + CORO_STACK);
+		return NULL;
+	}
+	return s;
+}
+
+static void stack_put(char *s)
+{
+	if(pooled < CORO_POOL)
+		pool[pooled++] = s;
+	else
+		munmap(s, guard_size() + CORO_STACK);
+}
+
+#if defined(__x86_64__)
+/*********************************************************************
+Save the callee-saved registers on the current stack, store the stack
+pointer at *from and carry on with the stack at to, popping its
+registers and returning to wherever it last switched away. Everything
+else is saved by the caller as for any function call.
+**********************************************************************/
+void coro_switch(void **from, void *to);
+__asm__(
+	".text\n"
+	".globl coro_switch\n"
+	".hidden coro_switch\n"
+	".type coro_switch, @function\n"
+	"coro_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size coro_switch, .-coro_switch\n");
+
+//first thing run on a new stack, by the ret of coro_switch()
+static void coro_entry(void)
+{
+	struct coro *co = current;
+
+	co->fn(co->arg);
+	co->done = 1;
+	current = NULL;
+	coro_switch(&co->sp, co->caller_sp);
+	//a finished coroutine is never resumed
+	abort();
+}
+
+static void coro_init(struct coro *co)
+{
+	uintptr_t *sp = (uintptr_t *)(co->stack + guard_size() + CORO_STACK);
+	int i;
+
+	//as after a call: the return address (none) 8 bytes off 16 alignment
+	*--sp = 0;
+	*--sp = (uintptr_t)coro_entry;
+	//rbp, rbx, r12-r15
+	for(i = 0; i < 6; i++)
+		*--sp = 0;
+	co->sp = sp;
+}
+
+void coro_resume(struct coro *co)
+{
+	struct coro *prev = current;
+
+	current = co;
+	coro_switch(&co->caller_sp, co->sp);
+	current = prev;
+}
+
+void coro_yield(void)
+{
+	struct coro *co = current;
+
+	coro_switch(&co->sp, co->caller_sp);
+}
+#else
+static void coro_entry(void)
+{
+	struct coro *co = current;
+
+	co->fn(co->arg);
+	co->done = 1;
+	//uc_link takes it back to the caller
+}
+
+static void coro_init(struct coro *co)
+{
+	getcontext(&co->ctx);
+	co->ctx.uc_stack.ss_sp = co->stack + guard_size();
+	co->ctx.uc_stack.ss_size = CORO_STACK;
+	co->ctx.uc_link = &co->caller;
+	makecontext(&co->ctx, coro_entry, 0);
+}
+
+void coro_resume(struct coro *co)
+{
+	struct coro *prev = current;
+
+	current = co;
+	swapcontext(&co->caller, &co->ctx);
+	current = prev;
+}
+
+void coro_yield(void)
+{
+	struct coro *co = current;
+
+	swapcontext(&co->ctx, &co->caller);
+}
+#endif
+
+struct coro *coro_new(void (*fn)(void *), void *arg)
+{
+	struct coro *co = calloc(1, sizeof(*co));
+
+	if(co == NULL)
+		return NULL;
+	if((co->stack = stack_get()) == NULL)
+	{
+		free(co);
+		errno = ENOMEM;
+		return NULL;
+	}
+	co->fn = fn;
+	co->arg = arg;
+	coro_init(co);
+	return co;
+}
+
+int coro_done(const struct coro *co)
+{
+	return co->done;
+}
+
+void coro_free(struct coro *co)
+{
+	if(co == NULL)
+		return;
+	stack_put(co->stack);
+	free(co);
+}
@@ -0,0 +1,50 @@
+#ifndef AESD_CORO_H
+#define AESD_CORO_H
+
+/*********************************************************************
+Stackful coroutines for code that reads better straight-line than as a
+state machine. A coroutine runs on a stack of its own (CORO_STACK bytes
+under a guard page) until it calls coro_yield(), which returns to
+whoever called coro_resume(). Stacks are kept in a per-thread pool, a
+coroutine must be resumed and freed on the thread that created it. On
+x86-64 switching is a few instructions, elsewhere it goes through
+swapcontext().
+**********************************************************************/
+
+//enough for the LZ4 hash table of a compressed reply plus the usual
+//call chain of a commit, only the pages touched take memory
+#define CORO_STACK (256 * 1024)
+//free stacks kept per thread for the next coroutine
+#define CORO_POOL 64
+
+struct coro;
+
+/**
+ * Create a coroutine that will run @param fn(@param arg) once resumed.
+ * @return the coroutine, or NULL with errno set.
+ */
+struct coro *coro_new(void (*fn)(void *), void *arg);
+
+/**
+ * Run @param co until it yields or @param fn returns.
+ */
+void coro_resume(struct coro *co);
+
+/**
+ * Give control back to the caller of coro_resume(); returns when the
+ * running coroutine is resumed again.
+ */
+void coro_yield(void);
+
+/**
+ * @return non-zero once the function of @param co returned.
+ */
+int coro_done(const struct coro *co);
+
+/**
+ * Free @param co whether it finished or not; whatever it left on its
+ * stack is dropped, so it must not yield while holding a lock or memory.
+ */
+void coro_free(struct coro *co);
+
+#endif
@@ -0,0 +1,80 @@
+#define _GNU_SOURCE
+#include "cpu.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+static cpu_set_t background;
+static int background_set;
+
+//one number of a CPU list, -1 if there is none
+static long cpu_number(const char *s, char **end)
+{
+	long n = strtol(s, end, 10);
+
+	if(*end == s || n < 0 || n >= CPU_SETSIZE)
+		return -1;
+	return n;
+}
+
+int cpu_parse(const char *list, cpu_set_t *set)
+{
+	CPU_ZERO(set);
+	while(*list != '\0')
+	{
+		char *end;
+		long from = cpu_number(list, &end), to = from;
+
+		if(from == -1)
+			return -1;
+		if(*end == '-' && ((to = cpu_number(end + 1, &end)) == -1 || to < from))
+			return -1;
+		for(; from <= to; from++)
+			CPU_SET(from, set);
+		if(*end == ',')
+			end++;
+		else if(*end != '\0')
+			return -1;
+		list = end;
+	}
+	return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+int cpu_pin(const cpu_set_t *set)
+{
+	int rc = pthread_setaffinity_np(pthread_self(), sizeof(*set), set);
+
+	if(rc != 0)
+	{
+		errno = rc;
+		return -1;
+	}
+	return 0;
+}
+
+int cpu_nth(const cpu_set_t *set, size_t n)
+{
+	int cpu;
+
+	n %= CPU_COUNT(set);
+	for(cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	{
+		if(CPU_ISSET(cpu, set) && n-- == 0)
+			return cpu;
+	}
+	return -1;
+}
+
+void cpu_set_background(const cpu_set_t *set)
+{
+	background = *set;
+	background_set = 1;
+}
+
+void cpu_background(void)
+{
+	//the thread just runs wherever the scheduler puts it
+	if(background_set)
+		cpu_pin(&background);
+}
@@ -0,0 +1,36 @@
+#ifndef AESD_CPU_H
+#define AESD_CPU_H
+
+//needs _GNU_SOURCE for cpu_set_t
+#include <sched.h>
+#include <stddef.h>
+
+/**
+ * Parse a CPU list such as "0-3,8" into @param set.
+ * @return 0 on success, -1 if the list is malformed or empty.
+ */
+int cpu_parse(const char *list, cpu_set_t *set);
+
+/**
+ * Pin the calling thread to the CPUs in @param set.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int cpu_pin(const cpu_set_t *set);
+
+/**
+ * @return the @param n th CPU of @param set, counting around.
+ */
+int cpu_nth(const cpu_set_t *set, size_t n);
+
+/**
+ * Set the CPUs of --background-cpus, taken by cpu_background().
+ */
+void cpu_set_background(const cpu_set_t *set);
+
+/**
+ * Pin the calling background thread (log drain, index scan) to the
+ * CPUs of --background-cpus, if given.
+ */
+void cpu_background(void);
+
+#endif
@@ -0,0 +1,132 @@
+#include "crc32c.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define HAVE_HW_CRC 1
+#elif defined(__aarch64__) && defined(__GNUC__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#define HAVE_HW_CRC 1
+#endif
+
+#define CRC32C_POLY 0x82f63b78u	//reflected Castagnoli polynomial
+
+//slicing-by-8 tables for CPUs without CRC instructions
+static uint32_t table[8][256];
+static uint32_t (*crc_fn)(uint32_t, const unsigned char *, size_t);
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	while(len > 0 && ((uintptr_t)p & 7))
+	{
+		crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while(len >= 8)
+	{
+		uint64_t v;
+		memcpy(&v, p, 8);
+		v ^= crc;
+		crc = table[7][v & 0xff] ^ table[6][(v >> 8) & 0xff] ^
+		      table[5][(v >> 16) & 0xff] ^ table[4][(v >> 24) & 0xff] ^
+		      table[3][(v >> 32) & 0xff] ^ table[2][(v >> 40) & 0xff] ^
+		      table[1][(v >> 48) & 0xff] ^ table[0][v >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while(len-- > 0)
+		crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t c = crc;
+
+	while(len > 0 && ((uintptr_t)p & 7))
+	{
+		c = _mm_crc32_u8(c, *p++);
+		len--;
+	}
+	while(len >= 8)
+	{
+		uint64_t v;
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+		p += 8;
+		len -= 8;
+	}
+	while(len-- > 0)
+		c = _mm_crc32_u8(c, *p++);
+	return c;
+}
+
+static int hw_available(void)
+{
+	return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__) && defined(__GNUC__)
+__attribute__((target("+crc")))
+static uint32_t crc_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	while(len > 0 && ((uintptr_t)p & 7))
+	{
+		crc = __crc32cb(crc, *p++);
+		len--;
+	}
+	while(len >= 8)
+	{
+		uint64_t v;
+		memcpy(&v, p, 8);
+		crc = __crc32cd(crc, v);
+		p += 8;
+		len -= 8;
+	}
+	while(len-- > 0)
+		crc = __crc32cb(crc, *p++);
+	return crc;
+}
+
+static int hw_available(void)
+{
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#endif
+
+static void crc_init(void)
+{
+	uint32_t i, j;
+
+	for(i = 0; i < 256; i++)
+	{
+		uint32_t c = i;
+		for(j = 0; j < 8; j++)
+			c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		table[0][i] = c;
+	}
+	for(i = 0; i < 256; i++)
+	{
+		for(j = 1; j < 8; j++)
+			table[j][i] = table[0][table[j - 1][i] & 0xff] ^ (table[j - 1][i] >> 8);
+	}
+	crc_fn = crc_sw;
+#ifdef HAVE_HW_CRC
+	if(hw_available())
+		crc_fn = crc_hw;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&crc_once, crc_init);
+	return ~crc_fn(~crc, buf, len);
+}
@@ -0,0 +1,15 @@
+#ifndef AESD_CRC32C_H
+#define AESD_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Extend the CRC32C (Castagnoli) @param crc, 0 to start, over
+ * @param len bytes at @param buf. Uses the SSE4.2 or ARMv8 CRC
+ * instructions when the CPU has them and a table otherwise.
+ * @return the updated checksum.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif
@@ -0,0 +1,87 @@
+#include "feed.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mem.h"
+
+int feed_init(struct feed *f, size_t size, uint64_t end)
+{
+	f->ring = mem_realloc(MEM_CACHE, NULL, 0, size);
+	if(f->ring == NULL)
+		return -1;
+	f->size = size;
+	f->start = end;
+	f->end = end;
+	f->subs = NULL;
+	return 0;
+}
+
+void feed_destroy(struct feed *f)
+{
+	while(f->subs != NULL)
+		feed_unsubscribe(f->subs);
+	mem_free(MEM_CACHE, f->ring, f->size);
+	f->ring = NULL;
+}
+
+void feed_publish(struct feed *f, const char *data, size_t len)
+{
+	//only the last f->size bytes of a large packet can stay in the ring
+	if(len > f->size)
+	{
+		f->end += len - f->size;
+		data += len - f->size;
+		len = f->size;
+		f->start = f->end;
+	}
+
+	size_t pos = f->end % f->size;
+	size_t first = f->size - pos < len ? f->size - pos : len;
+	memcpy(f->ring + pos, data, first);
+	memcpy(f->ring, data + first, len - first);
+	f->end += len;
+	if(f->end - f->start > f->size)
+		f->start = f->end - f->size;
+}
+
+void feed_skip(struct feed *f, uint64_t len)
+{
+	f->end += len;
+	f->start = f->end;
+}
+
+size_t feed_peek(const struct feed *f, uint64_t cursor, const char **data)
+{
+	if(cursor < f->start || cursor >= f->end)
+		return 0;
+
+	size_t pos = cursor % f->size;
+	size_t len = f->end - cursor;
+	if(len > f->size - pos)
+		len = f->size - pos;
+	*data = f->ring + pos;
+	return len;
+}
+
+void feed_subscribe(struct feed *f, struct feed_sub *sub)
+{
+	sub->cursor = f->end;
+	sub->skip = 0;
+	sub->next = f->subs;
+	sub->pprev = &f->subs;
+	if(f->subs != NULL)
+		f->subs->pprev = &sub->next;
+	f->subs = sub;
+}
+
+void feed_unsubscribe(struct feed_sub *sub)
+{
+	if(sub->pprev == NULL)
+		return;
+	*sub->pprev = sub->next;
+	if(sub->next != NULL)
+		sub->next->pprev = sub->pprev;
+	sub->next = NULL;
+	sub->pprev = NULL;
+}
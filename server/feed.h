@@ -0,0 +1,64 @@
+#ifndef AESD_FEED_H
+#define AESD_FEED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A subscriber's position in the committed-record stream, as an absolute
+ * log offset. @skip asks for the backlog to be dropped at the next packet
+ * boundary.
+ */
+struct feed_sub {
+	uint64_t cursor;
+	int skip;
+	struct feed_sub *next;
+	struct feed_sub **pprev;
+};
+
+/**
+ * The committed-record stream: a ring holding the most recently committed
+ * log bytes [@start, @end) so live subscribers are fed from memory.
+ * Anything older than @start has to be read back from the log.
+ */
+struct feed {
+	char *ring;
+	size_t size;
+	uint64_t start;
+	uint64_t end;
+	struct feed_sub *subs;
+};
+
+/**
+ * Set up an empty ring of @param size bytes for a log that currently ends
+ * at @param end.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int feed_init(struct feed *f, size_t size, uint64_t end);
+void feed_destroy(struct feed *f);
+
+/**
+ * Append @param len freshly committed bytes to the stream.
+ */
+void feed_publish(struct feed *f, const char *data, size_t len);
+
+/**
+ * Account for @param len committed bytes that were never in memory (a
+ * packet streamed through a stage); subscribers read them from the log.
+ */
+void feed_skip(struct feed *f, uint64_t len);
+
+/**
+ * Point at the bytes available from the ring at @param cursor.
+ * @return number of contiguous bytes at *@param data, 0 if @param cursor
+ * is at the end of the stream or older than the ring.
+ */
+size_t feed_peek(const struct feed *f, uint64_t cursor, const char **data);
+
+/**
+ * Start following the stream from its current end.
+ */
+void feed_subscribe(struct feed *f, struct feed_sub *sub);
+void feed_unsubscribe(struct feed_sub *sub);
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef AESD_FRAME_H
+#define AESD_FRAME_H
+
+#include <stdint.h>
+
+/*********************************************************************
+Binary framing, switched to with the AESDSOCKET_BINARY command. From
+then on everything either way is a frame: an 8 byte header holding the
+opcode, a flags byte (0), two reserved bytes (0) and the payload length
+as a 32 bit big-endian number, followed by the payload. Numbers in
+payloads are 64 bit big-endian. Packets are counted from 0 since the
+log was created, including those dropped by retention.
+
+Client to server:
+  APPEND   the payload is one packet, any bytes; a '\n' is added unless
+           it ends with one. Answered by OK <packet> <end offset>.
+  SEEK     <packet>: where the next REPLAY starts, 0 at first.
+           Answered by OK <packet> <its offset>.
+  REPLAY   [<count>]: one DATA frame per packet from the SEEK position
+           on, at most count of them, then END <next packet>.
+  STATS    answered by STATS, the text of AESDSOCKET_STATS.
+Server to client, besides the answers above: ERROR with a text payload
+for a request it could not carry out, or in place of a DATA frame for a
+packet that fails its checksum.
+**********************************************************************/
+
+#define FRAME_HDR 8
+//payload limit for everything but APPEND
+#define FRAME_ARGS_MAX 64
+
+enum frame_op {
+	FRAME_APPEND = 0x01,
+	FRAME_REPLAY = 0x02,
+	FRAME_SEEK = 0x03,
+	FRAME_STATS = 0x04,
+
+	FRAME_OK = 0x81,
+	FRAME_DATA = 0x82,
+	FRAME_END = 0x83,
+	FRAME_STATS_REPLY = 0x84,
+	FRAME_ERROR = 0x85,
+};
+
+static inline void frame_put64(char *p, uint64_t v)
+{
+	int i;
+
+	for(i = 7; i >= 0; i--, v >>= 8)
+		p[i] = v & 0xff;
+}
+
+static inline uint64_t frame_get64(const char *p)
+{
+	uint64_t v = 0;
+	int i;
+
+	for(i = 0; i < 8; i++)
+		v = v << 8 | (unsigned char)p[i];
+	return v;
+}
+
+static inline void frame_put(char *p, enum frame_op op, uint32_t len)
+{
+	p[0] = op;
+	p[1] = p[2] = p[3] = 0;
+	p[4] = len >> 24;
+	p[5] = len >> 16;
+	p[6] = len >> 8;
+	p[7] = len;
+}
+
+static inline uint32_t frame_len(const char *p)
+{
+	return (uint32_t)(unsigned char)p[4] << 24 | (uint32_t)(unsigned char)p[5] << 16 |
+		(uint32_t)(unsigned char)p[6] << 8 | (unsigned char)p[7];
+}
+
+#endif
@@ -0,0 +1,316 @@
+#define _GNU_SOURCE
+#include "index.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cpu.h"
+
+#define INDEX_MAGIC 0x3358444944534541ULL	//"AESDIDX3"
+#define INDEX_INITIAL_CAP 4096
+#define SCAN_CHUNK (1024 * 1024)
+//ranges smaller than this are not worth the thread start-up
+#define SCAN_PARALLEL_MIN (8 * SCAN_CHUNK)
+#define SCAN_MAX_THREADS 8
+
+static size_t map_size(size_t cap)
+{
+	return sizeof(struct index_hdr) + cap * sizeof(uint64_t);
+}
+
+static int index_map(struct pindex *ix, size_t cap)
+{
+	void *m;
+
+	if(ix->crc_fd != -1)
+	{
+		if(ftruncate(ix->crc_fd, cap * sizeof(uint32_t)) == -1)
+			return -1;
+		if(ix->crcs == NULL)
+			m = mmap(NULL, cap * sizeof(uint32_t), PROT_READ | PROT_WRITE, MAP_SHARED, ix->crc_fd, 0);
+		else
+			m = mremap(ix->crcs, ix->cap * sizeof(uint32_t), cap * sizeof(uint32_t), MREMAP_MAYMOVE);
+		if(m == MAP_FAILED)
+			return -1;
+		ix->crcs = m;
+	}
+	if(ftruncate(ix->fd, map_size(cap)) == -1)
+		return -1;
+	if(ix->hdr == NULL)
+		m = mmap(NULL, map_size(cap), PROT_READ | PROT_WRITE, MAP_SHARED, ix->fd, 0);
+	else
+		m = mremap(ix->hdr, map_size(ix->cap), map_size(cap), MREMAP_MAYMOVE);
+	if(m == MAP_FAILED)
+		return -1;
+	ix->hdr = m;
+	ix->ends = (uint64_t *)(ix->hdr + 1);
+	ix->cap = cap;
+	return 0;
+}
+
+int index_open(struct pindex *ix, const char *path, const char *crc_path, uint64_t ino)
+{
+	struct stat sb;
+	size_t cap = INDEX_INITIAL_CAP;
+	off_t crc_size = 0;
+	int fresh = 0;
+
+	snprintf(ix->path, sizeof(ix->path), "%s", path);
+	ix->hdr = NULL;
+	ix->crcs = NULL;
+	ix->count = 0;
+	ix->crc_fd = -1;
+	ix->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if(ix->fd == -1)
+		return -1;
+	if(crc_path != NULL && (ix->crc_fd = open(crc_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1)
+		goto fail;
+	if(ix->crc_fd != -1)
+	{
+		if(fstat(ix->crc_fd, &sb) == -1)
+			goto fail;
+		crc_size = sb.st_size;
+	}
+	if(fstat(ix->fd, &sb) == -1)
+		goto fail;
+
+	if((size_t)sb.st_size < sizeof(struct index_hdr))
+		fresh = 1;
+	else if((size_t)sb.st_size > map_size(cap))
+		cap = (sb.st_size - sizeof(struct index_hdr)) / sizeof(uint64_t);
+	if(index_map(ix, cap) == -1)
+		goto fail;
+
+	//a checkpoint is only usable if it was written for this very log and
+	//its header is self-consistent, otherwise start from scratch
+	if(!fresh && ix->hdr->magic == INDEX_MAGIC && ix->hdr->ino == ino &&
+	   ix->hdr->count <= ix->cap &&
+	   (ix->hdr->count ? ix->ends[ix->hdr->count - 1] : 0) == ix->hdr->covered)
+		ix->count = ix->hdr->count;
+	else
+	{
+		ix->hdr->head = 0;
+		//checksums recorded for some other log are worthless
+		ix->hdr->crc_from = INDEX_NO_CRC;
+	}
+	//the checksum file is missing or was cut short since
+	if(ix->crc_fd == -1 || (uint64_t)crc_size < ix->count * sizeof(uint32_t))
+		ix->hdr->crc_from = INDEX_NO_CRC;
+	ix->hdr->magic = INDEX_MAGIC;
+	ix->hdr->ino = ino;
+	index_checkpoint(ix);
+	return 0;
+fail:
+	if(ix->crcs != NULL)
+		munmap(ix->crcs, ix->cap * sizeof(uint32_t));
+	if(ix->hdr != NULL)
+		munmap(ix->hdr, map_size(ix->cap));
+	if(ix->crc_fd != -1)
+		close(ix->crc_fd);
+	close(ix->fd);
+	ix->hdr = NULL;
+	ix->crcs = NULL;
+	ix->fd = ix->crc_fd = -1;
+	return -1;
+}
+
+void index_close(struct pindex *ix)
+{
+	if(ix->hdr != NULL)
+	{
+		index_checkpoint(ix);
+		munmap(ix->hdr, map_size(ix->cap));
+	}
+	if(ix->crcs != NULL)
+		munmap(ix->crcs, ix->cap * sizeof(uint32_t));
+	if(ix->fd != -1)
+		close(ix->fd);
+	if(ix->crc_fd != -1)
+		close(ix->crc_fd);
+	ix->hdr = NULL;
+	ix->crcs = NULL;
+	ix->fd = ix->crc_fd = -1;
+}
+
+int index_push(struct pindex *ix, uint64_t end)
+{
+	if(ix->count == ix->cap && index_map(ix, ix->cap * 2) == -1)
+		return -1;
+	ix->ends[ix->count++] = end;
+	return 0;
+}
+
+void index_truncate(struct pindex *ix, size_t count)
+{
+	if(count < ix->count)
+		ix->count = count;
+	if(ix->hdr->head > index_end(ix))
+		ix->hdr->head = index_end(ix);
+	if(count < ix->hdr->count)
+		index_checkpoint(ix);
+}
+
+void index_checkpoint(struct pindex *ix)
+{
+	//count and covered are checked against each other on load, so a
+	//restart between these two stores just discards the checkpoint
+	ix->hdr->count = ix->count;
+	ix->hdr->covered = index_end(ix);
+	ix->checkpointed = ix->hdr->covered;
+}
+
+size_t index_find(const struct pindex *ix, uint64_t off)
+{
+	size_t lo = 0, hi = ix->count;
+
+	//first packet ending after off
+	while(lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		if(ix->ends[mid] > off)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+/*********************************************************************
+Parallel tail scan: each thread collects the newline offsets of its own
+slice of the log, the slices are then merged in order into the index.
+**********************************************************************/
+struct scan_slice
+{
+	pthread_t thread;
+	index_read_fn rd;
+	void *arg;
+	off_t from;
+	off_t to;
+	uint64_t *ends;
+	size_t count;
+	size_t cap;
+	int err;
+};
+
+static void *scan_thread(void *arg)
+{
+	struct scan_slice *s = arg;
+	char *buf = malloc(SCAN_CHUNK);
+	off_t off = s->from;
+
+	if(buf == NULL)
+	{
+		s->err = ENOMEM;
+		return s;
+	}
+	while(off < s->to)
+	{
+		size_t want = s->to - off < SCAN_CHUNK ? s->to - off : SCAN_CHUNK;
+		ssize_t rd = s->rd(s->arg, buf, want, off);
+		if(rd == -1 && errno == EINTR)
+			continue;
+		if(rd <= 0)
+		{
+			s->err = rd == 0 ? EIO : errno;
+			break;
+		}
+		char *p = buf, *end = buf + rd, *nl;
+		while((nl = memchr(p, '\n', end - p)) != NULL)
+		{
+			if(s->count == s->cap)
+			{
+				size_t cap = s->cap ? s->cap * 2 : 1024;
+				uint64_t *n = realloc(s->ends, cap * sizeof(uint64_t));
+				if(n == NULL)
+				{
+					s->err = ENOMEM;
+					goto out;
+				}
+				s->ends = n;
+				s->cap = cap;
+			}
+			s->ends[s->count++] = off + (nl - buf) + 1;
+			p = nl + 1;
+		}
+		off += rd;
+	}
+out:
+	free(buf);
+	return s;
+}
+
+//a helper thread scanning a slice, kept off the CPUs serving clients
+static void *scan_main(void *arg)
+{
+	cpu_background();
+	return scan_thread(arg);
+}
+
+int index_scan(struct pindex *ix, index_read_fn rd, void *arg, off_t from, off_t to)
+{
+	struct scan_slice slices[SCAN_MAX_THREADS];
+	long nthreads = 1;
+	int i, err = 0;
+
+	if(to <= from)
+		return 0;
+	if(to - from >= SCAN_PARALLEL_MIN)
+	{
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+		if(nthreads < 1)
+			nthreads = 1;
+		if(nthreads > SCAN_MAX_THREADS)
+			nthreads = SCAN_MAX_THREADS;
+	}
+
+	off_t step = (to - from) / nthreads;
+	memset(slices, 0, sizeof(slices));
+	for(i = 0; i < nthreads; i++)
+	{
+		slices[i].rd = rd;
+		slices[i].arg = arg;
+		slices[i].from = from + step * i;
+		slices[i].to = i == nthreads - 1 ? to : from + step * (i + 1);
+	}
+	//slice 0 runs on the calling thread
+	for(i = 1; i < nthreads; i++)
+	{
+		if(pthread_create(&slices[i].thread, NULL, scan_main, &slices[i]) != 0)
+		{
+			scan_thread(&slices[i]);
+			slices[i].thread = 0;
+		}
+	}
+	scan_thread(&slices[0]);
+	for(i = 1; i < nthreads; i++)
+	{
+		if(slices[i].thread)
+			pthread_join(slices[i].thread, NULL);
+	}
+
+	for(i = 0; i < nthreads; i++)
+	{
+		size_t j;
+		if(slices[i].err && !err)
+			err = slices[i].err;
+		for(j = 0; j < slices[i].count && !err; j++)
+		{
+			if(index_push(ix, slices[i].ends[j]) == -1)
+				err = errno;
+		}
+		free(slices[i].ends);
+	}
+	if(err)
+	{
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,111 @@
+#ifndef AESD_INDEX_H
+#define AESD_INDEX_H
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * On-disk header of the packet-boundary index. The index file is this
+ * header followed by one uint64_t per packet holding the log offset just
+ * past the packet's '\n'. Only the first @count entries are trusted, and
+ * only while the last of them equals @covered. Packets before the log
+ * offset @head were dropped by retention. Packets from number @crc_from
+ * on have their CRC32C in the checksum file, INDEX_NO_CRC if none do.
+ */
+struct index_hdr {
+	uint64_t magic;
+	uint64_t ino;
+	uint64_t count;
+	uint64_t covered;
+	uint64_t head;
+	uint64_t crc_from;
+};
+
+#define INDEX_NO_CRC UINT64_MAX
+
+/**
+ * Packet-boundary index, kept in a shared mapping of the index file so the
+ * checkpoint is simply publishing the header and a restart only has to map
+ * the file back in. With checksums on, @crcs maps a second file holding
+ * one CRC32C per packet, in step with @ends.
+ */
+struct pindex {
+	int fd;
+	int crc_fd;
+	char path[PATH_MAX];
+	struct index_hdr *hdr;
+	uint64_t *ends;
+	uint32_t *crcs;
+	size_t count;
+	size_t cap;
+	uint64_t checkpointed;
+};
+
+/**
+ * Map the index stored at @param path for the log with inode @param ino,
+ * starting empty if the file is missing or belongs to another log. The
+ * checksum file @param crc_path is mapped as well unless it is NULL.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int index_open(struct pindex *ix, const char *path, const char *crc_path, uint64_t ino);
+
+/**
+ * Publish and unmap the index.
+ */
+void index_close(struct pindex *ix);
+
+/**
+ * Record a packet ending at log offset @param end.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int index_push(struct pindex *ix, uint64_t end);
+
+/**
+ * Forget every packet after the first @param count.
+ */
+void index_truncate(struct pindex *ix, size_t count);
+
+/**
+ * Publish the entries recorded so far so a restart can trust them.
+ */
+void index_checkpoint(struct pindex *ix);
+
+/**
+ * @return log offset just past the last indexed packet.
+ */
+static inline uint64_t index_end(const struct pindex *ix)
+{
+	return ix->count ? ix->ends[ix->count - 1] : 0;
+}
+
+/**
+ * @return log offset where packet @param i starts.
+ */
+static inline uint64_t index_start(const struct pindex *ix, size_t i)
+{
+	return i ? ix->ends[i - 1] : 0;
+}
+
+/**
+ * @return number of the packet holding log offset @param off, or the
+ * packet count if @param off is past the last indexed packet.
+ */
+size_t index_find(const struct pindex *ix, uint64_t off);
+
+/**
+ * Reads log bytes for index_scan(), from several threads at once.
+ * @return number of bytes read, 0 at the end, -1 with errno set on error.
+ */
+typedef ssize_t (*index_read_fn)(void *arg, char *buf, size_t len, off_t off);
+
+/**
+ * Index every packet ending in the log read through @param rd between
+ * @param from and @param to, splitting the range across threads when it
+ * is large.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int index_scan(struct pindex *ix, index_read_fn rd, void *arg, off_t from, off_t to);
+
+#endif
@@ -0,0 +1,267 @@
+#define _GNU_SOURCE
+#include "journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "log.h"
+
+#define JOURNAL_MAGIC 0x314c4e5244534541ULL	//"AESDRNL1"
+#define RECORD_MAGIC 0x4443524aU		//"JRCD"
+
+//at the start of block 0, the rest of it is zero
+struct journal_hdr {
+	uint64_t magic;
+	uint64_t gen;
+};
+
+//in front of the data of every record
+struct journal_rec {
+	uint32_t magic;
+	//CRC32C of the fields below
+	uint32_t hcrc;
+	uint64_t gen;
+	uint64_t off;
+	uint64_t len;
+	//CRC32C of the data
+	uint32_t crc;
+	uint32_t pad;
+};
+
+static uint32_t rec_crc(const struct journal_rec *rec)
+{
+	return crc32c(0, &rec->gen, sizeof(*rec) - offsetof(struct journal_rec, gen));
+}
+
+static int pread_full(int fd, void *buf, size_t len, off_t off)
+{
+	char *p = buf;
+
+	while(len > 0)
+	{
+		ssize_t rd = pread(fd, p, len, off);
+		if(rd == -1 && errno == EINTR)
+			continue;
+		if(rd <= 0)
+		{
+			if(rd == 0)
+				errno = EIO;
+			return -1;
+		}
+		p += rd;
+		off += rd;
+		len -= rd;
+	}
+	return 0;
+}
+
+//with O_DIRECT every piece has to stay block aligned, which the kernel
+//only breaks on errors
+static int pwrite_full(int fd, const char *buf, size_t len, off_t off)
+{
+	while(len > 0)
+	{
+		ssize_t wr = pwrite(fd, buf, len, off);
+		if(wr == -1)
+		{
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += wr;
+		off += wr;
+		len -= wr;
+	}
+	return 0;
+}
+
+//write out the buffer up to the block holding its last byte, zero padded,
+//and keep only that partial block
+static int journal_flush(struct journal *jn)
+{
+	size_t end = (jn->len + JOURNAL_BLOCK - 1) & ~(size_t)(JOURNAL_BLOCK - 1);
+	size_t full = jn->len & ~(size_t)(JOURNAL_BLOCK - 1);
+
+	if(jn->len == 0)
+		return 0;
+	memset(jn->buf + jn->len, 0, end - jn->len);
+	if(pwrite_full(jn->fd, jn->buf, end, jn->base) == -1)
+		return -1;
+	if(full > 0)
+	{
+		memmove(jn->buf, jn->buf + full, jn->len - full);
+		jn->base += full;
+		jn->len -= full;
+	}
+	return 0;
+}
+
+static int journal_put(struct journal *jn, const void *data, size_t len)
+{
+	const char *p = data;
+
+	while(len > 0)
+	{
+		size_t n = JOURNAL_BUF - jn->len;
+
+		if(n == 0)
+		{
+			if(journal_flush(jn) == -1)
+				return -1;
+			continue;
+		}
+		if(n > len)
+			n = len;
+		memcpy(jn->buf + jn->len, p, n);
+		jn->len += n;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int journal_open(struct journal *jn, const char *path)
+{
+	struct journal_hdr hdr;
+
+	jn->buf = NULL;
+	jn->direct = 1;
+	jn->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | O_DIRECT | O_DSYNC, 0644);
+	if(jn->fd == -1 && errno == EINVAL)
+	{
+		//tmpfs and friends have no direct I/O, O_DSYNC alone still
+		//makes every write durable before it returns
+		log_warn("%s: no O_DIRECT on this filesystem, journal goes through the page cache", path);
+		jn->direct = 0;
+		jn->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | O_DSYNC, 0644);
+	}
+	if(jn->fd == -1)
+		return -1;
+	if((errno = posix_memalign((void **)&jn->buf, JOURNAL_BLOCK, JOURNAL_BUF)) != 0)
+	{
+		jn->buf = NULL;
+		goto fail;
+	}
+	//records of earlier generations must never look current
+	jn->gen = 0;
+	if(pread_full(jn->fd, jn->buf, JOURNAL_BLOCK, 0) == 0)
+	{
+		memcpy(&hdr, jn->buf, sizeof(hdr));
+		if(hdr.magic == JOURNAL_MAGIC)
+			jn->gen = hdr.gen;
+	}
+	if(journal_reset(jn) == -1)
+		goto fail;
+	return 0;
+fail:
+	journal_close(jn);
+	return -1;
+}
+
+void journal_close(struct journal *jn)
+{
+	if(jn->fd != -1)
+		close(jn->fd);
+	free(jn->buf);
+	jn->buf = NULL;
+	jn->fd = -1;
+}
+
+int journal_reset(struct journal *jn)
+{
+	struct journal_hdr hdr = { .magic = JOURNAL_MAGIC, .gen = jn->gen + 1 };
+
+	memset(jn->buf, 0, JOURNAL_BLOCK);
+	memcpy(jn->buf, &hdr, sizeof(hdr));
+	if(pwrite_full(jn->fd, jn->buf, JOURNAL_BLOCK, 0) == -1)
+		return -1;
+	jn->gen = hdr.gen;
+	jn->base = JOURNAL_BLOCK;
+	jn->len = 0;
+	return 0;
+}
+
+int journal_write(struct journal *jn, off_t off, const struct iovec *iov, int cnt)
+{
+	static const char zeros[8];
+	struct journal_rec rec = { .magic = RECORD_MAGIC, .gen = jn->gen, .off = off };
+	int i;
+
+	for(i = 0; i < cnt; i++)
+	{
+		rec.len += iov[i].iov_len;
+		rec.crc = crc32c(rec.crc, iov[i].iov_base, iov[i].iov_len);
+	}
+	rec.hcrc = rec_crc(&rec);
+	if(journal_put(jn, &rec, sizeof(rec)) == -1)
+		return -1;
+	for(i = 0; i < cnt; i++)
+	{
+		if(journal_put(jn, iov[i].iov_base, iov[i].iov_len) == -1)
+			return -1;
+	}
+	if(journal_put(jn, zeros, -(size_t)journal_size(jn) & 7) == -1)
+		return -1;
+	return journal_flush(jn);
+}
+
+ssize_t journal_replay(const char *path,
+		       int (*fn)(void *arg, off_t off, const char *buf, size_t len), void *arg)
+{
+	struct journal_hdr hdr;
+	struct journal_rec rec;
+	struct stat sb;
+	char *data = NULL;
+	size_t cap = 0;
+	ssize_t count = 0;
+	off_t pos = JOURNAL_BLOCK;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if(fd == -1)
+		return errno == ENOENT ? 0 : -1;
+	if(fstat(fd, &sb) == -1)
+		goto fail;
+	if(sb.st_size < JOURNAL_BLOCK || pread_full(fd, &hdr, sizeof(hdr), 0) == -1 ||
+	   hdr.magic != JOURNAL_MAGIC)
+		goto out;
+	while(pos + (off_t)sizeof(rec) <= sb.st_size)
+	{
+		if(pread_full(fd, &rec, sizeof(rec), pos) == -1)
+			goto fail;
+		pos += sizeof(rec);
+		if(rec.magic != RECORD_MAGIC || rec.gen != hdr.gen || rec.hcrc != rec_crc(&rec) ||
+		   rec.len > (uint64_t)(sb.st_size - pos))
+			break;
+		if(rec.len > cap)
+		{
+			char *n = realloc(data, rec.len);
+			if(n == NULL)
+				goto fail;
+			data = n;
+			cap = rec.len;
+		}
+		if(pread_full(fd, data, rec.len, pos) == -1)
+			goto fail;
+		//torn on the way to the disk, nothing after it was acknowledged
+		if(crc32c(0, data, rec.len) != rec.crc)
+			break;
+		if(fn(arg, rec.off, data, rec.len) == -1)
+			goto fail;
+		count++;
+		pos += (rec.len + 7) & ~(uint64_t)7;
+	}
+out:
+	free(data);
+	close(fd);
+	return count;
+fail:
+	free(data);
+	close(fd);
+	return -1;
+}
@@ -0,0 +1,86 @@
+#ifndef AESD_JOURNAL_H
+#define AESD_JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*********************************************************************
+Write-ahead journal for --durability=journal, kept next to the log as
+<log>.wal. Packets are copied into a block-aligned buffer and written
+out with O_DIRECT | O_DSYNC, so a commit costs one write to the device
+and never waits for (or sets off) page cache writeback of the log,
+which is written through the page cache as usual and synced only when
+the journal wraps.
+
+Block 0 holds the generation, records follow from JOURNAL_BLOCK on:
+a header naming the log offset and length with CRC32Cs of itself and
+the data, then the data, padded to 8 bytes. The last block is written
+zero-padded and rewritten with the next record, so the first record
+that does not check out, a zero header, an older generation or a torn
+write, marks the end. Starting a new generation forgets every record
+at once, without touching them.
+**********************************************************************/
+
+#define JOURNAL_BLOCK 4096
+//records are gathered in this many bytes before they have to be written
+#define JOURNAL_BUF (1024 * 1024)
+//the log is synced and the journal starts over once it grows past this
+#define JOURNAL_MAX (64 * 1024 * 1024)
+
+/**
+ * An open journal; @buf holds the journal from offset @base on, @len
+ * bytes of it, of which everything but the last partial block is on
+ * disk already. @direct is clear where the filesystem refused O_DIRECT.
+ */
+struct journal {
+	int fd;
+	int direct;
+	uint64_t gen;
+	char *buf;
+	size_t len;
+	off_t base;
+};
+
+/**
+ * Open or create the journal at @param path and start a new generation
+ * in it, whatever it held is dropped; replay it first.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int journal_open(struct journal *jn, const char *path);
+void journal_close(struct journal *jn);
+
+/**
+ * Call @param fn with the log offset, data and length of every record
+ * of the last generation of the journal at @param path, in order. A
+ * missing journal has none.
+ * @return the number of records, -1 with errno set on failure or when
+ * @param fn fails.
+ */
+ssize_t journal_replay(const char *path,
+		       int (*fn)(void *arg, off_t off, const char *buf, size_t len), void *arg);
+
+/**
+ * Journal the bytes of @param iov (@param cnt of them) that go to the
+ * log at @param off, and return once they are on disk.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int journal_write(struct journal *jn, off_t off, const struct iovec *iov, int cnt);
+
+/**
+ * Start a new generation, once everything journaled so far is safe in
+ * the log.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int journal_reset(struct journal *jn);
+
+/**
+ * @return the bytes the current generation takes in the journal.
+ */
+static inline off_t journal_size(const struct journal *jn)
+{
+	return jn->base + jn->len;
+}
+
+#endif
@@ -0,0 +1,407 @@
+#define _GNU_SOURCE
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "crc32c.h"
+
+//messages queued per thread, and the longest one kept
+#define LOG_SLOTS 256
+#define LOG_LINE_MAX 480
+//how often the drain thread looks at the rings when nobody wakes it
+#define LOG_FLUSH_MS 50
+//formatted lines are written out in batches of up to this many bytes
+#define LOG_BATCH (64 * 1024)
+//times one message is written per second, further repeats are counted
+#define LOG_BURST 20
+//messages told apart when counting repeats
+#define LOG_REPEATS 64
+
+struct log_slot {
+	uint64_t ns;
+	uint16_t len;
+	uint8_t level;
+	char text[LOG_LINE_MAX];
+};
+
+/**
+ * Message ring of one thread. The thread is the only producer and moves
+ * @head after filling a slot, the drain thread is the only consumer and
+ * moves @tail once the slot is written out. @dead is set when the thread
+ * exits, the ring is freed once it is empty.
+ */
+struct log_ring {
+	_Atomic uint64_t head;
+	_Atomic uint64_t tail;
+	_Atomic int dead;
+	struct log_ring *next;
+	struct log_slot slots[LOG_SLOTS];
+};
+
+_Atomic int log_threshold = LEVEL_INFO;
+
+static const char *const level_names[] = { "error", "warn", "info", "debug" };
+static const int syslog_prio[] = { LOG_ERR, LOG_WARNING, LOG_INFO, LOG_DEBUG };
+
+//the ring list only changes when a thread logs for the first time or
+//after it exited, writers never take the lock otherwise
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct log_ring *rings;
+static pthread_key_t ring_key;
+static __thread struct log_ring *my_ring;
+
+static pthread_t drain;
+static _Atomic int running;
+static _Atomic int stopping;
+static _Atomic int sleeping;
+static _Atomic uint64_t dropped;
+static int wake_fd = -1;
+static int out_fd = STDOUT_FILENO;
+static int use_syslog;
+
+/**
+ * A message the drain thread wrote in the current second: @count times
+ * so far, @suppressed of them held back, the last at @last_ns.
+ */
+struct log_repeat {
+	uint32_t hash;
+	uint32_t count;
+	uint32_t suppressed;
+	uint64_t last_ns;
+	struct log_slot msg;
+};
+
+//only touched by the drain thread, or once it is gone
+static char batch[LOG_BATCH];
+static size_t batch_len;
+static struct log_repeat repeats[LOG_REPEATS];
+static uint64_t repeat_second;
+
+static void batch_flush(void)
+{
+	size_t off = 0;
+
+	while(off < batch_len)
+	{
+		ssize_t wr = write(out_fd, batch + off, batch_len - off);
+		if(wr == -1 && errno == EINTR)
+			continue;
+		//nowhere left to report it
+		if(wr <= 0)
+			break;
+		off += wr;
+	}
+	batch_len = 0;
+}
+
+static void emit(const struct log_slot *s)
+{
+	time_t sec = s->ns / 1000000000;
+	struct tm tm;
+
+	if(use_syslog)
+	{
+		syslog(syslog_prio[s->level], "%.*s", s->len, s->text);
+		return;
+	}
+	if(batch_len + LOG_LINE_MAX + 64 > sizeof(batch))
+		batch_flush();
+	localtime_r(&sec, &tm);
+	batch_len += strftime(batch + batch_len, sizeof(batch) - batch_len, "%F %T", &tm);
+	batch_len += snprintf(batch + batch_len, sizeof(batch) - batch_len, ".%03u %-5s %.*s\n",
+			      (unsigned)(s->ns / 1000000 % 1000), level_names[s->level], s->len, s->text);
+}
+
+//write out how often @r was held back and forget it
+static void repeat_report(struct log_repeat *r)
+{
+	struct log_slot s = r->msg;
+	int len;
+
+	if(r->suppressed > 0)
+	{
+		len = snprintf(s.text + s.len, sizeof(s.text) - s.len,
+			       " (%u identical messages suppressed)", r->suppressed);
+		s.len = s.len + len < sizeof(s.text) ? s.len + len : sizeof(s.text) - 1;
+		s.ns = r->last_ns;
+		emit(&s);
+	}
+	r->count = r->suppressed = 0;
+}
+
+//report what the second before @ns held back, once it is over
+static void repeats_turn(uint64_t ns)
+{
+	size_t i;
+
+	if(ns / 1000000000 <= repeat_second)
+		return;
+	for(i = 0; i < LOG_REPEATS; i++)
+		repeat_report(&repeats[i]);
+	repeat_second = ns / 1000000000;
+}
+
+/*********************************************************************
+@return non-zero if @s repeats a message already written LOG_BURST times
+this second, to be counted instead. Messages are told apart by their
+text and level, through a table indexed by the CRC32C of the text: a
+different message taking the slot reports the one it replaces.
+**********************************************************************/
+static int repeat_limited(const struct log_slot *s)
+{
+	uint32_t hash = crc32c(s->level, s->text, s->len);
+	struct log_repeat *r = &repeats[hash % LOG_REPEATS];
+
+	repeats_turn(s->ns);
+	if(r->count == 0 || r->hash != hash || r->msg.level != s->level ||
+	   r->msg.len != s->len || memcmp(r->msg.text, s->text, s->len) != 0)
+	{
+		repeat_report(r);
+		r->hash = hash;
+		r->msg = *s;
+	}
+	if(++r->count <= LOG_BURST)
+		return 0;
+	r->suppressed++;
+	r->last_ns = s->ns;
+	return 1;
+}
+
+static void ring_exit(void *arg)
+{
+	struct log_ring *r = arg;
+
+	atomic_store_explicit(&r->dead, 1, memory_order_release);
+}
+
+static struct log_ring *ring_get(void)
+{
+	struct log_ring *r = my_ring;
+
+	if(r != NULL)
+		return r;
+	if((r = calloc(1, sizeof(*r))) == NULL)
+		return NULL;
+	pthread_mutex_lock(&rings_lock);
+	r->next = rings;
+	rings = r;
+	pthread_mutex_unlock(&rings_lock);
+	pthread_setspecific(ring_key, r);
+	my_ring = r;
+	return r;
+}
+
+/*********************************************************************
+Write out every queued message, oldest first across all the threads,
+then report what was dropped and free the rings of threads that exited.
+**********************************************************************/
+static void drain_rings(void)
+{
+	struct log_ring *r, **pr;
+	struct timespec ts;
+	uint64_t lost;
+
+	pthread_mutex_lock(&rings_lock);
+	for(;;)
+	{
+		struct log_ring *best = NULL;
+		uint64_t best_ns = 0;
+
+		for(r = rings; r != NULL; r = r->next)
+		{
+			uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+			if(tail == atomic_load_explicit(&r->head, memory_order_acquire))
+				continue;
+			if(best == NULL || r->slots[tail % LOG_SLOTS].ns < best_ns)
+			{
+				best = r;
+				best_ns = r->slots[tail % LOG_SLOTS].ns;
+			}
+		}
+		if(best == NULL)
+			break;
+		uint64_t tail = atomic_load_explicit(&best->tail, memory_order_relaxed);
+		if(!repeat_limited(&best->slots[tail % LOG_SLOTS]))
+			emit(&best->slots[tail % LOG_SLOTS]);
+		atomic_store_explicit(&best->tail, tail + 1, memory_order_release);
+	}
+	//the second may be over with nothing else logged
+	clock_gettime(CLOCK_REALTIME, &ts);
+	repeats_turn((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+	if((lost = atomic_exchange_explicit(&dropped, 0, memory_order_relaxed)) > 0)
+	{
+		struct log_slot s = { .level = LEVEL_WARN };
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		s.ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+		s.len = snprintf(s.text, sizeof(s.text), "%llu log messages dropped, ring full",
+				 (unsigned long long)lost);
+		emit(&s);
+	}
+	for(pr = &rings; (r = *pr) != NULL;)
+	{
+		if(atomic_load_explicit(&r->dead, memory_order_acquire) &&
+		   atomic_load_explicit(&r->tail, memory_order_relaxed) ==
+		   atomic_load_explicit(&r->head, memory_order_acquire))
+		{
+			*pr = r->next;
+			free(r);
+		}
+		else
+			pr = &r->next;
+	}
+	pthread_mutex_unlock(&rings_lock);
+	batch_flush();
+}
+
+static void *drain_main(void *arg)
+{
+	struct pollfd p = { .fd = wake_fd, .events = POLLIN };
+	uint64_t v;
+
+	cpu_background();
+	while(!atomic_load(&stopping))
+	{
+		drain_rings();
+		atomic_store(&sleeping, 1);
+		if(poll(&p, 1, LOG_FLUSH_MS) > 0 && read(wake_fd, &v, sizeof(v)) == -1 && errno != EAGAIN)
+			break;
+		atomic_store(&sleeping, 0);
+	}
+	drain_rings();
+	return NULL;
+}
+
+static void wake_drain(void)
+{
+	uint64_t one = 1;
+
+	if(write(wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+		return;
+}
+
+void log_write(enum log_level level, const char *fmt, ...)
+{
+	int saved = errno, len;
+	struct log_slot local, *s = &local;
+	struct log_ring *r = NULL;
+	struct timespec ts;
+	uint64_t head = 0;
+	va_list ap;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	if(atomic_load_explicit(&running, memory_order_acquire))
+	{
+		r = ring_get();
+		head = r ? atomic_load_explicit(&r->head, memory_order_relaxed) : 0;
+		if(r == NULL || head - atomic_load_explicit(&r->tail, memory_order_acquire) == LOG_SLOTS)
+		{
+			atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+			errno = saved;
+			return;
+		}
+		s = &r->slots[head % LOG_SLOTS];
+	}
+
+	va_start(ap, fmt);
+	errno = saved;
+	len = vsnprintf(s->text, sizeof(s->text), fmt, ap);
+	va_end(ap);
+	if(len < 0)
+		len = 0;
+	if(len >= (int)sizeof(s->text))
+		len = sizeof(s->text) - 1;
+	s->len = len;
+	s->level = level;
+	s->ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+	if(r == NULL)
+	{
+		//no drain thread yet or any more, write it out right here
+		static pthread_mutex_t direct_lock = PTHREAD_MUTEX_INITIALIZER;
+
+		pthread_mutex_lock(&direct_lock);
+		emit(s);
+		batch_flush();
+		pthread_mutex_unlock(&direct_lock);
+	}
+	else
+	{
+		atomic_store_explicit(&r->head, head + 1, memory_order_release);
+		//a ring filling up does not wait for the next periodic drain
+		if(head + 1 - atomic_load_explicit(&r->tail, memory_order_relaxed) > LOG_SLOTS / 2 &&
+		   atomic_exchange(&sleeping, 0))
+			wake_drain();
+	}
+	errno = saved;
+}
+
+int log_open(const char *target)
+{
+	sigset_t all, old;
+	int rc;
+
+	if(strcmp(target, "syslog") == 0)
+	{
+		openlog("aesdsocket", LOG_PID, LOG_USER);
+		use_syslog = 1;
+	}
+	else if(strcmp(target, "stdout") != 0 &&
+		(out_fd = open(target, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) == -1)
+	{
+		out_fd = STDOUT_FILENO;
+		return -1;
+	}
+	if((wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ||
+	   pthread_key_create(&ring_key, ring_exit) != 0)
+		return -1;
+
+	//signals are for the epoll loop, never the drain thread
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	atomic_store(&running, 1);
+	rc = pthread_create(&drain, NULL, drain_main, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if(rc != 0)
+	{
+		atomic_store(&running, 0);
+		errno = rc;
+		return -1;
+	}
+	return 0;
+}
+
+void log_close(void)
+{
+	if(!atomic_load(&running))
+		return;
+	atomic_store(&stopping, 1);
+	wake_drain();
+	pthread_join(drain, NULL);
+	atomic_store(&running, 0);
+	//anything logged while the thread was stopping, and what was held back
+	drain_rings();
+	repeats_turn(UINT64_MAX);
+	close(wake_fd);
+	wake_fd = -1;
+	if(use_syslog)
+		closelog();
+	else if(out_fd != STDOUT_FILENO)
+		close(out_fd);
+	use_syslog = 0;
+	out_fd = STDOUT_FILENO;
+}
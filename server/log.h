@@ -0,0 +1,56 @@
+#ifndef AESD_LOG_H
+#define AESD_LOG_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+enum log_level {
+	LEVEL_ERROR,
+	LEVEL_WARN,
+	LEVEL_INFO,
+	LEVEL_DEBUG,
+};
+
+//messages above this level are compiled out, e.g. make LOG_MAX_LEVEL=LEVEL_INFO
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LEVEL_DEBUG
+#endif
+
+//messages above this level are skipped at run time, see --log-level
+extern _Atomic int log_threshold;
+
+/**
+ * Log a printf-style message; "%m" is the current errno. The message is
+ * formatted into a ring owned by the calling thread and written out by
+ * a background thread, so the caller never waits for the log target.
+ * A message that finds the ring full is dropped and counted, and one
+ * repeated word for word is written LOG_BURST times a second at most.
+ */
+#define log_at(level, ...) do { \
+	if((level) <= LOG_MAX_LEVEL && \
+	   (int)(level) <= atomic_load_explicit(&log_threshold, memory_order_relaxed)) \
+		log_write((level), __VA_ARGS__); \
+} while(0)
+
+#define log_error(...) log_at(LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(LEVEL_WARN, __VA_ARGS__)
+#define log_info(...) log_at(LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LEVEL_DEBUG, __VA_ARGS__)
+
+void log_write(enum log_level level, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/**
+ * Start the drain thread writing to @param target: "stdout", "syslog"
+ * or the path of a file to append to. Until then, and after log_close(),
+ * messages are written directly to stdout.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int log_open(const char *target);
+
+/**
+ * Write out everything still queued and stop the drain thread.
+ */
+void log_close(void);
+
+#endif
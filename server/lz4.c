@@ -0,0 +1,170 @@
+#include "lz4.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+//the format wants the last 5 bytes as literals and no match starting
+//in the last 12
+#define LAST_LITERALS 5
+#define MF_LIMIT 12
+#define MAX_OFFSET 65535
+#define HASH_LOG 14
+
+static uint32_t read32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t hash4(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+//length beyond the 15 that fit in the token, as a run of 255s
+static unsigned char *put_len(unsigned char *op, size_t len)
+{
+	while(len >= 255)
+	{
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+static unsigned char *put_literals(unsigned char *op, unsigned char *token, const unsigned char *lit, size_t len)
+{
+	*token = (len >= 15 ? 15 : len) << 4;
+	if(len >= 15)
+		op = put_len(op, len - 15);
+	memcpy(op, lit, len);
+	return op + len;
+}
+
+/*********************************************************************
+Greedy single-pass compressor: a hash of the next four bytes points at
+the last place they were seen, a hit within 64 KiB becomes a match that
+is then stretched both ways. Misses make it step faster, so data that
+does not compress costs little time.
+**********************************************************************/
+size_t lz4_compress(const char *src, size_t len, char *dst, size_t cap)
+{
+	uint32_t table[1 << HASH_LOG];
+	const unsigned char *base = (const unsigned char *)src, *end = base + len;
+	const unsigned char *ip = base, *anchor = base;
+	unsigned char *op = (unsigned char *)dst;
+
+	if(cap < lz4_bound(len))
+		return 0;
+	if(len > MF_LIMIT)
+	{
+		const unsigned char *mflimit = end - MF_LIMIT, *matchlimit = end - LAST_LITERALS;
+
+		memset(table, 0, sizeof(table));
+		ip++;
+		while(ip < mflimit)
+		{
+			uint32_t h = hash4(read32(ip));
+			const unsigned char *ref = base + table[h];
+
+			table[h] = ip - base;
+			if(ip - ref > MAX_OFFSET || read32(ref) != read32(ip))
+			{
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+			while(ip > anchor && ref > base && ip[-1] == ref[-1])
+			{
+				ip--;
+				ref--;
+			}
+
+			const unsigned char *m = ip + MIN_MATCH, *r = ref + MIN_MATCH;
+			while(m < matchlimit && *m == *r)
+			{
+				m++;
+				r++;
+			}
+			size_t mlen = m - ip - MIN_MATCH, off = ip - ref;
+			unsigned char *token = op++;
+
+			op = put_literals(op, token, anchor, ip - anchor);
+			*op++ = off & 0xff;
+			*op++ = off >> 8;
+			*token |= mlen >= 15 ? 15 : mlen;
+			if(mlen >= 15)
+				op = put_len(op, mlen - 15);
+			ip = anchor = m;
+			if(ip < mflimit)
+				table[hash4(read32(ip - 2))] = ip - 2 - base;
+		}
+	}
+	unsigned char *token = op++;
+	op = put_literals(op, token, anchor, end - anchor);
+	return op - (unsigned char *)dst;
+}
+
+//read the rest of a length that did not fit in the token
+static int get_len(const unsigned char **ip, const unsigned char *end, size_t *len)
+{
+	unsigned b;
+
+	do {
+		if(*ip >= end)
+			return -1;
+		b = *(*ip)++;
+		*len += b;
+	} while(b == 255);
+	return 0;
+}
+
+ssize_t lz4_decompress(const char *src, size_t len, char *dst, size_t cap)
+{
+	const unsigned char *ip = (const unsigned char *)src, *iend = ip + len;
+	unsigned char *op = (unsigned char *)dst, *oend = op + cap;
+
+	while(ip < iend)
+	{
+		unsigned token = *ip++;
+		size_t lit = token >> 4, mlen = token & 15, off;
+
+		if(lit == 15 && get_len(&ip, iend, &lit) == -1)
+			return -1;
+		if(lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+			return -1;
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		//the last sequence has no match
+		if(ip == iend)
+			break;
+
+		if(iend - ip < 2)
+			return -1;
+		off = ip[0] | ip[1] << 8;
+		ip += 2;
+		if(off == 0 || off > (size_t)(op - (unsigned char *)dst))
+			return -1;
+		if(mlen == 15 && get_len(&ip, iend, &mlen) == -1)
+			return -1;
+		mlen += MIN_MATCH;
+		if(mlen > (size_t)(oend - op))
+			return -1;
+
+		//an overlapping match repeats the last @off bytes, copying what is
+		//already there doubles the run each time
+		const unsigned char *m = op - off;
+		while(mlen > 0)
+		{
+			size_t n = mlen < (size_t)(op - m) ? mlen : (size_t)(op - m);
+			memcpy(op, m, n);
+			op += n;
+			mlen -= n;
+		}
+	}
+	return op - (unsigned char *)dst;
+}
@@ -0,0 +1,35 @@
+#ifndef AESD_LZ4_H
+#define AESD_LZ4_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Blocks use the LZ4 block format, so any LZ4 implementation can
+ * decompress what aesdsocket sends and stores. Only the block layer is
+ * provided, there is no frame format.
+ */
+
+/**
+ * @return the largest block @param len input bytes can compress to.
+ */
+static inline size_t lz4_bound(size_t len)
+{
+	return len + len / 255 + 16;
+}
+
+/**
+ * Compress @param len bytes at @param src into @param dst, which must
+ * hold at least lz4_bound(@param len) bytes.
+ * @return the block size, 0 if @param cap is too small.
+ */
+size_t lz4_compress(const char *src, size_t len, char *dst, size_t cap);
+
+/**
+ * Decompress the block of @param len bytes at @param src into at most
+ * @param cap bytes at @param dst.
+ * @return the decompressed size, -1 if the block is malformed or too big.
+ */
+ssize_t lz4_decompress(const char *src, size_t len, char *dst, size_t cap);
+
+#endif
@@ -0,0 +1,76 @@
+#include "mem.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "config.h"
+
+struct mem_stats mem_stats;
+
+int mem_charge(enum mem_use use, size_t len)
+{
+	size_t budget = CFG.memory_budget;
+	size_t total = atomic_fetch_add(&mem_stats.total, len) + len;
+
+	if(budget && total > budget)
+	{
+		atomic_fetch_sub(&mem_stats.total, len);
+		atomic_fetch_add(&mem_stats.refused, 1);
+		errno = ENOMEM;
+		return -1;
+	}
+	atomic_fetch_add(&mem_stats.used[use], len);
+	size_t peak = atomic_load(&mem_stats.peak);
+	while(total > peak && !atomic_compare_exchange_weak(&mem_stats.peak, &peak, total))
+		;
+	return 0;
+}
+
+void mem_release(enum mem_use use, size_t len)
+{
+	atomic_fetch_sub(&mem_stats.total, len);
+	atomic_fetch_sub(&mem_stats.used[use], len);
+}
+
+void *mem_realloc(enum mem_use use, void *p, size_t old, size_t len)
+{
+	void *n;
+
+	if(len > old && mem_charge(use, len - old) == -1)
+		return NULL;
+	if((n = realloc(p, len)) == NULL)
+	{
+		if(len > old)
+			mem_release(use, len - old);
+		return NULL;
+	}
+	if(len < old)
+		mem_release(use, old - len);
+	return n;
+}
+
+void mem_free(enum mem_use use, void *p, size_t len)
+{
+	free(p);
+	if(p != NULL)
+		mem_release(use, len);
+}
+
+int mem_tight(void)
+{
+	size_t budget = CFG.memory_budget;
+
+	return budget && atomic_load_explicit(&mem_stats.total, memory_order_relaxed) > budget - budget / 8;
+}
+
+int mem_spare(size_t len)
+{
+	size_t budget = CFG.memory_budget;
+
+	return !budget || atomic_load_explicit(&mem_stats.total, memory_order_relaxed) + len <= budget / 2;
+}
+
+int mem_hog(size_t held, size_t conns)
+{
+	return conns > 0 && held > CFG.memory_budget / conns;
+}
@@ -0,0 +1,72 @@
+#ifndef AESD_MEM_H
+#define AESD_MEM_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * What the buffers charged to the memory budget are for.
+ */
+enum mem_use {
+	MEM_RECV,	//socket input, datagram batches and shared-memory rings
+	MEM_PACKET,	//partial packets being put together
+	MEM_REPLY,	//send buffers and queued replies
+	MEM_CACHE,	//subscriber feeds and decompressed segments
+	MEM_USES,
+};
+
+/**
+ * Bytes charged to the budget in all and per use, for AESDSOCKET_STATS.
+ * @refused counts allocations turned down for going over the budget and
+ * @paused the times a connection stopped reading because memory ran low.
+ */
+struct mem_stats {
+	_Atomic size_t total;
+	_Atomic size_t used[MEM_USES];
+	_Atomic size_t peak;
+	_Atomic uint64_t refused;
+	_Atomic uint64_t paused;
+};
+
+extern struct mem_stats mem_stats;
+
+/**
+ * Charge @param len bytes for @param use against --memory-budget.
+ * @return 0 on success, -1 with errno ENOMEM when they do not fit.
+ */
+int mem_charge(enum mem_use use, size_t len);
+
+void mem_release(enum mem_use use, size_t len);
+
+/**
+ * realloc() @param p from @param old to @param len bytes, charging the
+ * difference; nothing changes when it fails.
+ * @return the buffer, NULL with errno set on failure.
+ */
+void *mem_realloc(enum mem_use use, void *p, size_t old, size_t len);
+
+/**
+ * Free @param p, which was charged @param len bytes.
+ */
+void mem_free(enum mem_use use, void *p, size_t len);
+
+/**
+ * @return non-zero once 7/8 of the budget is used: buffers are given
+ * back where they can be, and the clients holding the most stop reading.
+ */
+int mem_tight(void);
+
+/**
+ * @return non-zero if @param len more bytes of cache still leave half
+ * the budget free, caches never grow past that.
+ */
+int mem_spare(size_t len);
+
+/**
+ * @return non-zero if a connection holding @param held bytes holds more
+ * than its share of the budget among @param conns connections.
+ */
+int mem_hog(size_t held, size_t conns);
+
+#endif
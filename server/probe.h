@@ -0,0 +1,44 @@
+#ifndef AESD_PROBE_H
+#define AESD_PROBE_H
+
+/*********************************************************************
+Static tracepoints on the hot path, for perf, bpftrace and the like to
+attach to a running server, e.g. "bpftrace -e 'usdt:./aesdsocket:
+aesdsocket:recv { @[arg0] = sum(arg1); }'". A probe is a single nop
+with its arguments noted in an ELF section, so it costs nothing until
+something attaches. Without <sys/sdt.h> (systemtap's header), or built
+with make NO_PROBES=1, they compile to nothing.
+
+Probes, all with the connection number first (0 for UDP):
+  accept          a client was taken on
+  recv            bytes read from the socket
+  frame_complete  a packet or binary frame is complete, its length
+  append_start    a packet is about to be stored, its length
+  append_end      it was stored, the log length
+  fsync_start     --durability=commit syncs a write, or journal
+                  writes it to the journal; the log offset it
+                  started at
+  fsync_end       the sync returned
+  replay_start    a reply was queued, the log bytes it starts with
+  replay_end      the reply went out, the log bytes it sent
+  close           the connection is gone
+fsync_* are fired by the store, which does not know the connection, so
+they carry 0 and are bracketed by the append probes of the packet.
+**********************************************************************/
+
+#if !defined(AESD_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define AESD_PROBES 1
+#endif
+#endif
+
+#ifdef AESD_PROBES
+#define PROBE1(name, a) STAP_PROBE1(aesdsocket, name, a)
+#define PROBE2(name, a, b) STAP_PROBE2(aesdsocket, name, a, b)
+#else
+#define PROBE1(name, a) do { } while(0)
+#define PROBE2(name, a, b) do { } while(0)
+#endif
+
+#endif
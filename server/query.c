@@ -0,0 +1,375 @@
+#define _GNU_SOURCE
+#include "query.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+//the log is searched this many bytes at a time
+#define QUERY_BLOCK (256 * 1024)
+
+static int parse_pair(const char *arg, uint64_t *a, uint64_t *b)
+{
+	char *end;
+
+	errno = 0;
+	*a = strtoull(arg, &end, 10);
+	if(errno || end == arg || *end != ',')
+		return -1;
+	arg = end + 1;
+	*b = strtoull(arg, &end, 10);
+	if(errno || end == arg || *end != '\0' || *b < *a)
+		return -1;
+	return 0;
+}
+
+int query_parse(struct query *q, const char *pkt, size_t len)
+{
+	const size_t plen = sizeof(QUERY_PREFIX) - 1;
+	char *line, *arg, *end;
+
+	memset(q, 0, sizeof(*q));
+	if(len < plen || memcmp(pkt, QUERY_PREFIX, plen) != 0)
+		return 0;
+
+	q->type = QUERY_INVALID;
+	line = strndup(pkt + plen, len - plen);
+	if(line == NULL)
+		return 1;
+	//drop the '\n' and a '\r' from clients that send CRLF
+	line[strcspn(line, "\r\n")] = '\0';
+	if(strcmp(line, "SUBSCRIBE") == 0)
+	{
+		q->type = QUERY_SUBSCRIBE;
+		goto out;
+	}
+	if(strcmp(line, "STATS") == 0)
+	{
+		q->type = QUERY_STATS;
+		goto out;
+	}
+	if(strcmp(line, "BINARY") == 0)
+	{
+		q->type = QUERY_BINARY;
+		goto out;
+	}
+	if((arg = strchr(line, ':')) == NULL)
+		goto out;
+	*arg++ = '\0';
+
+	if(strcmp(line, "CHANNEL") == 0)
+	{
+		//checked against the channel rules when it is switched to
+		if((q->pattern = strdup(arg)) != NULL)
+		{
+			q->pattern_len = strlen(arg);
+			q->type = QUERY_CHANNEL;
+		}
+	}
+	else if(strcmp(line, "COMPRESS") == 0)
+	{
+		if(strcmp(arg, "LZ4") == 0 || strcmp(arg, "NONE") == 0)
+		{
+			q->a = strcmp(arg, "LZ4") == 0;
+			q->type = QUERY_COMPRESS;
+		}
+	}
+	else if(strcmp(line, "TAIL") == 0)
+	{
+		errno = 0;
+		q->a = strtoull(arg, &end, 10);
+		if(!errno && end != arg && *end == '\0')
+			q->type = QUERY_TAIL;
+	}
+	else if(strcmp(line, "PACKETS") == 0)
+	{
+		if(parse_pair(arg, &q->a, &q->b) == 0)
+			q->type = QUERY_PACKETS;
+	}
+	else if(strcmp(line, "BYTES") == 0)
+	{
+		if(parse_pair(arg, &q->a, &q->b) == 0)
+			q->type = QUERY_BYTES;
+	}
+	else if(strcmp(line, "GREP") == 0)
+	{
+		if(*arg != '\0' && (q->pattern = strdup(arg)) != NULL)
+		{
+			q->pattern_len = strlen(arg);
+			q->type = QUERY_GREP;
+		}
+	}
+	else if(strcmp(line, "REGEX") == 0)
+	{
+		//the text is kept for a scan handed over by an upgrade
+		if((q->pattern = strdup(arg)) == NULL)
+			goto out;
+		q->pattern_len = strlen(arg);
+		if(regcomp(&q->re, arg, REG_EXTENDED | REG_NOSUB) == 0)
+			q->type = QUERY_REGEX;
+	}
+out:
+	free(line);
+	return 1;
+}
+
+int query_load(struct query *q, enum query_type type, const char *pattern, size_t len)
+{
+	memset(q, 0, sizeof(*q));
+	if((type != QUERY_GREP && type != QUERY_REGEX) || memchr(pattern, '\0', len) != NULL)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if((q->pattern = strndup(pattern, len)) == NULL)
+		return -1;
+	q->pattern_len = len;
+	if(type == QUERY_REGEX && regcomp(&q->re, q->pattern, REG_EXTENDED | REG_NOSUB) != 0)
+	{
+		query_free(q);
+		errno = EINVAL;
+		return -1;
+	}
+	q->type = type;
+	return 0;
+}
+
+void query_free(struct query *q)
+{
+	if(q->type == QUERY_REGEX)
+		regfree(&q->re);
+	free(q->pattern);
+	q->pattern = NULL;
+	q->type = QUERY_INVALID;
+}
+
+static int emit(struct emitter *em, off_t from, off_t to)
+{
+	if(from == em->to)
+	{
+		em->to = to;
+		return 0;
+	}
+	if(em->to > em->from && em->fn(em->arg, em->from, em->to) == -1)
+		return -1;
+	em->from = from;
+	em->to = to;
+	return 0;
+}
+
+static int emit_flush(struct emitter *em)
+{
+	if(em->to > em->from)
+		return em->fn(em->arg, em->from, em->to);
+	return 0;
+}
+
+//fill @buf with up to @len log bytes from @off on: store_read() stops at
+//segment boundaries, only its end of the committed log is an end here
+static ssize_t read_block(struct store *st, char *buf, size_t len, off_t off)
+{
+	size_t got = 0;
+
+	while(got < len)
+	{
+		ssize_t rd = store_read(st, buf + got, len - got, off + got);
+
+		if(rd == -1)
+			return -1;
+		if(rd == 0)
+		{
+			if(off + (off_t)got < st->committed)
+			{
+				errno = EIO;
+				return -1;
+			}
+			break;
+		}
+		got += rd;
+	}
+	return got;
+}
+
+/*********************************************************************
+Substring search runs memmem() over whole blocks of the log instead of
+packet by packet, which keeps glibc's vectorised search on long runs of
+data. A hit is mapped back to its packet through the index and the
+search resumes after that packet. Consecutive blocks overlap by the
+pattern length so hits across a block boundary are not missed.
+**********************************************************************/
+static ssize_t grep_step(struct query_scan *s, struct store *st)
+{
+	const struct pindex *ix = &st->idx;
+	const size_t n = s->q->pattern_len;
+	const off_t pos = s->pos;
+	size_t want = s->end - pos < QUERY_BLOCK ? s->end - pos : QUERY_BLOCK;
+	ssize_t rd = read_block(st, s->buf, want, pos);
+	size_t skip = 0;
+	off_t next;
+
+	if(rd <= 0)
+		return -1;
+	s->pos = s->end;
+	if((size_t)rd < n)
+		return rd;
+	next = pos + rd - (n - 1);
+	while(skip + n <= (size_t)rd)
+	{
+		char *hit = memmem(s->buf + skip, rd - skip, s->q->pattern, n);
+		if(hit == NULL)
+			break;
+		size_t i = index_find(ix, pos + (hit - s->buf));
+		if(i >= ix->count)
+			return rd;
+		if(emit(&s->em, index_start(ix, i), ix->ends[i]) == -1)
+			return -1;
+		if(ix->ends[i] >= (uint64_t)(pos + rd))
+		{
+			next = ix->ends[i];
+			break;
+		}
+		skip = ix->ends[i] - pos;
+		if(next < (off_t)ix->ends[i])
+			next = ix->ends[i];
+	}
+	if(pos + rd < s->end)
+		s->pos = next;
+	return rd;
+}
+
+static int regex_match(const struct query *q, const char *data, size_t len, int flags)
+{
+	regmatch_t m = { .rm_so = 0, .rm_eo = len };
+
+	return regexec(&q->re, data, 1, &m, REG_STARTEND | flags) == 0;
+}
+
+//match the piece at @s->piece of the packet at @s->pos, which is bigger
+//than a block; @rd of its bytes are in the buffer already, or 0
+static ssize_t regex_piece(struct query_scan *s, struct store *st, ssize_t rd)
+{
+	const struct pindex *ix = &st->idx;
+	size_t i = index_find(ix, s->pos);
+	off_t off = s->piece, pend = ix->ends[i] - 1;
+
+	if(rd == 0 && (rd = read_block(st, s->buf, QUERY_BLOCK, off)) <= 0)
+		return -1;
+	if(rd > pend - off)
+		rd = pend - off;
+	if(regex_match(s->q, s->buf, rd, (off > s->pos ? REG_NOTBOL : 0) |
+		       (off + rd < pend ? REG_NOTEOL : 0)))
+	{
+		if(emit(&s->em, s->pos, ix->ends[i]) == -1)
+			return -1;
+	}
+	else if(off + rd < pend)
+	{
+		s->piece = off + rd;
+		return rd;
+	}
+	s->piece = 0;
+	s->pos = ix->ends[i];
+	return rd;
+}
+
+/*********************************************************************
+Regex matching is per packet, so whole packets are read a block at a
+time and matched in place without their '\n'. A packet larger than a
+block is matched piece by piece, where only the first piece starts the
+line and only the last one ends it; a match spanning two pieces of such
+a packet is not found.
+**********************************************************************/
+static ssize_t regex_step(struct query_scan *s, struct store *st)
+{
+	const struct pindex *ix = &st->idx;
+	const off_t start = s->pos;
+	size_t i, want = s->end - start < QUERY_BLOCK ? s->end - start : QUERY_BLOCK;
+	ssize_t rd;
+
+	if(s->piece > 0)
+		return regex_piece(s, st, 0);
+	if((rd = read_block(st, s->buf, want, start)) <= 0)
+		return -1;
+	for(i = index_find(ix, start); i < ix->count && ix->ends[i] <= (uint64_t)(start + rd); i++)
+	{
+		size_t off = index_start(ix, i) - start;
+		if(regex_match(s->q, s->buf + off, ix->ends[i] - start - off - 1, 0) &&
+		   emit(&s->em, index_start(ix, i), ix->ends[i]) == -1)
+			return -1;
+		s->pos = ix->ends[i];
+	}
+	if(s->pos > start)
+		return rd;
+	//packet i alone is bigger than the block
+	s->piece = start;
+	return regex_piece(s, st, rd);
+}
+
+int query_scan_start(struct query_scan *s, const struct query *q, struct store *st,
+		     query_emit_fn fn, void *arg)
+{
+	memset(s, 0, sizeof(*s));
+	if((s->buf = malloc(QUERY_BLOCK)) == NULL)
+		return -1;
+	s->q = q;
+	s->em.fn = fn;
+	s->em.arg = arg;
+	s->pos = st->head;
+	s->end = st->committed;
+	return 0;
+}
+
+ssize_t query_scan_step(struct query_scan *s, struct store *st)
+{
+	//retention dropped packets since the last step
+	if(s->pos < st->head)
+	{
+		s->pos = st->head;
+		s->piece = 0;
+	}
+	if(s->pos >= s->end)
+		return emit_flush(&s->em) == -1 ? -1 : 0;
+	return s->q->type == QUERY_GREP ? grep_step(s, st) : regex_step(s, st);
+}
+
+void query_scan_free(struct query_scan *s)
+{
+	free(s->buf);
+	s->buf = NULL;
+}
+
+int query_run(const struct query *q, struct store *st, query_emit_fn fn, void *arg)
+{
+	const struct pindex *ix = &st->idx;
+	//packets before the head were dropped by retention
+	const size_t first = index_find(ix, st->head);
+	const uint64_t head = st->head;
+	struct query_scan scan;
+	uint64_t a, b;
+	ssize_t rc;
+
+	switch(q->type)
+	{
+	case QUERY_TAIL:
+		a = q->a >= ix->count - first ? head : index_start(ix, ix->count - q->a);
+		return a < (uint64_t)st->committed ? fn(arg, a, st->committed) : 0;
+	case QUERY_PACKETS:
+		a = q->a < first ? first : q->a < ix->count ? q->a : ix->count;
+		b = q->b < ix->count ? q->b : ix->count;
+		return a < b ? fn(arg, index_start(ix, a), ix->ends[b - 1]) : 0;
+	case QUERY_BYTES:
+		a = q->a < head ? head : q->a < (uint64_t)st->committed ? q->a : (uint64_t)st->committed;
+		b = q->b < (uint64_t)st->committed ? q->b : (uint64_t)st->committed;
+		return a < b ? fn(arg, a, b) : 0;
+	case QUERY_GREP:
+	case QUERY_REGEX:
+		if(query_scan_start(&scan, q, st, fn, arg) == -1)
+			return -1;
+		while((rc = query_scan_step(&scan, st)) > 0)
+			;
+		query_scan_free(&scan);
+		return rc;
+	default:
+		return 0;
+	}
+}
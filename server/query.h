@@ -0,0 +1,129 @@
+#ifndef AESD_QUERY_H
+#define AESD_QUERY_H
+
+#include <regex.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "store.h"
+
+/**
+ * Packets starting with this prefix are commands for the server rather
+ * than data, the same way AESDCHAR_IOCSEEKTO is for the char driver:
+ *   AESDSOCKET_TAIL:N          the last N packets
+ *   AESDSOCKET_PACKETS:A,B     packets A up to (not including) B
+ *   AESDSOCKET_BYTES:A,B       log bytes A up to (not including) B
+ *   AESDSOCKET_GREP:TEXT       packets containing TEXT
+ *   AESDSOCKET_REGEX:PATTERN   packets matching the POSIX extended regex
+ * The reply is the selected log data instead of the full replay.
+ *   AESDSOCKET_SUBSCRIBE       stop replaying, push every packet committed
+ *                              from now on to this connection instead
+ *   AESDSOCKET_CHANNEL:NAME    use channel NAME (created on first use) for
+ *                              everything this connection sends from now
+ *                              on, an empty NAME is the default channel
+ *   AESDSOCKET_COMPRESS:LZ4    send replies as AESDSOCKET_LZ4:RAW:LEN
+ *                              lines, each followed by an LEN byte LZ4
+ *                              block holding RAW log bytes; NONE switches
+ *                              back to plain replies
+ *   AESDSOCKET_STATS           one AESDSOCKET_STATS: line of connection
+ *                              and admission control counters
+ *   AESDSOCKET_BINARY          switch this connection to the binary
+ *                              framing of frame.h, answered by an OK frame
+ *                              with the packet count and log length
+ */
+#define QUERY_PREFIX "AESDSOCKET_"
+
+enum query_type {
+	QUERY_INVALID,
+	QUERY_TAIL,
+	QUERY_PACKETS,
+	QUERY_BYTES,
+	QUERY_GREP,
+	QUERY_REGEX,
+	QUERY_SUBSCRIBE,
+	QUERY_CHANNEL,
+	QUERY_COMPRESS,
+	QUERY_STATS,
+	QUERY_BINARY,
+};
+
+struct query {
+	enum query_type type;
+	uint64_t a;
+	uint64_t b;
+	char *pattern;
+	size_t pattern_len;
+	regex_t re;
+};
+
+/**
+ * Recognise a command in the packet @param pkt of @param len bytes
+ * (including its '\n'). Unknown or malformed commands parse as
+ * QUERY_INVALID so they are answered rather than stored.
+ * @return 1 if the packet is a command, 0 if it is ordinary data.
+ */
+int query_parse(struct query *q, const char *pkt, size_t len);
+
+/**
+ * Build GREP or REGEX query @param q of @param type from the @param len
+ * bytes of its @param pattern, for a scan handed over by an upgrade.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int query_load(struct query *q, enum query_type type, const char *pattern, size_t len);
+void query_free(struct query *q);
+
+/**
+ * Called with each run of selected log bytes [@param from, @param to),
+ * adjacent packets are merged into a single call.
+ * @return 0 to continue, -1 to stop the query.
+ */
+typedef int (*query_emit_fn)(void *arg, off_t from, off_t to);
+
+//merges adjacent selections so contiguous packets go out as one run
+struct emitter {
+	query_emit_fn fn;
+	void *arg;
+	off_t from;
+	off_t to;
+};
+
+/**
+ * A GREP or REGEX query run over the log a block at a time, so the
+ * caller may let go of the store between blocks. @pos is where the next
+ * block starts, @piece where the next piece of a packet bigger than a
+ * block does (0 outside one). Packets stored after @end, the committed
+ * length when the scan started, are not searched.
+ */
+struct query_scan {
+	const struct query *q;
+	char *buf;
+	struct emitter em;
+	off_t pos;
+	off_t piece;
+	off_t end;
+};
+
+/**
+ * Start running GREP or REGEX query @param q, which has to stay around
+ * until the scan is freed, over the retained part of @param st.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int query_scan_start(struct query_scan *s, const struct query *q, struct store *st,
+		     query_emit_fn emit, void *arg);
+
+/**
+ * Search the next block of @param st for scan @param s.
+ * @return the bytes searched, 0 once the scan is over, -1 if reading the
+ * log or the emit callback failed.
+ */
+ssize_t query_scan_step(struct query_scan *s, struct store *st);
+void query_scan_free(struct query_scan *s);
+
+/**
+ * Evaluate @param q against the retained, committed part of @param st.
+ * @return 0 on success, -1 if reading the log or @param emit failed.
+ */
+int query_run(const struct query *q, struct store *st, query_emit_fn emit, void *arg);
+
+#endif
@@ -0,0 +1,182 @@
+#include "rcache.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "mem.h"
+
+struct rcache_stats rcache_stats;
+
+static void block_put(struct rblock *b)
+{
+	if(b == NULL || atomic_fetch_sub(&b->refs, 1) != 1)
+		return;
+	mem_free(MEM_CACHE, b, sizeof(*b) + RCACHE_BLOCK);
+}
+
+int rcache_resize(struct rcache *rc, size_t bytes)
+{
+	size_t slots = bytes / RCACHE_BLOCK;
+
+	if(slots == rc->slots)
+		return 0;
+	rcache_destroy(rc);
+	if(slots == 0)
+		return 0;
+	if((rc->slot = calloc(slots, sizeof(*rc->slot))) == NULL)
+		return -1;
+	rc->slots = slots;
+	return 0;
+}
+
+void rcache_destroy(struct rcache *rc)
+{
+	size_t i;
+
+	for(i = 0; i < rc->slots; i++)
+		block_put(rc->slot[i]);
+	free(rc->slot);
+	rc->slot = NULL;
+	rc->slots = 0;
+}
+
+//bring @b up to date with the log, committed up to @end
+static int block_fill(struct rblock *b, struct store *st, const struct feed *feed, off_t end)
+{
+	off_t upto = b->off + RCACHE_BLOCK < end ? b->off + RCACHE_BLOCK : end;
+
+	while(b->off + (off_t)b->len < upto)
+	{
+		off_t at = b->off + b->len;
+		size_t want = upto - at;
+		const char *data;
+		size_t n = feed_peek(feed, at, &data);
+
+		if(n > 0)
+		{
+			if(n > want)
+				n = want;
+			memcpy(b->data + b->len, data, n);
+		}
+		else
+		{
+			ssize_t rd = store_read(st, b->data + b->len, want, at);
+			if(rd <= 0)
+			{
+				if(rd == 0)
+					errno = EIO;
+				return -1;
+			}
+			n = rd;
+		}
+		b->len += n;
+	}
+	return 0;
+}
+
+//the block holding log offset @off, read in or extended as needed
+static struct rblock *block_get(struct rcache *rc, struct store *st, const struct feed *feed, off_t off)
+{
+	off_t start = off - off % RCACHE_BLOCK;
+	struct rblock **slot = &rc->slot[(size_t)(off / RCACHE_BLOCK) % rc->slots];
+	struct rblock *b = *slot;
+
+	if(b != NULL && b->off == start && (b->len == RCACHE_BLOCK || b->off + (off_t)b->len >= st->committed))
+	{
+		atomic_fetch_add(&rcache_stats.hits, 1);
+		return b;
+	}
+	if(b == NULL || b->off != start)
+	{
+		//connections come first when memory runs short
+		if(!mem_spare(sizeof(*b) + RCACHE_BLOCK))
+		{
+			errno = ENOMEM;
+			return NULL;
+		}
+		struct rblock *n = mem_realloc(MEM_CACHE, NULL, 0, sizeof(*n) + RCACHE_BLOCK);
+		if(n == NULL)
+			return NULL;
+		atomic_init(&n->refs, 1);
+		n->off = start;
+		n->len = 0;
+		block_put(b);
+		*slot = b = n;
+	}
+	atomic_fetch_add(&rcache_stats.misses, 1);
+	//the bytes already there may be on their way to a client, only the
+	//end of the block is written
+	if(block_fill(b, st, feed, st->committed) == -1)
+	{
+		*slot = NULL;
+		block_put(b);
+		return NULL;
+	}
+	return b;
+}
+
+ssize_t rcache_chain(struct rcache *rc, struct store *st, const struct feed *feed,
+		     struct rchain *ch, off_t from, off_t to)
+{
+	off_t off = from;
+
+	if(rc->slots == 0)
+		return 0;
+	ch->count = ch->pos = 0;
+	while(off < to && ch->count < RCACHE_CHAIN)
+	{
+		struct rblock *b = block_get(rc, st, feed, off);
+		size_t skip, n;
+
+		if(b == NULL)
+		{
+			if(ch->count > 0)
+				break;
+			return -1;
+		}
+		skip = off - b->off;
+		n = b->len - skip;
+		if((off_t)n > to - off)
+			n = to - off;
+		if(n == 0)
+			break;
+		atomic_fetch_add(&b->refs, 1);
+		ch->blocks[ch->count] = b;
+		ch->iov[ch->count].iov_base = b->data + skip;
+		ch->iov[ch->count].iov_len = n;
+		ch->count++;
+		off += n;
+	}
+	return off - from;
+}
+
+ssize_t rchain_send(struct rchain *ch, int fd)
+{
+	struct msghdr msg = { .msg_iov = ch->iov + ch->pos, .msg_iovlen = ch->count - ch->pos };
+	ssize_t sd = sendmsg(fd, &msg, MSG_NOSIGNAL);
+	size_t left = sd;
+
+	if(sd == -1)
+		return -1;
+	while(ch->pos < ch->count && left >= ch->iov[ch->pos].iov_len)
+	{
+		left -= ch->iov[ch->pos].iov_len;
+		block_put(ch->blocks[ch->pos]);
+		ch->blocks[ch->pos++] = NULL;
+	}
+	if(left > 0)
+	{
+		ch->iov[ch->pos].iov_base = (char *)ch->iov[ch->pos].iov_base + left;
+		ch->iov[ch->pos].iov_len -= left;
+	}
+	return sd;
+}
+
+void rchain_drop(struct rchain *ch)
+{
+	for(; ch->pos < ch->count; ch->pos++)
+		block_put(ch->blocks[ch->pos]);
+	ch->count = ch->pos = 0;
+}
@@ -0,0 +1,106 @@
+#ifndef AESD_RCACHE_H
+#define AESD_RCACHE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "feed.h"
+#include "store.h"
+
+/*********************************************************************
+Replay cache for --replay-cache. Between appends every replay of a
+channel sends the same bytes, so they are kept in memory in blocks of
+RCACHE_BLOCK log bytes and replies go out of them as iovec chains,
+without reading the log. A block is found by its log offset and holds
+the bytes committed when it was last used: the log only grows, so a
+block never goes stale, the one at the end is just extended as new
+packets commit, from the subscriber feed while it still has them. The
+table is direct-mapped, a block pushes out whichever one had its slot,
+and it takes no new blocks once half the memory budget is used. Blocks
+are reference counted, one a reply is still being sent from stays alive
+when the cache lets go of it.
+**********************************************************************/
+
+#define RCACHE_BLOCK (64 * 1024)
+//blocks sent with one sendmsg()
+#define RCACHE_CHAIN 16
+
+struct rblock {
+	_Atomic unsigned refs;
+	off_t off;
+	size_t len;
+	char data[];
+};
+
+/**
+ * The blocks of one channel, @slots of them; guarded by the channel lock.
+ */
+struct rcache {
+	struct rblock **slot;
+	size_t slots;
+};
+
+/**
+ * Log bytes on their way to one client, straight out of the cache:
+ * iovecs [@pos, @count) are still to be sent.
+ */
+struct rchain {
+	struct rblock *blocks[RCACHE_CHAIN];
+	struct iovec iov[RCACHE_CHAIN];
+	int count;
+	int pos;
+};
+
+/**
+ * Blocks served from the cache and blocks that had to be read or
+ * extended, for AESDSOCKET_STATS.
+ */
+struct rcache_stats {
+	_Atomic uint64_t hits;
+	_Atomic uint64_t misses;
+};
+
+extern struct rcache_stats rcache_stats;
+
+/**
+ * Size @param rc for @param bytes of blocks, 0 turns it off; whatever
+ * it held is dropped.
+ * @return 0 on success, -1 with errno set on failure (then it is off).
+ */
+int rcache_resize(struct rcache *rc, size_t bytes);
+void rcache_destroy(struct rcache *rc);
+
+/**
+ * Fill @param ch with up to RCACHE_CHAIN blocks' worth of the
+ * committed bytes [@param from, @param to) of @param st, read into the
+ * cache from @param feed or the log where missing.
+ * @return bytes in the chain, 0 if the cache is off, -1 with errno set
+ * on failure.
+ */
+ssize_t rcache_chain(struct rcache *rc, struct store *st, const struct feed *feed,
+		     struct rchain *ch, off_t from, off_t to);
+
+/**
+ * Send what is left of @param ch to @param fd, letting go of the blocks
+ * sent.
+ * @return bytes sent, -1 with errno set on failure.
+ */
+ssize_t rchain_send(struct rchain *ch, int fd);
+
+/**
+ * Let go of every block of @param ch.
+ */
+void rchain_drop(struct rchain *ch);
+
+/**
+ * @return non-zero while @param ch has bytes to send.
+ */
+static inline int rchain_busy(const struct rchain *ch)
+{
+	return ch->pos < ch->count;
+}
+
+#endif
@@ -0,0 +1,355 @@
+#define _GNU_SOURCE
+#include "segment.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "log.h"
+#include "lz4.h"
+#include "mem.h"
+
+#define SEGTAB_MAGIC 0x3147455344534541ULL	//"AESDSEG1"
+
+//the table file starts with this, the entries follow in segment order
+struct segtab_hdr {
+	uint64_t magic;
+	uint64_t ino;
+};
+
+//@return 0, or -1 with errno ENAMETOOLONG if it does not fit in @len
+static int file_path(const char *path, const char *ext, char *buf, size_t len)
+{
+	if(snprintf(buf, len, "%s.%s", path, ext) >= (int)len)
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+}
+
+static off_t entry_off(uint64_t seg)
+{
+	return sizeof(struct segtab_hdr) + seg * sizeof(struct segment);
+}
+
+static int pread_full(int fd, char *buf, size_t len, off_t off)
+{
+	while(len > 0)
+	{
+		ssize_t rd = pread(fd, buf, len, off);
+		if(rd == -1 && errno == EINTR)
+			continue;
+		if(rd <= 0)
+		{
+			if(rd == 0)
+				errno = EIO;
+			return -1;
+		}
+		buf += rd;
+		off += rd;
+		len -= rd;
+	}
+	return 0;
+}
+
+static int pwrite_full(int fd, const char *buf, size_t len, off_t off)
+{
+	while(len > 0)
+	{
+		ssize_t wr = pwrite(fd, buf, len, off);
+		if(wr == -1)
+		{
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += wr;
+		off += wr;
+		len -= wr;
+	}
+	return 0;
+}
+
+//start both files afresh for this log
+static int segtab_create(struct segtab *t)
+{
+	struct segtab_hdr hdr = { .magic = SEGTAB_MAGIC, .ino = t->ino };
+	char path[PATH_MAX];
+
+	if(t->fd == -1)
+	{
+		if(file_path(t->path, "seg", path, sizeof(path)) == -1 ||
+		   (t->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1)
+			return -1;
+	}
+	if(t->lz_fd == -1)
+	{
+		if(file_path(t->path, "lz", path, sizeof(path)) == -1 ||
+		   (t->lz_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1)
+			return -1;
+	}
+	if(ftruncate(t->fd, 0) == -1 || ftruncate(t->lz_fd, 0) == -1 ||
+	   pwrite_full(t->fd, (const char *)&hdr, sizeof(hdr), 0) == -1)
+		return -1;
+	t->count = 0;
+	t->lz_end = 0;
+	return 0;
+}
+
+static int segtab_grow(struct segtab *t, size_t count)
+{
+	if(count > t->cap)
+	{
+		size_t cap = t->cap ? t->cap : 64;
+		while(cap < count)
+			cap *= 2;
+		struct segment *s = realloc(t->segs, cap * sizeof(*s));
+		if(s == NULL)
+			return -1;
+		t->segs = s;
+		t->cap = cap;
+	}
+	if(count > t->count)
+	{
+		memset(t->segs + t->count, 0, (count - t->count) * sizeof(*t->segs));
+		t->count = count;
+	}
+	return 0;
+}
+
+int segtab_open(struct segtab *t, const char *path, uint64_t ino, off_t size)
+{
+	char tpath[PATH_MAX];
+	struct segtab_hdr hdr;
+	struct stat sb;
+	size_t i, n;
+
+	memset(t, 0, sizeof(*t));
+	snprintf(t->path, sizeof(t->path), "%s", path);
+	t->ino = ino;
+	t->fd = t->lz_fd = -1;
+	t->cached = -1;
+	pthread_mutex_init(&t->lock, NULL);
+	if(file_path(path, "seg", tpath, sizeof(tpath)) == -1)
+		return -1;
+	if((t->fd = open(tpath, O_RDWR | O_CLOEXEC)) == -1)
+		return errno == ENOENT ? 0 : -1;
+	if(file_path(path, "lz", tpath, sizeof(tpath)) == -1 ||
+	   (t->lz_fd = open(tpath, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) == -1 || fstat(t->fd, &sb) == -1)
+		goto fail;
+	if(pread(t->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr.magic != SEGTAB_MAGIC || hdr.ino != ino)
+	{
+		log_warn("segment table does not belong to %s, discarding it", path);
+		if(segtab_create(t) == -1)
+			goto fail;
+		return 0;
+	}
+
+	n = (sb.st_size - sizeof(hdr)) / sizeof(struct segment);
+	if(segtab_grow(t, n) == -1 ||
+	   pread_full(t->fd, (char *)t->segs, n * sizeof(struct segment), sizeof(hdr)) == -1)
+		goto fail;
+	for(i = 0; i < n; i++)
+	{
+		//the log was cut short behind our back
+		if(t->segs[i].len && (off_t)((i + 1) * SEGMENT_SIZE) > size)
+			break;
+		if(t->segs[i].len && t->segs[i].off + t->segs[i].len > t->lz_end)
+			t->lz_end = t->segs[i].off + t->segs[i].len;
+	}
+	t->count = t->next = i;
+	//blocks of a batch that was never released have no entry
+	if(ftruncate(t->fd, entry_off(t->count)) == -1 || ftruncate(t->lz_fd, t->lz_end) == -1)
+		goto fail;
+	return 0;
+fail:
+	segtab_close(t, -1);
+	return -1;
+}
+
+/*********************************************************************
+Make the pending blocks and their table entries durable, then punch the
+raw segments out of the log. Readers switch to the blocks as soon as the
+entries are in @t->segs, before the punch.
+**********************************************************************/
+static int segtab_release(struct segtab *t, int log_fd)
+{
+	size_t i;
+
+	if(t->npending == 0)
+		return 0;
+	if(fdatasync(t->lz_fd) == -1)
+		return -1;
+	for(i = 0; i < t->npending; i++)
+	{
+		if(pwrite_full(t->fd, (const char *)&t->pending[i], sizeof(struct segment),
+			       entry_off(t->pending_seg[i])) == -1)
+			return -1;
+	}
+	if(fdatasync(t->fd) == -1 || segtab_grow(t, t->pending_seg[t->npending - 1] + 1) == -1)
+		return -1;
+	for(i = 0; i < t->npending; i++)
+	{
+		t->segs[t->pending_seg[i]] = t->pending[i];
+		if(log_fd != -1 &&
+		   fallocate(log_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			     t->pending_seg[i] * SEGMENT_SIZE, SEGMENT_SIZE) == -1 &&
+		   errno != EOPNOTSUPP)
+			return -1;
+	}
+	t->npending = 0;
+	return 0;
+}
+
+void segtab_close(struct segtab *t, int log_fd)
+{
+	if(t->npending > 0 && segtab_release(t, log_fd) == -1)
+		log_error("segment release: %m");
+	if(t->fd != -1)
+		close(t->fd);
+	if(t->lz_fd != -1)
+		close(t->lz_fd);
+	free(t->segs);
+	mem_free(MEM_CACHE, t->cache, SEGMENT_SIZE);
+	pthread_mutex_destroy(&t->lock);
+	t->fd = t->lz_fd = -1;
+	t->segs = NULL;
+	t->cache = NULL;
+	t->count = t->cap = 0;
+}
+
+void segtab_unlink(const char *path)
+{
+	char buf[PATH_MAX];
+
+	if(file_path(path, "seg", buf, sizeof(buf)) == 0)
+		remove(buf);
+	if(file_path(path, "lz", buf, sizeof(buf)) == 0)
+		remove(buf);
+}
+
+int segtab_seal(struct segtab *t, int log_fd, off_t head, off_t committed)
+{
+	uint64_t seg = t->next > (uint64_t)head / SEGMENT_SIZE ? t->next : (uint64_t)head / SEGMENT_SIZE;
+	char *raw, *z;
+	size_t len;
+	int rc = -1;
+
+	if((off_t)((seg + 1) * SEGMENT_SIZE) > committed)
+		return 0;
+	raw = malloc(SEGMENT_SIZE);
+	z = malloc(lz4_bound(SEGMENT_SIZE));
+	if(raw == NULL || z == NULL)
+		goto out;
+	if(t->fd == -1 && segtab_create(t) == -1)
+		goto out;
+	if(pread_full(log_fd, raw, SEGMENT_SIZE, seg * SEGMENT_SIZE) == -1)
+		goto out;
+	len = lz4_compress(raw, SEGMENT_SIZE, z, lz4_bound(SEGMENT_SIZE));
+	t->next = seg + 1;
+	//not worth it otherwise, it stays raw
+	if(len < SEGMENT_SIZE - SEGMENT_SIZE / 16)
+	{
+		if(pwrite_full(t->lz_fd, z, len, t->lz_end) == -1)
+			goto out;
+		t->pending[t->npending] = (struct segment){ .off = t->lz_end, .len = len,
+							    .crc = crc32c(0, z, len) };
+		t->pending_seg[t->npending++] = seg;
+		t->lz_end += len;
+		if(t->npending == SEGMENT_BATCH && segtab_release(t, log_fd) == -1)
+			goto out;
+	}
+	rc = 0;
+out:
+	free(raw);
+	free(z);
+	return rc;
+}
+
+ssize_t segtab_block(struct segtab *t, uint64_t seg, char *buf, size_t cap)
+{
+	const struct segment *s = &t->segs[seg];
+
+	if(s->len > cap)
+	{
+		errno = ENOBUFS;
+		return -1;
+	}
+	if(pread_full(t->lz_fd, buf, s->len, s->off) == -1)
+		return -1;
+	if(crc32c(0, buf, s->len) != s->crc)
+	{
+		log_error("block of segment %llu of %s fails its checksum", (unsigned long long)seg, t->path);
+		errno = EIO;
+		return -1;
+	}
+	return s->len;
+}
+
+//decompress segment @seg into the cache
+static int segtab_load(struct segtab *t, uint64_t seg)
+{
+	char *z = malloc(t->segs[seg].len);
+	ssize_t len;
+
+	if(z == NULL)
+		return -1;
+	if(t->cache == NULL && (t->cache = mem_realloc(MEM_CACHE, NULL, 0, SEGMENT_SIZE)) == NULL)
+	{
+		free(z);
+		return -1;
+	}
+	t->cached = -1;
+	len = segtab_block(t, seg, z, t->segs[seg].len);
+	if(len != -1 && lz4_decompress(z, len, t->cache, SEGMENT_SIZE) != SEGMENT_SIZE)
+	{
+		log_error("block of segment %llu of %s is corrupt", (unsigned long long)seg, t->path);
+		errno = EIO;
+		len = -1;
+	}
+	free(z);
+	if(len == -1)
+		return -1;
+	t->cached = seg;
+	return 0;
+}
+
+ssize_t segtab_read(struct segtab *t, char *buf, size_t len, off_t off)
+{
+	uint64_t seg = off / SEGMENT_SIZE;
+	size_t in = off - seg * SEGMENT_SIZE;
+
+	if(len > SEGMENT_SIZE - in)
+		len = SEGMENT_SIZE - in;
+	pthread_mutex_lock(&t->lock);
+	if(t->cached != (int64_t)seg && segtab_load(t, seg) == -1)
+	{
+		pthread_mutex_unlock(&t->lock);
+		return -1;
+	}
+	memcpy(buf, t->cache + in, len);
+	pthread_mutex_unlock(&t->lock);
+	return len;
+}
+
+void segtab_trim(struct segtab *t, off_t head)
+{
+	uint64_t seg, end = head / SEGMENT_SIZE;
+
+	//pending blocks are given back once they are released
+	if(t->npending > 0 && t->pending_seg[0] < end)
+		end = t->pending_seg[0];
+	for(seg = t->dropped; seg < end; seg++)
+	{
+		if(segtab_sealed(t, seg))
+			fallocate(t->lz_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				  t->segs[seg].off, t->segs[seg].len);
+	}
+	t->dropped = seg;
+}
@@ -0,0 +1,108 @@
+#ifndef AESD_SEGMENT_H
+#define AESD_SEGMENT_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+//the log is sealed and compressed in pieces of this many bytes
+#define SEGMENT_SIZE (256 * 1024)
+//sealed segments released from the log together, with one sync
+#define SEGMENT_BATCH 16
+
+/**
+ * Where the compressed block of a sealed segment is kept in the block
+ * file, @len is 0 while the segment is raw in the log. @crc is the
+ * CRC32C of the block.
+ */
+struct segment {
+	uint64_t off;
+	uint32_t len;
+	uint32_t crc;
+};
+
+/**
+ * Compressed copies of the sealed, fixed-size segments of a log. Blocks
+ * are appended to <log>.lz and found through the table in <log>.seg,
+ * @segs has an entry for every segment up to @count. Sealed segments
+ * wait in @pending until a batch is complete; then the blocks and the
+ * table are synced and only after that the raw bytes are punched out of
+ * the log, so after a crash every segment is readable one way or the
+ * other. Segment @next is the first one not sealed yet; one that does
+ * not compress is passed over and stays raw. Blocks of segments before
+ * @dropped were given back by segtab_trim().
+ */
+struct segtab {
+	int fd;
+	int lz_fd;
+	char path[PATH_MAX];
+	uint64_t ino;
+	struct segment *segs;
+	size_t count;
+	size_t cap;
+	uint64_t lz_end;
+	uint64_t next;
+	uint64_t dropped;
+	struct segment pending[SEGMENT_BATCH];
+	uint64_t pending_seg[SEGMENT_BATCH];
+	size_t npending;
+
+	//the last segment decompressed, shared by all readers
+	pthread_mutex_t lock;
+	char *cache;
+	int64_t cached;
+};
+
+/**
+ * Load the table kept for the log at @param path with inode @param ino,
+ * @param size bytes long. Missing files just mean nothing was sealed,
+ * they are only created when the first segment is.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int segtab_open(struct segtab *t, const char *path, uint64_t ino, off_t size);
+
+/**
+ * Release what is pending from @param log_fd and close the table.
+ */
+void segtab_close(struct segtab *t, int log_fd);
+
+/**
+ * Remove the block and table files of the log at @param path.
+ */
+void segtab_unlink(const char *path);
+
+static inline int segtab_sealed(const struct segtab *t, uint64_t seg)
+{
+	return seg < t->count && t->segs[seg].len != 0;
+}
+
+/**
+ * Compress the first complete segment in [@param head, @param committed)
+ * of the log @param log_fd that is not sealed yet. One segment per call
+ * keeps the work an append does bounded, a log that fell behind catches
+ * up over the appends that follow.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int segtab_seal(struct segtab *t, int log_fd, off_t head, off_t committed);
+
+/**
+ * Read up to @param len bytes at log offset @param off, which must lie
+ * in a sealed segment, stopping at the end of the segment.
+ * @return number of bytes read, -1 with errno set on failure.
+ */
+ssize_t segtab_read(struct segtab *t, char *buf, size_t len, off_t off);
+
+/**
+ * Copy the compressed block of sealed segment @param seg to @param buf.
+ * @return the block size, -1 with errno set on failure.
+ */
+ssize_t segtab_block(struct segtab *t, uint64_t seg, char *buf, size_t cap);
+
+/**
+ * Give back the space of the blocks of segments wholly before @param head.
+ */
+void segtab_trim(struct segtab *t, off_t head);
+
+#endif
@@ -0,0 +1,373 @@
+#define _GNU_SOURCE
+#include "shm.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "conn.h"
+#include "log.h"
+#include "mem.h"
+#include "query.h"
+#include "upgrade.h"
+
+//records appended per write, and batches taken per wakeup
+#define SHM_BATCH 256
+#define SHM_ROUNDS 16
+
+static struct shm_ring *rings;
+
+//hand the ring and the doorbell to the producer
+static int send_fds(int sock, int memfd, int efd)
+{
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} ctl;
+	int fds[2] = { memfd, efd };
+	char byte = 0;
+	struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+			      .msg_control = ctl.buf, .msg_controllen = sizeof(ctl.buf) };
+	struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(c), fds, sizeof(fds));
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+//map the ring in @r->memfd and start watching its doorbell and socket
+static int shm_setup(struct shm_ring *r, int epfd)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = r };
+
+	r->map_len = SHM_HDR_SIZE + r->size;
+	if(mem_charge(MEM_RECV, r->map_len) == -1)
+		return -1;
+	r->hdr = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, r->memfd, 0);
+	if(r->hdr == MAP_FAILED)
+	{
+		mem_release(MEM_RECV, r->map_len);
+		return -1;
+	}
+	r->data = (char *)r->hdr + SHM_HDR_SIZE;
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, r->efd, &ev) == -1 ||
+	   epoll_ctl(epfd, EPOLL_CTL_ADD, r->sock, &ev) == -1)
+		return -1;
+
+	r->next = rings;
+	r->pprev = &rings;
+	if(rings != NULL)
+		rings->pprev = &r->next;
+	rings = r;
+	return 0;
+}
+
+static struct shm_ring *shm_alloc(int sock, struct channel *ch)
+{
+	struct shm_ring *r = calloc(1, sizeof(*r));
+
+	if(r == NULL)
+		return NULL;
+	r->source = SOURCE_SHM;
+	r->sock = sock;
+	r->memfd = -1;
+	r->efd = -1;
+	r->ch = ch;
+	r->hdr = MAP_FAILED;
+	return r;
+}
+
+static struct shm_ring *shm_new(int epfd, int sock, struct channel *ch)
+{
+	struct shm_ring *r = shm_alloc(sock, ch);
+
+	if(r == NULL)
+	{
+		close(sock);
+		return NULL;
+	}
+	r->size = CFG.shm_size;
+	if((r->memfd = memfd_create("aesdsocket-ring", MFD_CLOEXEC)) == -1 ||
+	   ftruncate(r->memfd, SHM_HDR_SIZE + r->size) == -1 ||
+	   (r->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ||
+	   shm_setup(r, epfd) == -1)
+		goto fail;
+	r->hdr->magic = SHM_RING_MAGIC;
+	r->hdr->size = r->size;
+	//nothing to drain yet, the first record rings the doorbell
+	atomic_store(&r->hdr->sleeping, 1);
+	if(send_fds(sock, r->memfd, r->efd) == -1)
+		goto fail;
+	log_info("shm producer attached, ring of %zu bytes", (size_t)r->size);
+	return r;
+fail:
+	log_error("shm setup: %m");
+	shm_free(r);
+	return NULL;
+}
+
+void shm_adopt(int epfd, const int *fds, struct channel *ch)
+{
+	struct shm_ring *r = shm_alloc(fds[2], ch);
+	struct stat sb;
+
+	if(r == NULL)
+	{
+		close(fds[0]);
+		close(fds[1]);
+		close(fds[2]);
+		return;
+	}
+	r->memfd = fds[0];
+	r->efd = fds[1];
+	//the size is taken from the file, the header is writable by the producer
+	if(fstat(r->memfd, &sb) == -1 || sb.st_size <= SHM_HDR_SIZE)
+		goto fail;
+	r->size = sb.st_size - SHM_HDR_SIZE;
+	if((r->size & (r->size - 1)) || shm_setup(r, epfd) == -1)
+		goto fail;
+	//records published during the hand over are picked up right away
+	uint64_t one = 1;
+	if(write(r->efd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+		goto fail;
+	return;
+fail:
+	log_error("shm adopt: %m");
+	shm_free(r);
+}
+
+void shm_accept(int epfd, int fd, struct channel *ch)
+{
+	for(;;)
+	{
+		int sock = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(sock == -1)
+		{
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				log_error("shm accept: %m");
+			return;
+		}
+		shm_new(epfd, sock, ch);
+	}
+}
+
+void shm_free(struct shm_ring *r)
+{
+	if(r->pprev != NULL)
+	{
+		*r->pprev = r->next;
+		if(r->next != NULL)
+			r->next->pprev = r->pprev;
+	}
+	if(r->hdr != MAP_FAILED)
+	{
+		munmap(r->hdr, r->map_len);
+		mem_release(MEM_RECV, r->map_len);
+	}
+	if(r->memfd != -1)
+		close(r->memfd);
+	if(r->efd != -1)
+		close(r->efd);
+	close(r->sock);
+	free(r->pkts);
+	free(r);
+}
+
+void shm_free_all(void)
+{
+	while(rings != NULL)
+		shm_free(rings);
+}
+
+static _Atomic uint32_t *rec_hdr(struct shm_ring *r, uint64_t pos)
+{
+	return (_Atomic uint32_t *)(r->data + (pos & (r->size - 1)));
+}
+
+static int add_packet(struct shm_ring *r, size_t *n, char *data, size_t len)
+{
+	if(*n == r->pkts_cap)
+	{
+		size_t cap = r->pkts_cap ? r->pkts_cap * 2 : SHM_BATCH;
+		struct iovec *p = realloc(r->pkts, cap * sizeof(*p));
+		if(p == NULL)
+			return -1;
+		r->pkts = p;
+		r->pkts_cap = cap;
+	}
+	r->pkts[*n].iov_base = data;
+	r->pkts[*n].iov_len = len;
+	(*n)++;
+	return 0;
+}
+
+/*********************************************************************
+Gather up to SHM_BATCH published records from *@pos on as packets that
+point straight into the ring. A record may hold several packets, the
+producer always ends it with '\n'. Commands are dropped, there is no
+way to answer them.
+@return number of packets, -1 if the producer wrote a bad record.
+**********************************************************************/
+static ssize_t shm_collect(struct shm_ring *r, uint64_t *pos)
+{
+	const uint64_t size = r->size, start = *pos;
+	size_t n = 0;
+	int recs;
+
+	//a full ring comes back around to the records taken here, which
+	//are still marked ready until they are released
+	for(recs = 0; recs < SHM_BATCH && *pos - start < size; recs++)
+	{
+		uint32_t h = atomic_load_explicit(rec_hdr(r, *pos), memory_order_acquire);
+		uint64_t off = *pos & (size - 1), len = h & SHM_REC_LEN;
+
+		if(!(h & SHM_REC_READY))
+			break;
+		if(off + shm_rec_size(len) > size)
+			return -1;
+		*pos += shm_rec_size(len);
+		if(h & SHM_REC_PAD)
+			continue;
+
+		char *p = r->data + off + 8, *end = p + len;
+		if(len == 0 || end[-1] != '\n')
+			return -1;
+		while(p < end)
+		{
+			char *nl = memchr(p, '\n', end - p);
+			size_t plen = nl - p + 1;
+
+			if(!(plen >= sizeof(QUERY_PREFIX) - 1 &&
+			     memcmp(p, QUERY_PREFIX, sizeof(QUERY_PREFIX) - 1) == 0) &&
+			   add_packet(r, &n, p, plen) == -1)
+				return -1;
+			p = nl + 1;
+		}
+	}
+	return n;
+}
+
+//hand the records in [tail, @pos) back to the producers, zeroed: a record
+//header written later may land on any of their bytes, and a stale one
+//with SHM_REC_READY set would pass for a published record
+static void shm_release(struct shm_ring *r, uint64_t pos)
+{
+	uint64_t tail = atomic_load_explicit(&r->hdr->tail, memory_order_relaxed);
+
+	while(tail < pos)
+	{
+		uint64_t off = tail & (r->size - 1), n = pos - tail;
+
+		if(n > r->size - off)
+			n = r->size - off;
+		memset(r->data + off, 0, n);
+		tail += n;
+	}
+	atomic_store_explicit(&r->hdr->tail, pos, memory_order_release);
+}
+
+/*********************************************************************
+Append whatever the producer published. When the ring runs dry the
+server sets @sleeping and looks once more, so a record published in
+between is never left waiting for a doorbell that will not ring. A
+producer that keeps the ring busy past SHM_ROUNDS batches gets a
+doorbell rung on its behalf, letting the other clients in first.
+@return 0 once the ring is empty, 1 if records are left, -1 on error.
+**********************************************************************/
+static int shm_drain(struct shm_ring *r)
+{
+	struct channel *ch = r->ch;
+	int round;
+
+	for(round = 0; round < SHM_ROUNDS; round++)
+	{
+		uint64_t tail = atomic_load_explicit(&r->hdr->tail, memory_order_relaxed), pos = tail;
+		ssize_t i, n = shm_collect(r, &pos);
+
+		if(n == -1)
+		{
+			log_warn("shm producer wrote a bad record, detaching it");
+			return -1;
+		}
+		if(pos == tail)
+		{
+			atomic_store_explicit(&r->hdr->sleeping, 1, memory_order_relaxed);
+			atomic_thread_fence(memory_order_seq_cst);
+			if(!(atomic_load_explicit(rec_hdr(r, tail), memory_order_relaxed) & SHM_REC_READY))
+				return 0;
+			atomic_store_explicit(&r->hdr->sleeping, 0, memory_order_relaxed);
+			continue;
+		}
+		if(n > 0)
+		{
+			channel_lock(ch);
+			if(store_appendv(&ch->st, r->pkts, n) == -1)
+			{
+				channel_unlock(ch);
+				log_error("shm append: %m");
+				return -1;
+			}
+			for(i = 0; i < n; i++)
+				feed_publish(&ch->feed, r->pkts[i].iov_base, r->pkts[i].iov_len);
+			channel_retain(ch);
+			channel_unlock(ch);
+			feed_notify(ch);
+		}
+		shm_release(r, pos);
+	}
+
+	uint64_t one = 1;
+	if(write(r->efd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+		return -1;
+	return 1;
+}
+
+int shm_event(struct shm_ring *r)
+{
+	uint64_t count;
+	char buf[64];
+	ssize_t rc;
+
+	if(read(r->efd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+		return -1;
+	//the producer has nothing to say on the socket, only its close matters
+	rc = recv(r->sock, buf, sizeof(buf), MSG_DONTWAIT);
+	int gone = rc == 0 || (rc == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+
+	if(!gone)
+		return shm_drain(r) == -1 ? -1 : 0;
+	//take everything it published before going away
+	while((rc = shm_drain(r)) == 1)
+		;
+	log_info("shm producer detached");
+	return -1;
+}
+
+void shm_handoff(int epfd, int sock)
+{
+	while(rings != NULL)
+	{
+		struct shm_ring *r = rings;
+		struct upgrade_item it = { .kind = UPGRADE_SHM_RING, .nfds = 3,
+					   .fds = { r->memfd, r->efd, r->sock } };
+
+		while(shm_drain(r) == 1)
+			;
+		epoll_ctl(epfd, EPOLL_CTL_DEL, r->efd, NULL);
+		epoll_ctl(epfd, EPOLL_CTL_DEL, r->sock, NULL);
+		if(upgrade_send(sock, &it, NULL, 0) == -1)
+			log_error("shm handoff: %m");
+		shm_free(r);
+	}
+}
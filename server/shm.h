@@ -0,0 +1,67 @@
+#ifndef AESD_SHM_H
+#define AESD_SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "channel.h"
+#include "shmring.h"
+#include "source.h"
+
+/**
+ * The server side of one attached producer's ring (see shmring.h).
+ * Both the doorbell and the control socket are watched by the epoll
+ * loop; the control socket closing means the producer went away.
+ * Records are appended to @ch straight out of the shared mapping.
+ */
+struct shm_ring {
+	enum source source;
+	int memfd;
+	int efd;
+	int sock;
+	struct shm_ring_hdr *hdr;
+	char *data;
+	//private copy, the producer can write to the shared header
+	uint64_t size;
+	size_t map_len;
+	struct channel *ch;
+
+	struct iovec *pkts;
+	size_t pkts_cap;
+
+	struct shm_ring *next;
+	struct shm_ring **pprev;
+};
+
+/**
+ * Give every producer waiting on the --shm listening socket @param fd
+ * its own ring, appending to channel @param ch.
+ */
+void shm_accept(int epfd, int fd, struct channel *ch);
+
+/**
+ * Drain @param r after its doorbell or control socket fired.
+ * @return 0 to keep the ring, -1 once the producer is gone and it
+ * should be freed.
+ */
+int shm_event(struct shm_ring *r);
+
+void shm_free(struct shm_ring *r);
+void shm_free_all(void);
+
+/**
+ * Drain every ring and pass it to the new server over the upgrade
+ * socket @param sock, the producers keep writing to the same memory.
+ * The rings are taken out of @param epfd first: the descriptors stay
+ * open in the new server, epoll would go on reporting them.
+ */
+void shm_handoff(int epfd, int sock);
+
+/**
+ * Take over a ring handed over by the previous server: @param fds are
+ * its memfd, doorbell and control socket.
+ */
+void shm_adopt(int epfd, const int *fds, struct channel *ch);
+
+#endif
@@ -0,0 +1,169 @@
+#ifndef AESD_SHMRING_H
+#define AESD_SHMRING_H
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*********************************************************************
+Shared-memory ingestion ring. A producer connects to the server's
+--shm socket and receives two descriptors with SCM_RIGHTS: a memfd
+holding the ring and an eventfd doorbell. The producer side needs
+nothing else from the server, this header is all it includes.
+
+The memfd is a header page followed by @size data bytes (a power of
+two). Producers reserve space by moving @head forward with a CAS, so
+several threads may share one ring, then write an 8-byte record header
+and the packet, and publish it by setting SHM_REC_READY in the header
+last. A record that would wrap is preceded by a padding record, so a
+packet is always contiguous. The server drains records from @tail,
+zeroes them and moves @tail on, which frees the space.
+
+The doorbell is only rung when the server has set @sleeping, so while
+the server keeps up no system call is made on either side.
+**********************************************************************/
+
+#define SHM_RING_MAGIC 0x474e495244534541ULL	//"AESDRING"
+#define SHM_HDR_SIZE 4096
+#define SHM_REC_READY 0x80000000u
+#define SHM_REC_PAD 0x40000000u
+#define SHM_REC_LEN 0x3fffffffu
+
+struct shm_ring_hdr {
+	uint64_t magic;
+	uint64_t size;
+	_Alignas(64) _Atomic uint64_t head;
+	_Alignas(64) _Atomic uint64_t tail;
+	_Atomic uint32_t sleeping;
+};
+
+//bytes a record with @len bytes of packet takes up in the ring
+static inline uint64_t shm_rec_size(uint64_t len)
+{
+	return 8 + ((len + 7) & ~7ULL);
+}
+
+//the producer's view of an attached ring
+struct shm_producer {
+	struct shm_ring_hdr *hdr;
+	char *data;
+	size_t map_len;
+	int efd;
+	int sock;
+};
+
+/**
+ * Attach to the server listening on the --shm socket @param path.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+static inline int shm_attach(struct shm_producer *p, const char *path)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} ctl;
+	char byte;
+	struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+			      .msg_control = ctl.buf, .msg_controllen = sizeof(ctl.buf) };
+	struct cmsghdr *c;
+	int fds[2];
+
+	strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+	if((p->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+		return -1;
+	if(connect(p->sock, (struct sockaddr *)&sun, sizeof(sun)) == -1 ||
+	   recvmsg(p->sock, &msg, MSG_CMSG_CLOEXEC) != 1 ||
+	   (c = CMSG_FIRSTHDR(&msg)) == NULL || c->cmsg_type != SCM_RIGHTS ||
+	   c->cmsg_len != CMSG_LEN(sizeof(fds)))
+		goto fail;
+	memcpy(fds, CMSG_DATA(c), sizeof(fds));
+	p->efd = fds[1];
+
+	struct shm_ring_hdr *h = mmap(NULL, SHM_HDR_SIZE, PROT_READ, MAP_SHARED, fds[0], 0);
+	if(h == MAP_FAILED)
+		goto fail_fds;
+	p->map_len = SHM_HDR_SIZE + h->size;
+	munmap(h, SHM_HDR_SIZE);
+	p->hdr = mmap(NULL, p->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	if(p->hdr == MAP_FAILED || p->hdr->magic != SHM_RING_MAGIC)
+		goto fail_fds;
+	p->data = (char *)p->hdr + SHM_HDR_SIZE;
+	close(fds[0]);
+	return 0;
+fail_fds:
+	close(fds[0]);
+	close(fds[1]);
+fail:
+	close(p->sock);
+	return -1;
+}
+
+/**
+ * Queue one packet of @param len bytes, a '\n' is added if it does not
+ * end with one.
+ * @return 0 on success, -1 with errno EAGAIN while the ring is full or
+ * EMSGSIZE if the packet can never fit.
+ */
+static inline int shm_send(struct shm_producer *p, const void *buf, size_t len)
+{
+	struct shm_ring_hdr *h = p->hdr;
+	const uint64_t size = h->size;
+	int nl = len == 0 || ((const char *)buf)[len - 1] != '\n';
+	uint64_t plen = len + nl, need = shm_rec_size(plen), pos, off, pad;
+
+	if(plen > SHM_REC_LEN || need > size / 2)
+	{
+		errno = EMSGSIZE;
+		return -1;
+	}
+	pos = atomic_load_explicit(&h->head, memory_order_relaxed);
+	do
+	{
+		off = pos & (size - 1);
+		pad = off + need > size ? size - off : 0;
+		if(pos + pad + need - atomic_load_explicit(&h->tail, memory_order_acquire) > size)
+		{
+			errno = EAGAIN;
+			return -1;
+		}
+	} while(!atomic_compare_exchange_weak_explicit(&h->head, &pos, pos + pad + need,
+						       memory_order_relaxed, memory_order_relaxed));
+	if(pad)
+	{
+		atomic_store_explicit((_Atomic uint32_t *)(p->data + off),
+				      SHM_REC_READY | SHM_REC_PAD | (uint32_t)(pad - 8), memory_order_release);
+		off = 0;
+	}
+	memcpy(p->data + off + 8, buf, len);
+	if(nl)
+		p->data[off + 8 + len] = '\n';
+	atomic_store_explicit((_Atomic uint32_t *)(p->data + off), SHM_REC_READY | (uint32_t)plen,
+			      memory_order_release);
+
+	//pairs with the fence the server issues after setting @sleeping
+	atomic_thread_fence(memory_order_seq_cst);
+	if(atomic_load_explicit(&h->sleeping, memory_order_relaxed))
+	{
+		uint64_t one = 1;
+		atomic_store_explicit(&h->sleeping, 0, memory_order_relaxed);
+		if(write(p->efd, &one, sizeof(one)) == -1)
+			return errno == EAGAIN ? 0 : -1;
+	}
+	return 0;
+}
+
+static inline void shm_detach(struct shm_producer *p)
+{
+	munmap(p->hdr, p->map_len);
+	close(p->efd);
+	close(p->sock);
+}
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef AESD_SOURCE_H
+#define AESD_SOURCE_H
+
+/**
+ * Every object registered with the epoll loop starts with one of these,
+ * so the loop can tell from the event's data pointer who handles it.
+ */
+enum source {
+	SOURCE_CONN,
+	SOURCE_LISTENER,
+	SOURCE_UDP,
+	SOURCE_SHM,
+	SOURCE_WORKER,
+	SOURCE_UPGRADE,
+};
+
+#endif
@@ -0,0 +1,723 @@
+#define _GNU_SOURCE
+#include "store.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "crc32c.h"
+#include "log.h"
+#include "probe.h"
+
+#define COPY_CHUNK (64 * 1024)
+//checksums of old packets are checked this many bytes at a time
+#define VERIFY_CHUNK (1024 * 1024)
+//publish the index after this many new packets or bytes
+#define CHECKPOINT_PACKETS 4096
+#define CHECKPOINT_BYTES (64 * 1024 * 1024)
+//while journaling, start writeback of the log every this many bytes
+#define WRITEBACK_BYTES (4 * 1024 * 1024)
+
+static void index_path(const struct store *st, char *buf, size_t len)
+{
+	snprintf(buf, len, "%s.idx", st->path);
+}
+
+static void crc_path(const struct store *st, char *buf, size_t len)
+{
+	snprintf(buf, len, "%s.crc", st->path);
+}
+
+static void journal_path(const struct store *st, char *buf, size_t len)
+{
+	snprintf(buf, len, "%s.wal", st->path);
+}
+
+//read log bytes, from the block of a segment that was sealed
+static ssize_t log_pread(struct store *st, char *buf, size_t len, off_t off)
+{
+	uint64_t seg = off / SEGMENT_SIZE;
+	ssize_t rd;
+
+	if(segtab_sealed(&st->seg, seg))
+		return segtab_read(&st->seg, buf, len, off);
+	//stop short of the next sealed segment, the log has a hole there
+	if(seg + 1 < st->seg.count && (off_t)len > (off_t)((seg + 1) * SEGMENT_SIZE) - off)
+		len = (seg + 1) * SEGMENT_SIZE - off;
+	while((rd = pread(st->fd, buf, len, off)) == -1 && errno == EINTR)
+		;
+	return rd;
+}
+
+static ssize_t scan_read(void *arg, char *buf, size_t len, off_t off)
+{
+	return log_pread(arg, buf, len, off);
+}
+
+static int add_bad(struct store *st, size_t i)
+{
+	if(st->nbad == st->bad_cap)
+	{
+		size_t cap = st->bad_cap ? st->bad_cap * 2 : 16;
+		size_t *b = realloc(st->bad, cap * sizeof(*b));
+		if(b == NULL)
+			return -1;
+		st->bad = b;
+		st->bad_cap = cap;
+	}
+	st->bad[st->nbad++] = i;
+	return 0;
+}
+
+/*********************************************************************
+Check packets [@i, @end) against their stored CRC32C, reading the log
+VERIFY_CHUNK bytes at a time. With @stop set the check ends at the first
+mismatch, otherwise every packet that fails is added to @st->bad.
+@return the first packet that failed, @end if none did, -1 on error.
+**********************************************************************/
+static ssize_t verify_packets(struct store *st, size_t i, size_t end, int stop)
+{
+	const struct pindex *ix = &st->idx;
+	ssize_t first = end;
+	uint32_t crc = 0;
+	char *buf;
+	off_t off, to;
+
+	if(i >= end)
+		return end;
+	if((buf = malloc(VERIFY_CHUNK)) == NULL)
+		return -1;
+	off = index_start(ix, i);
+	to = ix->ends[end - 1];
+	while(off < to)
+	{
+		size_t want = to - off < VERIFY_CHUNK ? to - off : VERIFY_CHUNK;
+		ssize_t rd = log_pread(st, buf, want, off);
+		char *p = buf;
+
+		if(rd == -1 && errno == EINTR)
+			continue;
+		if(rd <= 0)
+		{
+			if(rd == 0)
+				errno = EIO;
+			free(buf);
+			return -1;
+		}
+		while(p < buf + rd)
+		{
+			size_t n = ix->ends[i] - off;
+
+			if(n > (size_t)(buf + rd - p))
+				n = buf + rd - p;
+			crc = crc32c(crc, p, n);
+			p += n;
+			off += n;
+			if((uint64_t)off < ix->ends[i])
+				continue;
+			if(crc != ix->crcs[i])
+			{
+				log_error("packet %zu at offset %llu of %s fails its checksum",
+				       i, (unsigned long long)index_start(ix, i), st->path);
+				if(first == (ssize_t)end)
+					first = i;
+				if(stop)
+					goto done;
+				if(add_bad(st, i) == -1)
+				{
+					free(buf);
+					return -1;
+				}
+			}
+			crc = 0;
+			i++;
+		}
+	}
+done:
+	free(buf);
+	return first;
+}
+
+//check the packets past the checkpoint now, leave the rest for replays
+static int recover_checksums(struct store *st, size_t checkpointed)
+{
+	struct pindex *ix = &st->idx;
+	size_t from;
+	ssize_t bad;
+
+	if(!st->checksums)
+		return 0;
+	if(ix->hdr->crc_from == INDEX_NO_CRC)
+	{
+		//only packets written from now on have a checksum
+		ix->hdr->crc_from = ix->count;
+		log_info("checksumming %s from packet %zu on", st->path, ix->count);
+	}
+	from = ix->hdr->crc_from;
+	bad = verify_packets(st, from > checkpointed ? from : checkpointed, ix->count, 1);
+	if(bad == -1)
+		return -1;
+	if((size_t)bad < ix->count)
+	{
+		log_warn("truncating %s at packet %zd, %zu packets dropped",
+		       st->path, bad, ix->count - bad);
+		index_truncate(ix, bad);
+		if(checkpointed > (size_t)bad)
+			checkpointed = bad;
+	}
+	if(from < checkpointed)
+	{
+		st->verified = index_start(ix, from);
+		st->verify_end = ix->ends[checkpointed - 1];
+	}
+	return 0;
+}
+
+//pwrite() the whole buffer, retrying on short writes
+static int write_full(int fd, const char *buf, size_t len, off_t off)
+{
+	while(len > 0)
+	{
+		ssize_t wr = pwrite(fd, buf, len, off);
+		if(wr == -1)
+		{
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += wr;
+		off += wr;
+		len -= wr;
+	}
+	return 0;
+}
+
+//put a journaled write back into the log, leaving out what was trimmed
+//or sealed since
+static int replay_write(void *arg, off_t off, const char *buf, size_t len)
+{
+	struct store *st = arg;
+	off_t head = st->idx.hdr->head;
+	off_t end = off + len;
+
+	if(off < head)
+	{
+		buf += head - off;
+		off = head;
+	}
+	while(off < end)
+	{
+		uint64_t seg = off / SEGMENT_SIZE;
+		off_t stop = (off_t)((seg + 1) * SEGMENT_SIZE) < end ? (off_t)((seg + 1) * SEGMENT_SIZE) : end;
+
+		if(!segtab_sealed(&st->seg, seg) && write_full(st->fd, buf, stop - off, off) == -1)
+			return -1;
+		buf += stop - off;
+		off = stop;
+	}
+	return 0;
+}
+
+//the log may have lost what the journal of an earlier run holds
+static int store_replay(struct store *st, struct stat *sb)
+{
+	char jpath[PATH_MAX];
+	ssize_t n;
+
+	journal_path(st, jpath, sizeof(jpath));
+	if((n = journal_replay(jpath, replay_write, st)) == -1)
+		return -1;
+	if(n > 0)
+	{
+		log_info("replayed %zd journal records into %s", n, st->path);
+		if(fdatasync(st->fd) == -1 || fstat(st->fd, sb) == -1)
+			return -1;
+	}
+	//all of it is in the log for good now
+	remove(jpath);
+	return 0;
+}
+
+//bring the index up to date with the log and cut off any torn packet
+static int store_recover(struct store *st, off_t size)
+{
+	struct timespec t0, t1;
+	uint64_t covered = index_end(&st->idx);
+	char last;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	//the checkpoint must still match the log, e.g. it is useless if the
+	//log was truncated behind our back
+	if(covered > (uint64_t)size ||
+	   (covered > 0 && (log_pread(st, &last, 1, covered - 1) != 1 || last != '\n')))
+	{
+		log_warn("index checkpoint does not match %s, rescanning", st->path);
+		index_truncate(&st->idx, 0);
+		st->idx.hdr->crc_from = INDEX_NO_CRC;
+		covered = 0;
+	}
+	size_t checkpointed = st->idx.count;
+
+	if(index_scan(&st->idx, scan_read, st, covered, size) == -1)
+		return -1;
+	if(recover_checksums(st, checkpointed) == -1)
+		return -1;
+	st->committed = index_end(&st->idx);
+	if(st->committed < size)
+	{
+		log_warn("truncating %lld byte torn packet at end of %s",
+		       (long long)(size - st->committed), st->path);
+		if(ftruncate(st->fd, st->committed) == -1)
+			return -1;
+	}
+	index_checkpoint(&st->idx);
+	st->head = st->idx.hdr->head;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	log_info("recovered %zu packets (%zu from checkpoint) in %ld us",
+	       st->idx.count, checkpointed,
+	       (long)((t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000));
+	return 0;
+}
+
+int store_open(struct store *st, const char *path, int flags)
+{
+	char ipath[PATH_MAX], cpath[PATH_MAX];
+	struct stat sb;
+
+	//no O_APPEND: copy_file_range() refuses append-only targets and we
+	//track the end of the log ourselves anyway
+	st->path = path;
+	st->sync = 0;
+	st->checksums = !!(flags & STORE_CHECKSUMS);
+	st->compress = !!(flags & STORE_COMPRESS);
+	st->verified = st->verify_end = 0;
+	st->bad = NULL;
+	st->nbad = st->bad_cap = 0;
+	st->jn.fd = -1;
+	st->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if(st->fd == -1)
+		return -1;
+	if(fstat(st->fd, &sb) == -1)
+		goto fail;
+	//sealed segments have to be readable before recovery looks at the log
+	if(segtab_open(&st->seg, path, sb.st_ino, sb.st_size) == -1)
+		goto fail;
+	index_path(st, ipath, sizeof(ipath));
+	crc_path(st, cpath, sizeof(cpath));
+	if(index_open(&st->idx, ipath, st->checksums ? cpath : NULL, sb.st_ino) == -1)
+	{
+		segtab_close(&st->seg, -1);
+		goto fail;
+	}
+	if(store_replay(st, &sb) == -1 || store_recover(st, sb.st_size) == -1)
+	{
+		index_close(&st->idx);
+		segtab_close(&st->seg, -1);
+		goto fail;
+	}
+	segtab_trim(&st->seg, st->head);
+	return 0;
+fail:
+	free(st->bad);
+	st->bad = NULL;
+	close(st->fd);
+	st->fd = -1;
+	return -1;
+}
+
+void store_close(struct store *st)
+{
+	if(st->fd != -1)
+	{
+		if(store_journal(st, 0) == -1)
+			log_error("%s: %m", st->path);
+		index_close(&st->idx);
+		segtab_close(&st->seg, st->fd);
+		close(st->fd);
+	}
+	free(st->bad);
+	st->bad = NULL;
+	st->nbad = st->bad_cap = 0;
+	st->fd = -1;
+}
+
+void store_unlink(struct store *st)
+{
+	char ipath[PATH_MAX];
+
+	index_path(st, ipath, sizeof(ipath));
+	remove(st->path);
+	remove(ipath);
+	crc_path(st, ipath, sizeof(ipath));
+	remove(ipath);
+	journal_path(st, ipath, sizeof(ipath));
+	remove(ipath);
+	segtab_unlink(st->path);
+}
+
+int store_journal(struct store *st, int on)
+{
+	char jpath[PATH_MAX];
+
+	if(!on == (st->jn.fd == -1))
+		return 0;
+	journal_path(st, jpath, sizeof(jpath));
+	if(on)
+	{
+		st->written_back = st->committed;
+		return journal_open(&st->jn, jpath);
+	}
+	//the journal may be all there is of the last packets
+	if(fdatasync(st->fd) == -1)
+		return -1;
+	journal_close(&st->jn);
+	remove(jpath);
+	return 0;
+}
+
+//record a packet with checksum @crc that now ends at the committed offset
+static int store_index(struct store *st, uint32_t crc)
+{
+	if(index_push(&st->idx, st->committed) == -1)
+		return -1;
+	if(st->checksums)
+		st->idx.crcs[st->idx.count - 1] = crc;
+	if(st->idx.count - st->idx.hdr->count >= CHECKPOINT_PACKETS ||
+	   st->committed - st->idx.checkpointed >= CHECKPOINT_BYTES)
+		index_checkpoint(&st->idx);
+	return 0;
+}
+
+//compress the next segment complete in the log, if any
+static int store_seal(struct store *st)
+{
+	if(!st->compress || (off_t)((st->seg.next + 1) * SEGMENT_SIZE) > st->committed)
+		return 0;
+	//recovery then never has to scan what is about to be punched out
+	index_checkpoint(&st->idx);
+	//the packets are committed either way, a segment that could not be
+	//sealed just stays raw
+	if(segtab_seal(&st->seg, st->fd, st->head, st->committed) == -1)
+		log_error("seal: %m");
+	return 0;
+}
+
+//with --durability=commit, wait for what was just written to reach the disk
+static int store_sync(struct store *st, off_t from)
+{
+	if(!st->sync)
+		return 0;
+	PROBE2(fsync_start, 0, from);
+	int rc = fdatasync(st->fd);
+	PROBE2(fsync_end, 0, from);
+	return rc;
+}
+
+//sync the log and start the journal over, it holds nothing the log lacks
+static int journal_wrap(struct store *st)
+{
+	if(fdatasync(st->fd) == -1 || journal_reset(&st->jn) == -1)
+		return -1;
+	st->written_back = st->committed;
+	return 0;
+}
+
+//with --durability=journal, get the packets about to go to the log on
+//disk first
+static int store_journal_write(struct store *st, const struct iovec *iov, int cnt)
+{
+	if(st->jn.fd == -1)
+		return 0;
+	PROBE2(fsync_start, 0, st->committed);
+	int rc = journal_write(&st->jn, st->committed, iov, cnt);
+	PROBE2(fsync_end, 0, st->committed);
+	if(rc == -1)
+	{
+		//a record cut short would hide every later one from recovery
+		int err = errno;
+		if(journal_wrap(st) == -1)
+			log_error("journal of %s: %m", st->path);
+		errno = err;
+	}
+	return rc;
+}
+
+//keep the journal bounded and the log trickling out to disk, instead of
+//piling up dirty pages for the kernel to flush in one go
+static int store_writeback(struct store *st)
+{
+	if(st->jn.fd == -1)
+		return 0;
+	if(journal_size(&st->jn) >= JOURNAL_MAX)
+		return journal_wrap(st);
+	if(st->committed - st->written_back >= WRITEBACK_BYTES)
+	{
+		if(sync_file_range(st->fd, st->written_back, st->committed - st->written_back,
+				   SYNC_FILE_RANGE_WRITE) == -1)
+			return -1;
+		st->written_back = st->committed;
+	}
+	return 0;
+}
+
+int store_append(struct store *st, const char *buf, size_t len)
+{
+	struct iovec iov = { .iov_base = (char *)buf, .iov_len = len };
+
+	if(store_journal_write(st, &iov, 1) == -1)
+		return -1;
+	if(write_full(st->fd, buf, len, st->committed) == -1)
+		return -1;
+	if(store_sync(st, st->committed) == -1)
+		return -1;
+	st->committed += len;
+	if(store_index(st, st->checksums ? crc32c(0, buf, len) : 0) == -1)
+		return -1;
+	if(store_writeback(st) == -1)
+		return -1;
+	return store_seal(st);
+}
+
+//pwritev() @cnt packets, finishing a short write piece by piece
+static int writev_full(int fd, const struct iovec *iov, int cnt, off_t off)
+{
+	while(cnt > 0)
+	{
+		int n = cnt < IOV_MAX ? cnt : IOV_MAX;
+		ssize_t wr = pwritev(fd, iov, n, off);
+		if(wr == -1)
+		{
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		for(; n > 0 && (size_t)wr >= iov->iov_len; n--, cnt--, iov++)
+		{
+			wr -= iov->iov_len;
+			off += iov->iov_len;
+		}
+		if(n > 0 && wr > 0)
+		{
+			if(write_full(fd, (char *)iov->iov_base + wr, iov->iov_len - wr, off + wr) == -1)
+				return -1;
+			off += iov->iov_len;
+			iov++;
+			cnt--;
+		}
+	}
+	return 0;
+}
+
+int store_appendv(struct store *st, const struct iovec *iov, int cnt)
+{
+	int i;
+
+	if(store_journal_write(st, iov, cnt) == -1)
+		return -1;
+	if(writev_full(st->fd, iov, cnt, st->committed) == -1)
+		return -1;
+	if(store_sync(st, st->committed) == -1)
+		return -1;
+	for(i = 0; i < cnt; i++)
+	{
+		st->committed += iov[i].iov_len;
+		if(store_index(st, st->checksums ? crc32c(0, iov[i].iov_base, iov[i].iov_len) : 0) == -1)
+			return -1;
+	}
+	if(store_writeback(st) == -1)
+		return -1;
+	return store_seal(st);
+}
+
+int store_trim(struct store *st, off_t keep)
+{
+	off_t head;
+	size_t i;
+
+	if(st->committed - st->head <= keep)
+		return 0;
+	//first packet that starts inside the last keep bytes
+	i = index_find(&st->idx, st->committed - keep);
+	head = index_start(&st->idx, i);
+	if(head < st->committed - keep)
+		head = st->idx.ends[i];
+	if(head <= st->head)
+		return 0;
+	if(fallocate(st->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, st->head, head - st->head) == -1 &&
+	   errno != EOPNOTSUPP)
+		return -1;
+	st->head = head;
+	st->idx.hdr->head = head;
+	segtab_trim(&st->seg, head);
+	return 0;
+}
+
+ssize_t store_read(struct store *st, char *buf, size_t len, off_t off)
+{
+	if(off >= st->committed)
+		return 0;
+	if((off_t)len > st->committed - off)
+		len = st->committed - off;
+	return log_pread(st, buf, len, off);
+}
+
+ssize_t store_read_block(struct store *st, off_t off, size_t len, char *buf, size_t cap)
+{
+	uint64_t seg = off / SEGMENT_SIZE;
+
+	if(len != SEGMENT_SIZE || off % SEGMENT_SIZE || !segtab_sealed(&st->seg, seg))
+		return 0;
+	return segtab_block(&st->seg, seg, buf, cap);
+}
+
+int store_verify(struct store *st, off_t upto)
+{
+	const struct pindex *ix = &st->idx;
+	off_t from = st->verified > st->head ? st->verified : st->head;
+
+	if(upto > st->verify_end)
+		upto = st->verify_end;
+	if(from >= upto)
+		return 0;
+	//a replay carries on from here, so check a whole chunk at once
+	upto = from + VERIFY_CHUNK < st->verify_end ? from + VERIFY_CHUNK : st->verify_end;
+
+	size_t end = index_find(ix, upto - 1) + 1;
+	if(verify_packets(st, index_find(ix, from), end, 0) == -1)
+		return -1;
+	st->verified = ix->ends[end - 1];
+	return 0;
+}
+
+ssize_t store_bad(const struct store *st, off_t from, off_t to)
+{
+	const struct pindex *ix = &st->idx;
+	size_t lo = 0, hi = st->nbad;
+
+	//first bad packet ending after from
+	while(lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		if(ix->ends[st->bad[mid]] > (uint64_t)from)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	if(lo == st->nbad || index_start(ix, st->bad[lo]) >= (uint64_t)to)
+		return -1;
+	return st->bad[lo];
+}
+
+int stage_open(struct stage *sg, const struct store *st)
+{
+	char dir[PATH_MAX];
+
+	snprintf(dir, sizeof(dir), "%s", st->path);
+	sg->len = 0;
+	sg->checksums = st->checksums;
+	sg->crc = 0;
+	sg->fd = open(dirname(dir), O_RDWR | O_TMPFILE | O_CLOEXEC, 0600);
+	if(sg->fd != -1)
+		return 0;
+
+	//filesystems without O_TMPFILE: create a named file and unlink it at once
+	char tmpl[PATH_MAX];
+	snprintf(tmpl, sizeof(tmpl), "%s.stageXXXXXX", st->path);
+	sg->fd = mkostemp(tmpl, O_CLOEXEC);
+	if(sg->fd == -1)
+		return -1;
+	unlink(tmpl);
+	return 0;
+}
+
+int stage_write(struct stage *sg, const char *buf, size_t len)
+{
+	if(write_full(sg->fd, buf, len, sg->len) == -1)
+		return -1;
+	if(sg->checksums)
+		sg->crc = crc32c(sg->crc, buf, len);
+	sg->len += len;
+	return 0;
+}
+
+void stage_close(struct stage *sg)
+{
+	if(sg->fd != -1)
+		close(sg->fd);
+	sg->fd = -1;
+	sg->len = 0;
+}
+
+//copy the staged bytes to @off in the log without pulling them into memory
+//more than COPY_CHUNK at a time
+static int copy_stage(struct store *st, struct stage *sg, off_t off)
+{
+	off_t in = 0, out = off;
+
+	while(in < sg->len)
+	{
+		ssize_t cp = copy_file_range(sg->fd, &in, st->fd, &out, sg->len - in, 0);
+		if(cp > 0)
+			continue;
+		if(cp == -1 && errno == EINTR)
+			continue;
+		if(cp == -1 && errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP)
+			return -1;
+		break;
+	}
+
+	//fallback for kernels or filesystems that cannot copy in-kernel
+	if(in < sg->len)
+	{
+		char *buf = malloc(COPY_CHUNK);
+		if(buf == NULL)
+			return -1;
+		while(in < sg->len)
+		{
+			size_t want = sg->len - in < COPY_CHUNK ? sg->len - in : COPY_CHUNK;
+			ssize_t rd = pread(sg->fd, buf, want, in);
+			if(rd == -1 && errno == EINTR)
+				continue;
+			if(rd <= 0 || write_full(st->fd, buf, rd, out) == -1)
+			{
+				free(buf);
+				if(rd == 0)
+					errno = EIO;
+				return -1;
+			}
+			in += rd;
+			out += rd;
+		}
+		free(buf);
+	}
+	return 0;
+}
+
+int store_commit_stage(struct store *st, struct stage *sg, const char *tail, size_t len)
+{
+	if(copy_stage(st, sg, st->committed) == -1)
+		return -1;
+	if(write_full(st->fd, tail, len, st->committed + sg->len) == -1)
+		return -1;
+	if(store_sync(st, st->committed) == -1)
+		return -1;
+	//too big to journal, a staged packet is synced in place instead
+	if(st->jn.fd != -1 && journal_wrap(st) == -1)
+		return -1;
+	st->committed += sg->len + len;
+	if(store_index(st, st->checksums ? crc32c(sg->crc, tail, len) : 0) == -1)
+		return -1;
+	if(store_writeback(st) == -1)
+		return -1;
+	return store_seal(st);
+}
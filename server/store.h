@@ -0,0 +1,159 @@
+#ifndef AESD_STORE_H
+#define AESD_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "index.h"
+#include "journal.h"
+#include "segment.h"
+
+//store_open() flags
+#define STORE_CHECKSUMS 1
+#define STORE_COMPRESS 2
+
+/**
+ * The packet log that aesdsocket appends to and replays from.
+ * Only the first @committed bytes are visible to readers, anything written
+ * past that point belongs to a packet which has not seen its '\n' yet.
+ * @idx records where every committed packet ends and is kept next to the
+ * log as <path>.idx. With @sync set every packet is fdatasync()ed before
+ * it is committed. Bytes before @head were dropped by store_trim() and
+ * read back as zeros.
+ * With @checksums set the CRC32C of every packet is kept in <path>.crc.
+ * The unindexed tail is checked on recovery; the rest of what an earlier
+ * run wrote, up to @verify_end, is checked lazily by store_verify() and
+ * packets that fail are listed in @bad.
+ * With @compress set complete segments are sealed into @seg as the log
+ * grows; reads of sealed segments are served from their blocks.
+ * While @jn is open every packet is journaled before it goes to the log,
+ * which is then left to writeback, started early from @written_back on.
+ */
+struct store {
+	int fd;
+	const char *path;
+	off_t head;
+	off_t committed;
+	int sync;
+	struct pindex idx;
+
+	int checksums;
+	off_t verified;
+	off_t verify_end;
+	size_t *bad;
+	size_t nbad;
+	size_t bad_cap;
+
+	int compress;
+	struct segtab seg;
+
+	struct journal jn;
+	off_t written_back;
+};
+
+/**
+ * Staging region for a packet that outgrew the in-memory threshold.
+ * The partial packet is streamed into an unlinked file on the same
+ * filesystem as the log and only copied into the log once it is complete,
+ * so readers never observe half a packet.
+ */
+struct stage {
+	int fd;
+	off_t len;
+	int checksums;
+	uint32_t crc;
+};
+
+/**
+ * Open (creating if needed) the log at @param path and recover it: the
+ * index checkpoint is mapped back in, only the unindexed tail is scanned
+ * and a torn trailing packet left by a crash is truncated away. With
+ * STORE_CHECKSUMS in @param flags, the tail is also cut at the first
+ * packet whose CRC32C does not match; STORE_COMPRESS seals and compresses
+ * complete segments as they fill. What a journal left by an earlier run
+ * holds is written back to the log first.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int store_open(struct store *st, const char *path, int flags);
+void store_close(struct store *st);
+
+/**
+ * Remove the log, its index, checksums and blocks from disk. The store
+ * must be closed.
+ */
+void store_unlink(struct store *st);
+
+/**
+ * Start journaling packets to <path>.wal if @param on is set, else sync
+ * the log and drop the journal.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int store_journal(struct store *st, int on);
+
+/**
+ * Append one complete packet of @param len bytes and make it visible.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int store_append(struct store *st, const char *buf, size_t len);
+
+/**
+ * Append @param cnt complete packets, one per iovec, with a single write
+ * (and a single fdatasync() when syncing) and make them visible together.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int store_appendv(struct store *st, const struct iovec *iov, int cnt);
+
+/**
+ * Drop the oldest packets until at most @param keep bytes remain. Their
+ * disk space is released with a hole punch, so offsets of the remaining
+ * packets do not move.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int store_trim(struct store *st, off_t keep);
+
+/**
+ * Read up to @param len committed bytes starting at @param off.
+ * @return number of bytes read, 0 at the committed end, -1 on error.
+ */
+ssize_t store_read(struct store *st, char *buf, size_t len, off_t off);
+
+/**
+ * If [@param off, @param off + @param len) is exactly a sealed segment,
+ * copy its compressed block to @param buf.
+ * @return the block size, 0 if the range is not a sealed segment, -1 on error.
+ */
+ssize_t store_read_block(struct store *st, off_t off, size_t len, char *buf, size_t cap);
+
+/**
+ * Check the checksums of the packets up to log offset @param upto that
+ * were written by an earlier run and not checked yet. Work is done a
+ * megabyte at a time, so a replay pays for it as it goes.
+ * @return 0 on success, -1 with errno set if the log cannot be read.
+ */
+int store_verify(struct store *st, off_t upto);
+
+/**
+ * @return the first packet overlapping [@param from, @param to) that
+ * store_verify() found corrupt, -1 if there is none.
+ */
+ssize_t store_bad(const struct store *st, off_t from, off_t to);
+
+/**
+ * Start staging a packet next to the log held by @param st.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int stage_open(struct stage *sg, const struct store *st);
+int stage_write(struct stage *sg, const char *buf, size_t len);
+void stage_close(struct stage *sg);
+
+/**
+ * Move the staged bytes followed by the final @param len bytes of the packet
+ * (ending in '\n') into the log, then commit the whole packet at once.
+ * The caller still owns the stage and closes it afterwards.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int store_commit_stage(struct store *st, struct stage *sg, const char *tail, size_t len);
+
+#endif
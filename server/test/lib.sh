@@ -0,0 +1,112 @@
+#!/bin/bash
+# Helpers for the aesdsocket checks in this directory, sourced by every
+# test-*.sh. Like the assignment-autotest socket test, a check runs its
+# own server and talks to it as a client would, here through bash's
+# /dev/tcp and /dev/udp so nothing but bash and coreutils is needed.
+# The first mismatch ends the check with a message and the tail of the
+# server log.
+
+TEST_DIR=$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)
+AESDSOCKET=${AESDSOCKET:-$TEST_DIR/../aesdsocket}
+PORT=${PORT:-9500}
+# seconds the server may stay silent before a reply counts as complete
+QUIET=${QUIET:-0.5}
+WORK=$(mktemp -d /tmp/aesdtest.XXXXXX)
+SERVER_PID=
+
+# a server still running here is left over from a failed check
+cleanup()
+{
+	if [ -n "$SERVER_PID" ]; then
+		kill -KILL "$SERVER_PID" 2>/dev/null
+		wait "$SERVER_PID" 2>/dev/null
+	fi
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+fail()
+{
+	echo "FAIL: $*" >&2
+	if [ -f "$WORK/server.log" ]; then
+		echo "--- server log:" >&2
+		tail -20 "$WORK/server.log" >&2
+	fi
+	exit 1
+}
+
+# wait_port PORT: wait until something accepts connections on PORT
+wait_port()
+{
+	local i
+
+	for i in $(seq 50); do
+		if (exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null; then
+			return 0
+		fi
+		sleep 0.1
+	done
+	return 1
+}
+
+# start_server [OPTION...]: run aesdsocket on $PORT with its log and
+# packet log in $WORK, return once it accepts connections
+start_server()
+{
+	"$AESDSOCKET" -p "$PORT" -f "$WORK/data" --log="$WORK/server.log" "$@" &
+	SERVER_PID=$!
+	wait_port "$PORT" || fail "server did not come up"
+}
+
+# stop_server: SIGTERM the server, it has to exit cleanly
+stop_server()
+{
+	local rc
+
+	kill -TERM "$SERVER_PID"
+	wait "$SERVER_PID"
+	rc=$?
+	SERVER_PID=
+	[ $rc -eq 0 ] || fail "server exited with $rc"
+}
+
+# open_conn FD: connect descriptor FD to the server
+open_conn()
+{
+	eval "exec $1<>/dev/tcp/127.0.0.1/$PORT" || fail "cannot connect to port $PORT"
+}
+
+close_conn()
+{
+	eval "exec $1<&- $1>&-"
+}
+
+# read_reply FD: print what the server sends on FD until it is quiet for
+# $QUIET seconds; a last line cut short of its '\n' is followed by a
+# "[no newline]" line, command substitution would hide it otherwise
+read_reply()
+{
+	local line
+
+	while IFS= read -r -t "$QUIET" line <&$1; do
+		printf '%s\n' "$line"
+	done
+	[ -z "$line" ] || printf '%s\n[no newline]\n' "$line"
+}
+
+# send_recv DATA: send DATA (printf escapes allowed) on a connection of
+# its own and print the reply
+send_recv()
+{
+	open_conn 3
+	printf "$1" >&3
+	read_reply 3
+	close_conn 3
+}
+
+# expect_eq GOT WANT WHAT
+expect_eq()
+{
+	[ "$1" == "$2" ] || fail "$3: expected '$2', got '$1'"
+}
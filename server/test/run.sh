@@ -0,0 +1,19 @@
+#!/bin/bash
+# Run every check in this directory against ../aesdsocket (or
+# $AESDSOCKET), one after the other since they share $PORT.
+# usage: run.sh [test-NAME.sh...]
+
+cd "$(dirname "$0")"
+failed=0
+tests=("$@")
+[ ${#tests[@]} -gt 0 ] || tests=(test-*.sh)
+for t in "${tests[@]}"; do
+	if timeout 120 bash "$t"; then
+		echo "PASS $t"
+	else
+		echo "FAIL $t"
+		failed=$((failed + 1))
+	fi
+done
+echo "$failed of ${#tests[@]} checks failed"
+[ $failed -eq 0 ]
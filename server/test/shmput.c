@@ -0,0 +1,48 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "shmring.h"
+
+/*********************************************************************
+shmput is the --shm producer of test-shm.sh: it attaches to the server
+at the socket given and queues every line of its input as one packet,
+waiting for the server to free room whenever the ring is full.
+**********************************************************************/
+
+int main(int argc, char *argv[])
+{
+	const struct timespec pause = { .tv_nsec = 100 * 1000 };
+	struct shm_producer p;
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+
+	if(argc != 2)
+	{
+		fprintf(stderr, "usage: %s SOCKET < packets\n", argv[0]);
+		return 2;
+	}
+	if(shm_attach(&p, argv[1]) == -1)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+	while((len = getline(&line, &cap, stdin)) != -1)
+	{
+		while(shm_send(&p, line, len) == -1)
+		{
+			if(errno != EAGAIN)
+			{
+				perror("shm_send");
+				return 1;
+			}
+			nanosleep(&pause, NULL);
+		}
+	}
+	free(line);
+	shm_detach(&p);
+	return 0;
+}
@@ -0,0 +1,24 @@
+#!/bin/bash
+# The logger holds back a message repeated word for word more than 20
+# times a second and reports how many it held back, while distinct
+# messages are all written however many come in.
+. "$(dirname "$0")/lib.sh"
+
+CLIENTS=100
+
+start_server --max-channels=0
+for i in $(seq $CLIENTS); do
+	QUIET=0.005 send_recv "AESDSOCKET_CHANNEL:ch$i\n" >/dev/null
+done
+stop_server
+
+log=$WORK/server.log
+for i in $(seq $CLIENTS); do
+	grep -q "switched to channel 'ch$i'$" "$log" || fail "switch to ch$i not logged"
+done
+# every connection, start_server()'s included, is written or counted
+written=$(grep -c "Connected with the IP: 127.0.0.1$" "$log")
+held=$(sed -n 's/.*Connected with the IP: 127.0.0.1 (\([0-9]*\) identical messages suppressed)$/\1/p' "$log" |
+	awk '{ n += $1 } END { print n + 0 }')
+[ "$held" -gt 0 ] || fail "no repeats held back"
+expect_eq "$((written + held))" "$((CLIENTS + 1))" "connections written or counted"
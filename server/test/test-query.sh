@@ -0,0 +1,15 @@
+#!/bin/bash
+# Queries answer with the packets they select. A reply that is not log
+# data comes out whole even when it is longer than --recv-size.
+. "$(dirname "$0")/lib.sh"
+
+start_server --recv-size=8
+send_recv 'alpha\nbeta\ngamma one\ndelta\ngamma two\n' >/dev/null
+expect_eq "$(send_recv 'AESDSOCKET_TAIL:2\n')" $'delta\ngamma two' "TAIL"
+expect_eq "$(send_recv 'AESDSOCKET_PACKETS:1,3\n')" $'beta\ngamma one' "PACKETS"
+expect_eq "$(send_recv 'AESDSOCKET_BYTES:0,6\n')" "alpha" "BYTES"
+expect_eq "$(send_recv 'AESDSOCKET_GREP:gamma\n')" $'gamma one\ngamma two' "GREP"
+expect_eq "$(send_recv 'AESDSOCKET_REGEX:^(beta|delta)$\n')" $'beta\ndelta' "REGEX"
+expect_eq "$(send_recv 'AESDSOCKET_NOSUCH\n')" "AESDSOCKET_ERROR:bad command" "unknown command"
+expect_eq "$(send_recv 'AESDSOCKET_CHANNEL:bad/name\n')" "AESDSOCKET_ERROR:bad channel" "bad channel name"
+stop_server
@@ -0,0 +1,50 @@
+#!/bin/bash
+# SIGHUP picks up the reloadable options from the config file while
+# clients keep sending, and the options it replaces are freed: hundreds
+# of reloads must not grow the server.
+. "$(dirname "$0")/lib.sh"
+
+# rss: resident KiB of the server
+rss()
+{
+	awk '/^VmRSS/ { print $2 }' "/proc/$SERVER_PID/status"
+}
+
+# reload N: send N SIGHUPs, far enough apart to be picked up one by one
+reload()
+{
+	local i
+
+	for i in $(seq "$1"); do
+		kill -HUP "$SERVER_PID"
+		sleep 0.005
+	done
+}
+
+echo "log-level = info" >"$WORK/conf"
+start_server -c "$WORK/conf" --workers=2
+
+# clients sending all the while, on both workers
+(
+	for i in $(seq 200); do
+		QUIET=0.02 send_recv "client $i\n" >/dev/null
+	done
+) &
+traffic=$!
+
+reload 100
+before=$(rss)
+reload 400
+after=$(rss)
+wait $traffic
+[ $((after - before)) -lt 2048 ] || fail "400 reloads grew the server from $before to $after KiB"
+
+echo "log-level = warn" >"$WORK/conf"
+kill -HUP "$SERVER_PID"
+sleep 0.5
+logged=$(wc -l <"$WORK/server.log")
+send_recv 'last\n' >/dev/null
+sleep 0.5
+tail -n +$((logged + 1)) "$WORK/server.log" | grep -q "Connected with" && fail "log-level not reloaded"
+[ "$(send_recv 'AESDSOCKET_TAIL:1000\n' | wc -l)" -eq 201 ] || fail "packets lost while reloading"
+stop_server
@@ -0,0 +1,22 @@
+#!/bin/bash
+# Packets queued by a --shm producer reach the log whole and in order,
+# over many laps of the smallest ring, padding records and a ring that
+# keeps filling up included.
+. "$(dirname "$0")/lib.sh"
+
+SHMPUT=$TEST_DIR/shmput
+[ -x "$SHMPUT" ] || fail "$SHMPUT missing, run make check"
+
+# 3000 packets of 3 to 900 bytes, some 150 laps of a 4 KiB ring
+awk 'BEGIN { for(i = 0; i < 3000; i++) { s = i ":"; for(n = (i * 37) % 897; n > 0; n--) s = s "x"; print s } }' \
+	>"$WORK/packets"
+size=$(stat -c %s "$WORK/packets")
+
+start_server -k --shm="$WORK/shm.sock" --shm-size=4096
+timeout 20 "$SHMPUT" "$WORK/shm.sock" <"$WORK/packets" || fail "producer failed or stuck"
+for i in $(seq 50); do
+	[ "$(stat -c %s "$WORK/data" 2>/dev/null)" == "$size" ] && break
+	sleep 0.1
+done
+stop_server
+cmp "$WORK/packets" "$WORK/data" || fail "the log differs from the packets queued"
@@ -0,0 +1,16 @@
+#!/bin/bash
+# Every packet is answered with the whole log, packets may be split
+# across sends and connections.
+. "$(dirname "$0")/lib.sh"
+
+start_server
+expect_eq "$(send_recv 'abcdefg\n')" "abcdefg" "first packet"
+expect_eq "$(send_recv 'hijklmnop\n')" $'abcdefg\nhijklmnop' "second packet"
+
+open_conn 3
+printf '1234' >&3
+sleep 0.2
+printf '5678\n' >&3
+expect_eq "$(read_reply 3)" $'abcdefg\nhijklmnop\n12345678' "packet sent in two parts"
+close_conn 3
+stop_server
@@ -0,0 +1,19 @@
+#!/bin/bash
+# AESDSOCKET_STATS answers with one whole line of counters, however small
+# --recv-size is, and counts clients turned away at --max-connections.
+. "$(dirname "$0")/lib.sh"
+
+start_server --recv-size=128 --max-connections=1
+open_conn 4
+# the connection of start_server() may still be closing
+sleep 0.2
+expect_eq "$(send_recv 'x\n')" "AESDSOCKET_ERROR:too many connections" "client over the limit"
+close_conn 4
+sleep 0.2
+
+stats=$(send_recv 'AESDSOCKET_STATS\n')
+[[ "$stats" == AESDSOCKET_STATS:connections=1\ * ]] || fail "STATS line starts wrong: '$stats'"
+[[ "$stats" == *" udp_dropped=0" ]] || fail "STATS line cut short: '$stats'"
+[[ "$stats" == *" accepted=3 rejected=1 "* ]] || fail "admission counters wrong: '$stats'"
+[ "$(printf '%s\n' "$stats" | wc -l)" -eq 1 ] || fail "STATS is not one line: '$stats'"
+stop_server
@@ -0,0 +1,29 @@
+#!/bin/bash
+# With --udp-ack every datagram is answered: ACK with the end offset of
+# what it stored, NACK with the reason when nothing of it was stored.
+. "$(dirname "$0")/lib.sh"
+
+UDP_PORT=$((PORT + 1))
+
+# udp_send DATA: send DATA as one datagram, print the answer. printf
+# writes a line at a time and read takes a byte per recv(), losing the
+# rest of the datagram, so dd does both ends.
+udp_send()
+{
+	printf "$1" | dd bs=64k count=1 iflag=fullblock status=none >&4
+	timeout 2 dd bs=512 count=1 status=none <&4
+}
+
+start_server -u "$UDP_PORT" --udp-ack --udp-size=64
+exec 4<>/dev/udp/127.0.0.1/$UDP_PORT
+
+expect_eq "$(udp_send 'hello\n')" "AESDSOCKET_ACK:6" "stored datagram"
+expect_eq "$(udp_send 'AESDSOCKET_TAIL:1\n')" "AESDSOCKET_NACK:command" "command datagram"
+expect_eq "$(udp_send 'two\nAESDSOCKET_TAIL:1\n')" "AESDSOCKET_ACK:10" "datagram with a command"
+expect_eq "$(udp_send "$(printf 'x%.0s' $(seq 100))\n")" "AESDSOCKET_NACK:truncated" "oversized datagram"
+expect_eq "$(udp_send 'no newline')" "AESDSOCKET_ACK:21" "datagram without its newline"
+
+stats=$(send_recv 'AESDSOCKET_STATS\n')
+[[ "$stats" == *" udp_dropped=3" ]] || fail "udp_dropped not 3 in '$stats'"
+expect_eq "$(send_recv 'tcp\n')" $'hello\ntwo\nno newline\ntcp' "log after the datagrams"
+stop_server
@@ -0,0 +1,46 @@
+#!/bin/bash
+# SIGUSR2 starts the binary again and hands everything over to it. A
+# client in the middle of a packet is passed on at once, not waited for:
+# new clients are served right away and the packet completes on the new
+# server.
+. "$(dirname "$0")/lib.sh"
+
+# ms: milliseconds since the epoch
+ms()
+{
+	echo $(($(date +%s%N) / 1000000))
+}
+
+start_server --workers=2
+send_recv 'before\n' >/dev/null
+open_conn 4
+printf 'first half, ' >&4
+sleep 0.2
+
+start=$(ms)
+kill -USR2 "$SERVER_PID"
+wait "$SERVER_PID"
+rc=$?
+took=$(($(ms) - start))
+old=$SERVER_PID
+# the new server is not our child, cleanup() still kills it by pid
+SERVER_PID=$(sed -n 's/.*upgrade: \(started\|handing over to\) pid \([0-9]*\)$/\2/p' "$WORK/server.log" | tail -1)
+[ $took -lt 2000 ] || fail "old server took $took ms to hand over"
+[ $rc -eq 0 ] || fail "old server exited with $rc"
+[ -n "$SERVER_PID" ] && [ "$SERVER_PID" != "$old" ] || fail "no new server started"
+expect_eq "$(QUIET=0.2 send_recv 'after\n')" $'before\nafter' "reply from the new server"
+took=$(($(ms) - start))
+[ $took -lt 2000 ] || fail "new client waited $took ms for the upgrade"
+
+printf 'second half\n' >&4
+expect_eq "$(read_reply 4)" $'before\nafter\nfirst half, second half' "packet split across the upgrade"
+close_conn 4
+
+kill -TERM "$SERVER_PID"
+for i in $(seq 50); do
+	[ -d "/proc/$SERVER_PID" ] || break
+	sleep 0.1
+done
+[ -d "/proc/$SERVER_PID" ] && fail "new server did not exit"
+SERVER_PID=
+grep -q "caught signal, exiting$" "$WORK/server.log" || fail "new server did not exit cleanly"
@@ -0,0 +1,154 @@
+#include "timer.h"
+
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+//furthest a timer can be set, later ones are cut back to this
+#define WHEEL_SPAN ((1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+uint64_t timer_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void wheel_init(struct wheel *w)
+{
+	memset(w, 0, sizeof(*w));
+	w->tick = timer_now() / TIMER_TICK_MS;
+}
+
+static void slot_push(struct timer **slot, struct timer *t)
+{
+	t->next = *slot;
+	if(t->next != NULL)
+		t->next->pprev = &t->next;
+	t->pprev = slot;
+	*slot = t;
+}
+
+//file @t under the level its distance from the current tick falls in
+static void wheel_add(struct wheel *w, struct timer *t)
+{
+	uint64_t expires = t->expires < w->tick ? w->tick : t->expires;
+	uint64_t delta = expires - w->tick;
+	int lvl = 0;
+
+	if(delta > WHEEL_SPAN)
+		expires = w->tick + WHEEL_SPAN;
+	while(lvl < WHEEL_LEVELS - 1 && delta >> (WHEEL_BITS * (lvl + 1)) != 0)
+		lvl++;
+	slot_push(&w->slots[lvl][(expires >> (WHEEL_BITS * lvl)) & WHEEL_MASK], t);
+}
+
+void timer_set(struct wheel *w, struct timer *t, uint64_t ms)
+{
+	uint64_t expires = (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+
+	if(timer_pending(t))
+	{
+		if(t->expires == expires)
+			return;
+		timer_cancel(w, t);
+	}
+	t->expires = expires;
+	wheel_add(w, t);
+	w->count++;
+}
+
+void timer_cancel(struct wheel *w, struct timer *t)
+{
+	if(!timer_pending(t))
+		return;
+	*t->pprev = t->next;
+	if(t->next != NULL)
+		t->next->pprev = t->pprev;
+	t->pprev = NULL;
+	w->count--;
+}
+
+//move the timers of a coarse slot down to where they belong now
+static void cascade(struct wheel *w, int lvl, size_t idx)
+{
+	struct timer *t = w->slots[lvl][idx], *next;
+
+	w->slots[lvl][idx] = NULL;
+	for(; t != NULL; t = next)
+	{
+		next = t->next;
+		wheel_add(w, t);
+	}
+}
+
+/*********************************************************************
+Process the current tick: when level 0 wraps around, the next slot of
+level 1 is cascaded, and so on up while those wrap too. What is left in
+the level 0 slot of the tick has expired and goes to @w->due.
+**********************************************************************/
+static void wheel_step(struct wheel *w)
+{
+	int lvl;
+
+	if((w->tick & WHEEL_MASK) == 0)
+	{
+		for(lvl = 1; lvl < WHEEL_LEVELS; lvl++)
+		{
+			size_t idx = (w->tick >> (WHEEL_BITS * lvl)) & WHEEL_MASK;
+
+			cascade(w, lvl, idx);
+			if(idx != 0)
+				break;
+		}
+	}
+	struct timer **slot = &w->slots[0][w->tick & WHEEL_MASK];
+	if(*slot != NULL)
+	{
+		w->due = *slot;
+		w->due->pprev = &w->due;
+		*slot = NULL;
+	}
+	w->tick++;
+}
+
+struct timer *wheel_expired(struct wheel *w, uint64_t ms)
+{
+	uint64_t now = ms / TIMER_TICK_MS;
+	struct timer *t;
+
+	if(w->count == 0)
+	{
+		//nothing to walk through, just catch up
+		if(w->tick <= now)
+			w->tick = now + 1;
+		return NULL;
+	}
+	while(w->due == NULL && w->tick <= now)
+		wheel_step(w);
+	if((t = w->due) == NULL)
+		return NULL;
+	timer_cancel(w, t);
+	return t;
+}
+
+int wheel_timeout(const struct wheel *w, uint64_t ms)
+{
+	uint64_t tick, wrap = (w->tick | WHEEL_MASK) + 1;
+
+	if(w->count == 0)
+		return -1;
+	if(w->due != NULL || w->tick * TIMER_TICK_MS <= ms)
+		return 0;
+	//the next busy slot before level 0 wraps, or the wrap itself since
+	//it may bring timers down from the coarser levels
+	for(tick = w->tick; tick < wrap; tick++)
+	{
+		if(w->slots[0][tick & WHEEL_MASK] != NULL)
+			break;
+	}
+	uint64_t wait = tick * TIMER_TICK_MS - ms;
+	return wait > INT_MAX ? INT_MAX : (int)wait;
+}
@@ -0,0 +1,69 @@
+#ifndef AESD_TIMER_H
+#define AESD_TIMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//resolution of the wheel, deadlines are rounded up to a tick
+#define TIMER_TICK_MS 100
+//four levels of 64 slots reach 64^4 ticks, about 19 days
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+/**
+ * A deadline, embedded in whatever it times out. @expires is in ticks;
+ * @pprev is NULL while the timer is not pending.
+ */
+struct timer {
+	uint64_t expires;
+	struct timer *next;
+	struct timer **pprev;
+};
+
+/**
+ * Hierarchical timer wheel. A timer due within 64 ticks sits in the
+ * level 0 slot of its tick, later ones in coarser levels and move down
+ * a level each time the finer one wraps around, so setting, cancelling
+ * and expiring a timer cost O(1) however many are pending. @tick is the
+ * next tick to be processed, @due holds expired timers not yet handed
+ * out.
+ */
+struct wheel {
+	uint64_t tick;
+	size_t count;
+	struct timer *due;
+	struct timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+/**
+ * @return the current time in milliseconds of CLOCK_MONOTONIC.
+ */
+uint64_t timer_now(void);
+
+void wheel_init(struct wheel *w);
+
+/**
+ * (Re)arm @param t to expire at @param ms, a timer_now() time.
+ */
+void timer_set(struct wheel *w, struct timer *t, uint64_t ms);
+void timer_cancel(struct wheel *w, struct timer *t);
+
+static inline int timer_pending(const struct timer *t)
+{
+	return t->pprev != NULL;
+}
+
+/**
+ * Take the next timer that expired by @param ms; it is no longer pending.
+ * @return the timer, NULL once there are none.
+ */
+struct timer *wheel_expired(struct wheel *w, uint64_t ms);
+
+/**
+ * @return milliseconds until the wheel next needs to be looked at, -1
+ * when no timer is pending; suitable as an epoll_wait() timeout.
+ */
+int wheel_timeout(const struct wheel *w, uint64_t ms);
+
+#endif
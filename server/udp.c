@@ -0,0 +1,311 @@
+#define _GNU_SOURCE
+#include "udp.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "admit.h"
+#include "capture.h"
+#include "config.h"
+#include "conn.h"
+#include "timer.h"
+#include "log.h"
+#include "mem.h"
+#include "probe.h"
+#include "query.h"
+
+//batches read per wakeup before going back to the epoll loop
+#define UDP_ROUNDS 16
+//a deep socket buffer absorbs bursts between two drains
+#define UDP_RCVBUF (4 * 1024 * 1024)
+
+struct udp_stats udp_stats;
+
+static int udp_bind(const char *addr, const char *port)
+{
+	struct addrinfo hints, *res;
+	int fd, gai;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = addr[0] ? AF_UNSPEC : AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_PASSIVE;
+	if((gai = getaddrinfo(addr[0] ? addr : NULL, port, &hints, &res)) != 0)
+	{
+		log_error("udp getaddrinfo: %s", gai_strerror(gai));
+		return -1;
+	}
+	fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, res->ai_protocol);
+	if(fd == -1)
+	{
+		log_error("udp socket: %m");
+		freeaddrinfo(res);
+		return -1;
+	}
+	int one = 1, rcvbuf = UDP_RCVBUF;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	if(bind(fd, res->ai_addr, res->ai_addrlen) != 0)
+	{
+		log_error("udp bind: %m");
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+int udp_open(struct udp *u, int fd, const char *addr, const char *port, struct channel *ch)
+{
+	size_t i;
+
+	memset(u, 0, sizeof(*u));
+	u->source = SOURCE_UDP;
+	u->ch = ch;
+	u->batch = CFG.udp_batch;
+	u->size = CFG.udp_size;
+	u->bufs = mem_realloc(MEM_RECV, NULL, 0, u->batch * (u->size + 1));
+	u->msgs = calloc(u->batch, sizeof(*u->msgs));
+	u->slots = calloc(u->batch, sizeof(*u->slots));
+	u->addrs = calloc(u->batch, sizeof(*u->addrs));
+	u->acks = calloc(u->batch, sizeof(*u->acks));
+	u->ack_iov = calloc(u->batch, sizeof(*u->ack_iov));
+	u->ack_text = calloc(u->batch, sizeof(*u->ack_text));
+	if(u->bufs == NULL || u->msgs == NULL || u->slots == NULL || u->addrs == NULL ||
+	   u->acks == NULL || u->ack_iov == NULL || u->ack_text == NULL)
+	{
+		log_error("udp: %m");
+		u->fd = fd;
+		udp_close(u);
+		return -1;
+	}
+	for(i = 0; i < u->batch; i++)
+	{
+		u->slots[i].iov_base = u->bufs + i * (u->size + 1);
+		u->slots[i].iov_len = u->size;
+		u->ack_iov[i].iov_base = u->ack_text[i];
+		u->acks[i].msg_hdr.msg_iov = &u->ack_iov[i];
+		u->acks[i].msg_hdr.msg_iovlen = 1;
+		u->acks[i].msg_hdr.msg_name = &u->addrs[i];
+	}
+	if((u->fd = fd != -1 ? fd : udp_bind(addr, port)) == -1)
+	{
+		udp_close(u);
+		return -1;
+	}
+	return 0;
+}
+
+void udp_close(struct udp *u)
+{
+	if(u->fd != -1)
+		close(u->fd);
+	u->fd = -1;
+	mem_free(MEM_RECV, u->bufs, u->batch * (u->size + 1));
+	free(u->msgs);
+	free(u->slots);
+	free(u->addrs);
+	free(u->pkts);
+	free(u->acks);
+	free(u->ack_iov);
+	free(u->ack_text);
+	u->bufs = NULL;
+	u->msgs = NULL;
+	u->slots = NULL;
+	u->addrs = NULL;
+	u->pkts = NULL;
+	u->acks = NULL;
+	u->ack_iov = NULL;
+	u->ack_text = NULL;
+}
+
+static int add_packet(struct udp *u, size_t *n, char *data, size_t len)
+{
+	if(*n == u->pkts_cap)
+	{
+		size_t cap = u->pkts_cap ? u->pkts_cap * 2 : u->batch * 2;
+		struct iovec *p = realloc(u->pkts, cap * sizeof(*p));
+		if(p == NULL)
+			return -1;
+		u->pkts = p;
+		u->pkts_cap = cap;
+	}
+	u->pkts[*n].iov_base = data;
+	u->pkts[*n].iov_len = len;
+	(*n)++;
+	return 0;
+}
+
+//whether the sender of datagram @i is within its rate limits
+static int udp_admit(struct udp *u, int i, const char *p, size_t len, uint64_t now)
+{
+	const struct sockaddr_storage *sa = &u->addrs[i];
+	char addr[INET6_ADDRSTRLEN] = "";
+	size_t packets = 0;
+	const char *nl;
+
+	for(nl = p; (nl = memchr(nl, '\n', p + len - nl)) != NULL; nl++)
+		packets++;
+	if(sa->ss_family == AF_INET6)
+		inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)sa)->sin6_addr, addr, sizeof(addr));
+	else if(sa->ss_family == AF_INET)
+		inet_ntop(AF_INET, &((const struct sockaddr_in *)sa)->sin_addr, addr, sizeof(addr));
+	if(admit_take(addr, len, packets, 0, now) == 0)
+		return 1;
+	admit_stats.dropped_packets += packets;
+	admit_stats.dropped_bytes += len;
+	return 0;
+}
+
+/*********************************************************************
+Split the datagrams of one batch into packets. Each datagram ends up as
+whole packets, so a datagram can never leave half a packet in the log.
+Commands are dropped: there is no connection to send a reply on, and
+so are datagrams from senders over their rate limits.
+@ends gets the log length (relative to the batch) after each datagram,
+@nack why a datagram was dropped or NULL if it was stored.
+@return number of packets, -1 if out of memory.
+**********************************************************************/
+static ssize_t udp_frame(struct udp *u, int count, size_t *ends, const char **nack)
+{
+	size_t n = 0, total = 0;
+	uint64_t now = admit_limited() ? timer_now() : 0;
+	int i;
+
+	for(i = 0; i < count; i++)
+	{
+		struct mmsghdr *m = &u->msgs[i];
+		char *p = u->slots[i].iov_base, *end = p + m->msg_len;
+
+		PROBE2(recv, 0, m->msg_len);
+		ends[i] = total;
+		nack[i] = NULL;
+		if(m->msg_hdr.msg_flags & MSG_TRUNC)
+		{
+			atomic_fetch_add(&udp_stats.dropped, 1);
+			nack[i] = "truncated";
+			continue;
+		}
+		if(m->msg_len > 0 && end[-1] != '\n')
+			*end++ = '\n';
+		if(now && !udp_admit(u, i, p, end - p, now))
+		{
+			nack[i] = "throttled";
+			continue;
+		}
+		while(p < end)
+		{
+			char *nl = memchr(p, '\n', end - p);
+			size_t len = nl - p + 1;
+
+			if(len >= sizeof(QUERY_PREFIX) - 1 && memcmp(p, QUERY_PREFIX, sizeof(QUERY_PREFIX) - 1) == 0)
+				atomic_fetch_add(&udp_stats.dropped, 1);
+			else
+			{
+				if(add_packet(u, &n, p, len) == -1)
+					return -1;
+				capture_event(CAPTURE_DATAGRAM, 0, NULL, len);
+				total += len;
+			}
+			p = nl + 1;
+		}
+		//nothing of it reached the log: empty, or its lines were all commands
+		if(total == ends[i])
+			nack[i] = m->msg_len > 0 ? "command" : "empty";
+		ends[i] = total;
+	}
+	return n;
+}
+
+//a dropped datagram is answered with why instead of an offset it never reached
+static void udp_ack(struct udp *u, int count, const size_t *ends, const char **nack, uint64_t base)
+{
+	int i, sent = 0;
+
+	for(i = 0; i < count; i++)
+	{
+		struct msghdr *h = &u->acks[i].msg_hdr;
+
+		h->msg_namelen = u->msgs[i].msg_hdr.msg_namelen;
+		if(nack[i] != NULL)
+			u->ack_iov[i].iov_len = snprintf(u->ack_text[i], sizeof(u->ack_text[i]),
+							 QUERY_PREFIX "NACK:%s\n", nack[i]);
+		else
+			u->ack_iov[i].iov_len = snprintf(u->ack_text[i], sizeof(u->ack_text[i]),
+							 QUERY_PREFIX "ACK:%llu\n",
+							 (unsigned long long)(base + ends[i]));
+	}
+	//acks are best effort, a full socket buffer just loses them
+	while(sent < count)
+	{
+		int rc = sendmmsg(u->fd, u->acks + sent, count - sent, MSG_DONTWAIT);
+		if(rc <= 0)
+			break;
+		sent += rc;
+	}
+}
+
+void udp_drain(struct udp *u)
+{
+	size_t ends[u->batch];
+	const char *nack[u->batch];
+	int round, i;
+
+	for(round = 0; round < UDP_ROUNDS; round++)
+	{
+		for(i = 0; i < (int)u->batch; i++)
+		{
+			struct msghdr *h = &u->msgs[i].msg_hdr;
+			h->msg_iov = &u->slots[i];
+			h->msg_iovlen = 1;
+			h->msg_name = &u->addrs[i];
+			h->msg_namelen = sizeof(u->addrs[i]);
+			h->msg_flags = 0;
+		}
+		int count = recvmmsg(u->fd, u->msgs, u->batch, MSG_DONTWAIT, NULL);
+		if(count <= 0)
+		{
+			if(count == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				log_error("udp receive: %m");
+			return;
+		}
+
+		ssize_t n = udp_frame(u, count, ends, nack);
+		if(n == -1)
+		{
+			log_error("udp: %m");
+			return;
+		}
+
+		struct channel *ch = u->ch;
+		channel_lock(ch);
+		uint64_t base = ch->st.committed;
+		if(n > 0)
+		{
+			PROBE2(append_start, 0, ends[count - 1]);
+			if(store_appendv(&ch->st, u->pkts, n) == -1)
+			{
+				channel_unlock(ch);
+				log_error("udp append: %m");
+				return;
+			}
+			PROBE2(append_end, 0, ch->st.committed);
+		}
+		for(i = 0; i < n; i++)
+			feed_publish(&ch->feed, u->pkts[i].iov_base, u->pkts[i].iov_len);
+		if(n > 0)
+			channel_retain(ch);
+		channel_unlock(ch);
+		if(n > 0)
+			feed_notify(ch);
+		if(CFG.udp_ack)
+			udp_ack(u, count, ends, nack, base);
+		if(count < (int)u->batch)
+			return;
+	}
+}
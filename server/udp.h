@@ -0,0 +1,72 @@
+#ifndef AESD_UDP_H
+#define AESD_UDP_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "channel.h"
+#include "source.h"
+
+/**
+ * Datagram ingestion for fire-and-forget producers. Every datagram holds
+ * one or more packets, a missing final '\n' is added. Datagrams are read
+ * in batches with recvmmsg() and a whole batch is appended to the default
+ * channel with one write. There is no replay, with --udp-ack each datagram
+ * is answered with "AESDSOCKET_ACK:<end offset>\n" through sendmmsg(), or
+ * with "AESDSOCKET_NACK:<reason>\n" if it was dropped: "truncated" when it
+ * was longer than --udp-size, "throttled" when its sender was over the
+ * rate limits, "command" when it held nothing but commands and "empty"
+ * when it held nothing at all.
+ */
+struct udp {
+	enum source source;
+	int fd;
+	struct channel *ch;
+	size_t batch;
+	size_t size;
+
+	//one receive slot per datagram, with room for an added '\n'
+	char *bufs;
+	struct mmsghdr *msgs;
+	struct iovec *slots;
+	struct sockaddr_storage *addrs;
+
+	//the packets of the current batch, in log order
+	struct iovec *pkts;
+	size_t pkts_cap;
+
+	struct mmsghdr *acks;
+	struct iovec *ack_iov;
+	char (*ack_text)[48];
+};
+
+/**
+ * Datagrams dropped for being longer than --udp-size, and commands
+ * dropped from datagrams, for AESDSOCKET_STATS.
+ */
+struct udp_stats {
+	_Atomic uint64_t dropped;
+};
+
+extern struct udp_stats udp_stats;
+
+/**
+ * Bind a non-blocking datagram socket to @param addr (all IPv4 addresses
+ * if empty) and @param port, feeding channel @param ch. @param fd is a
+ * socket handed over by an upgrade to use instead, or -1.
+ * @return 0 on success, -1 after printing the error.
+ */
+int udp_open(struct udp *u, int fd, const char *addr, const char *port, struct channel *ch);
+
+/**
+ * Append every datagram waiting on the socket, a bounded number of
+ * batches per call so TCP clients are not starved.
+ */
+void udp_drain(struct udp *u);
+
+void udp_close(struct udp *u);
+
+#endif
@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+#include "upgrade.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "log.h"
+
+//in front of every item on the socket
+struct upgrade_hdr {
+	uint32_t version;
+	uint32_t item_len;
+	//bytes following the item, in messages of up to UPGRADE_CHUNK
+	uint64_t data_len;
+};
+
+//the new server while it has not reported ready
+static pid_t child = -1;
+//workers hand their connections over at the same time
+static pthread_mutex_t send_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int upgrade_exec(char *argv[])
+{
+	int sv[2];
+	char num[16];
+	pid_t pid;
+
+	if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1)
+		return -1;
+	//or the child would print our buffered output a second time
+	fflush(NULL);
+	if((pid = fork()) == -1)
+	{
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+	if(pid == 0)
+	{
+		//only the hand-over socket survives the exec
+		fcntl(sv[1], F_SETFD, 0);
+		snprintf(num, sizeof(num), "%d", sv[1]);
+		setenv(UPGRADE_ENV, num, 1);
+		execvp(argv[0], argv);
+		//no log thread in here, write straight to stderr
+		perror("\nupgrade exec");
+		_exit(127);
+	}
+	close(sv[1]);
+	child = pid;
+	log_info("upgrade: started pid %d", (int)pid);
+	return sv[0];
+}
+
+int upgrade_ready(int sock)
+{
+	uint32_t version;
+	ssize_t rc;
+
+	do
+		rc = recv(sock, &version, sizeof(version), 0);
+	while(rc == -1 && errno == EINTR);
+	if(rc == -1)
+		log_error("upgrade: %m");
+	else if(rc == 0)
+		log_error("upgrade: new server (pid %d) exited before it came up", (int)child);
+	else if(rc != sizeof(version) || version != UPGRADE_VERSION)
+		log_error("upgrade: new server (pid %d) speaks another hand-over version than %d",
+			  (int)child, UPGRADE_VERSION);
+	else
+	{
+		log_info("upgrade: handing over to pid %d", (int)child);
+		child = -1;
+		return 0;
+	}
+	upgrade_abandon(sock);
+	return -1;
+}
+
+void upgrade_abandon(int sock)
+{
+	if(child != -1)
+	{
+		kill(child, SIGTERM);
+		waitpid(child, NULL, 0);
+		child = -1;
+	}
+	close(sock);
+}
+
+int upgrade_accept(void)
+{
+	const char *env = getenv(UPGRADE_ENV);
+	uint32_t version = UPGRADE_VERSION;
+	int sock;
+
+	if(env == NULL)
+		return -1;
+	sock = atoi(env);
+	unsetenv(UPGRADE_ENV);
+	fcntl(sock, F_SETFD, FD_CLOEXEC);
+	if(send(sock, &version, sizeof(version), MSG_NOSIGNAL) != sizeof(version))
+	{
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+static int send_full(int sock, const struct msghdr *msg, size_t len)
+{
+	ssize_t sd;
+
+	do
+		sd = sendmsg(sock, msg, MSG_NOSIGNAL);
+	while(sd == -1 && errno == EINTR);
+	//records go whole or not at all
+	return sd == (ssize_t)len ? 0 : -1;
+}
+
+int upgrade_send(int sock, const struct upgrade_item *it, const struct iovec *data, int cnt)
+{
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(UPGRADE_MAX_FDS * sizeof(int))];
+	} ctl;
+	struct upgrade_hdr hdr = { .version = UPGRADE_VERSION, .item_len = sizeof(*it) };
+	struct iovec iov[2] = { { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+				{ .iov_base = (void *)it, .iov_len = sizeof(*it) } };
+	struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2,
+			      .msg_control = ctl.buf, .msg_controllen = CMSG_SPACE(it->nfds * sizeof(int)) };
+	struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+	int i, rc = -1;
+
+	for(i = 0; i < cnt; i++)
+		hdr.data_len += data[i].iov_len;
+	memset(&ctl, 0, sizeof(ctl));
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(it->nfds * sizeof(int));
+	memcpy(CMSG_DATA(c), it->fds, it->nfds * sizeof(int));
+	pthread_mutex_lock(&send_lock);
+	if(send_full(sock, &msg, sizeof(hdr) + sizeof(*it)) == -1)
+		goto out;
+	for(i = 0; i < cnt; i++)
+	{
+		struct iovec chunk = data[i];
+		struct msghdr dmsg = { .msg_iov = &chunk, .msg_iovlen = 1 };
+		size_t left = data[i].iov_len;
+
+		while(left > 0)
+		{
+			chunk.iov_len = left < UPGRADE_CHUNK ? left : UPGRADE_CHUNK;
+			if(send_full(sock, &dmsg, chunk.iov_len) == -1)
+				goto out;
+			chunk.iov_base = (char *)chunk.iov_base + chunk.iov_len;
+			left -= chunk.iov_len;
+		}
+	}
+	rc = 0;
+out:
+	pthread_mutex_unlock(&send_lock);
+	return rc;
+}
+
+//the connection bytes @it says follow it
+static uint64_t item_data_len(const struct upgrade_item *it)
+{
+	if(it->kind != UPGRADE_CONN)
+		return 0;
+	return (uint64_t)it->in_len + it->packet_len + it->unsent_len +
+		(uint64_t)it->ranges * 2 * sizeof(uint64_t) + it->pattern_len;
+}
+
+int upgrade_recv(int sock, struct upgrade_item *it)
+{
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(UPGRADE_MAX_FDS * sizeof(int))];
+	} ctl;
+	struct upgrade_hdr hdr;
+	struct iovec iov[2] = { { .iov_base = &hdr, .iov_len = sizeof(hdr) },
+				{ .iov_base = it, .iov_len = sizeof(*it) } };
+	struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2,
+			      .msg_control = ctl.buf, .msg_controllen = sizeof(ctl.buf) };
+	struct cmsghdr *c;
+	uint64_t got;
+	ssize_t rc;
+	int i, nfds = 0;
+
+	do
+		rc = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	while(rc == -1 && errno == EINTR);
+	if(rc <= 0)
+		return rc;
+	c = CMSG_FIRSTHDR(&msg);
+	if(c != NULL && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+		nfds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	if(rc != sizeof(hdr) + sizeof(*it) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ||
+	   hdr.version != UPGRADE_VERSION || hdr.item_len != sizeof(*it) ||
+	   it->nfds < 1 || it->nfds != nfds || hdr.data_len != item_data_len(it))
+	{
+		//whatever came along must not leak
+		for(i = 0; i < nfds; i++)
+			close(((int *)CMSG_DATA(c))[i]);
+		errno = EPROTO;
+		return -1;
+	}
+	memcpy(it->fds, CMSG_DATA(c), nfds * sizeof(int));
+	it->data = NULL;
+	if(hdr.data_len == 0)
+		return 1;
+	if((it->data = malloc(hdr.data_len)) == NULL)
+		goto fail;
+	for(got = 0; got < hdr.data_len; got += rc)
+	{
+		do
+			rc = recv(sock, it->data + got, hdr.data_len - got, 0);
+		while(rc == -1 && errno == EINTR);
+		if(rc <= 0)
+		{
+			if(rc == 0)
+				errno = EPROTO;
+			goto fail;
+		}
+	}
+	return 1;
+fail:
+	upgrade_discard(it);
+	return -1;
+}
+
+void upgrade_discard(const struct upgrade_item *it)
+{
+	int i;
+
+	for(i = 0; i < it->nfds; i++)
+		close(it->fds[i]);
+	free(it->data);
+}
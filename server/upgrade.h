@@ -0,0 +1,143 @@
+#ifndef AESD_UPGRADE_H
+#define AESD_UPGRADE_H
+
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "channel.h"
+#include "frame.h"
+
+/*********************************************************************
+Hot upgrade. On SIGUSR2 the running server starts the binary found at
+its argv[0] with the same arguments and a SOCK_SEQPACKET socket named
+by UPGRADE_ENV, and goes on serving. The new server reports ready with
+the protocol version it speaks, which turns the socket readable in the
+old one's epoll loop. If the versions match the old server sends it
+every listening socket and the capture trace, then every connection
+right away, busy or not: a connection carries what it was in the middle
+of (input not read into packets yet, a partial packet, reply bytes on
+their way out, the replies still owed, a GREP or REGEX being scanned)
+and the new server picks it up there. Each item goes with its
+descriptors attached through SCM_RIGHTS, behind a header giving the
+version and the lengths of the item and of the connection bytes that
+follow it. The old server closes its logs and trace and then the
+socket; only at that EOF does the new server open the logs and start
+serving, so the two never write at the same time. As nothing waits for
+clients, that takes a round of the loops; clients that connect
+meanwhile wait in the listen backlog, none are refused.
+**********************************************************************/
+
+#define UPGRADE_ENV "AESDSOCKET_UPGRADE_FD"
+//bumped whenever struct upgrade_item or what follows it changes
+#define UPGRADE_VERSION 2
+#define UPGRADE_MAX_FDS 3
+//connection bytes sent per message after the item
+#define UPGRADE_CHUNK (64 * 1024)
+
+enum upgrade_kind {
+	UPGRADE_TCP,
+	UPGRADE_UNIX,
+	UPGRADE_SEQPACKET,
+	UPGRADE_SHM_LISTENER,
+	UPGRADE_UDP,
+	UPGRADE_CONN,		//the connection's socket
+	UPGRADE_SHM_RING,	//the ring's memfd, doorbell and control socket
+	UPGRADE_CAPTURE,	//the --capture trace file
+};
+
+struct upgrade_item {
+	enum upgrade_kind kind;
+	int nfds;
+	int fds[UPGRADE_MAX_FDS];
+	//connections only
+	int seqpacket;
+	int subscribed;
+	int compressed;
+	int binary;
+	uint64_t cursor;
+	char channel[CHANNEL_NAME_MAX + 1];
+	char addr[INET6_ADDRSTRLEN];
+	//what the connection was in the middle of, see conn_handoff(); the
+	//bytes counted here follow the item in this order
+	uint32_t in_len;		//received, not split into packets yet
+	uint32_t packet_len;		//of the partial packet held in memory
+	uint32_t unsent_len;		//of replies on their way out
+	uint32_t ranges;		//replies still owed, two int64_t each
+	uint32_t pattern_len;		//of the GREP or REGEX being scanned
+	//the partial packet spilled to disk, its file is fds[1]
+	uint64_t stage_len;
+	uint32_t stage_crc;
+	int stage_checksums;
+	char frame_hdr[FRAME_HDR];
+	uint32_t frame_got;
+	uint64_t frame_left;
+	char frame_last;
+	int64_t frame_end;
+	uint64_t sub_cursor;
+	int sub_skip;
+	//the scan, see struct query_scan, and the matches not queued yet;
+	//QUERY_INVALID when there is none
+	int scan_type;
+	int64_t scan_pos;
+	int64_t scan_piece;
+	int64_t scan_end;
+	int64_t scan_from;
+	int64_t scan_to;
+	//the capture trace only, see capture_state()
+	uint64_t capture_started;
+	uint32_t capture_next_id;
+	//not sent: the bytes that came after the item, malloc()ed, or NULL
+	char *data;
+};
+
+/**
+ * Start the new server with @param argv, without waiting for it.
+ * @return the socket to hand descriptors over on, which turns readable
+ * once the new server is up (see upgrade_ready()), -1 if it could not
+ * be started.
+ */
+int upgrade_exec(char *argv[]);
+
+/**
+ * Read what the new server reported on @param sock once it turned
+ * readable.
+ * @return 0 if it is ready and speaks UPGRADE_VERSION, else -1 after
+ * logging why; then the new server was stopped and the socket closed.
+ */
+int upgrade_ready(int sock);
+
+/**
+ * Give up on a new server that did not report in time: stop it and
+ * close @param sock.
+ */
+void upgrade_abandon(int sock);
+
+/**
+ * @return the hand-over socket if this process was started by
+ * upgrade_exec(), after telling the old server it is ready, else -1.
+ */
+int upgrade_accept(void);
+
+/**
+ * Send @param it with its descriptors, followed by the @param cnt
+ * buffers of @param data (connections only). The descriptors stay open.
+ * Safe to call from several threads at once, items do not interleave.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int upgrade_send(int sock, const struct upgrade_item *it, const struct iovec *data, int cnt);
+
+/**
+ * Receive the next item and the bytes that follow it, blocking.
+ * @return 1 for an item, 0 once the old server is done, -1 with errno
+ * set on error (EPROTO for an item of another version or size).
+ */
+int upgrade_recv(int sock, struct upgrade_item *it);
+
+/**
+ * Close the descriptors of @param it and free its data, for an item
+ * that will not be taken over.
+ */
+void upgrade_discard(const struct upgrade_item *it);
+
+#endif
@@ -0,0 +1,367 @@
+#define _GNU_SOURCE
+#include "worker.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "conn.h"
+#include "cpu.h"
+#include "log.h"
+#include "source.h"
+#include "upgrade.h"
+
+#define WORKER_EVENTS 64
+
+struct worker {
+	enum source source;
+	pthread_t thread;
+	int started;
+	int epfd;
+	//wakes the worker for new connections, kicks and shutdown
+	int efd;
+	//the CPU it is pinned to, -1 if it is not
+	int cpu;
+
+	//guards the two lists below, filled by other threads
+	pthread_mutex_t lock;
+	struct upgrade_item *incoming;
+	size_t incoming_count;
+	size_t incoming_cap;
+	struct conn *kicked;
+
+	_Atomic int stop;
+	//set until it handed its connections over during an upgrade
+	_Atomic int busy;
+	//config_generation() at its last quiescent point, UINT64_MAX while
+	//it waits for events
+	_Atomic uint64_t config_seen;
+};
+
+static struct worker *workers;
+static size_t nworkers;
+//next worker for a connection without a CPU of its own
+static size_t next_worker;
+//the upgrade socket once an upgrade started, -1 before
+static _Atomic int handoff_sock = -1;
+
+static __thread struct worker *self;
+
+static void worker_wake(struct worker *w)
+{
+	uint64_t one = 1;
+
+	if(write(w->efd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+		log_error("worker wake: %m");
+}
+
+static void kick_unlink(struct conn *c)
+{
+	if(c->kick_pprev == NULL)
+		return;
+	*c->kick_pprev = c->kick_next;
+	if(c->kick_next != NULL)
+		c->kick_next->kick_pprev = c->kick_pprev;
+	c->kick_pprev = NULL;
+}
+
+//take over the connections queued for @w and serve the kicked ones
+static void worker_drain(struct worker *w)
+{
+	struct upgrade_item *items;
+	size_t i, count;
+	uint64_t v;
+
+	if(read(w->efd, &v, sizeof(v)) == -1 && errno != EAGAIN)
+		log_error("worker wake: %m");
+	pthread_mutex_lock(&w->lock);
+	items = w->incoming;
+	count = w->incoming_count;
+	w->incoming = NULL;
+	w->incoming_count = w->incoming_cap = 0;
+	pthread_mutex_unlock(&w->lock);
+	for(i = 0; i < count; i++)
+		conn_adopt(w->epfd, &items[i]);
+	free(items);
+
+	//one at a time, serving one may free it and kick others
+	for(;;)
+	{
+		pthread_mutex_lock(&w->lock);
+		struct conn *c = w->kicked;
+		if(c != NULL)
+			kick_unlink(c);
+		pthread_mutex_unlock(&w->lock);
+		if(c == NULL)
+			break;
+		conn_kicked(c);
+	}
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	size_t waiting = 0;
+
+	self = w;
+	if(w->cpu != -1)
+	{
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(w->cpu, &set);
+		if(cpu_pin(&set) == -1)
+			log_warn("worker %zu: cannot pin to CPU %d: %m", (size_t)(w - workers), w->cpu);
+	}
+	while(!atomic_load(&w->stop))
+	{
+		struct epoll_event events[WORKER_EVENTS];
+		int timeout = conn_expire();
+		int sock;
+
+		//same pacing as the main loop while replaying
+		if(waiting)
+			timeout = 0;
+		//holds nothing of the options while it waits
+		atomic_store(&w->config_seen, UINT64_MAX);
+		int i, n = epoll_wait(w->epfd, events, WORKER_EVENTS, timeout);
+		atomic_store(&w->config_seen, config_generation());
+		if(n == -1)
+		{
+			if(errno == EINTR)
+				continue;
+			log_error("worker epoll_wait: %m");
+			break;
+		}
+		for(i = 0; i < n; i++)
+		{
+			void *ptr = events[i].data.ptr;
+
+			if(*(enum source *)ptr == SOURCE_WORKER)
+				worker_drain(w);
+			else if(conn_event(ptr, events[i].events) == -1)
+				conn_free(ptr);
+		}
+		waiting = conn_schedule();
+		//woken up by worker_handoff()
+		if((sock = atomic_load(&handoff_sock)) != -1)
+		{
+			//connections queued for it go along
+			worker_drain(w);
+			conn_handoff(sock);
+			atomic_store(&w->busy, 0);
+		}
+	}
+	conn_free_all();
+	return NULL;
+}
+
+static int worker_init(struct worker *w, int cpu)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = w };
+
+	w->source = SOURCE_WORKER;
+	w->cpu = cpu;
+	w->efd = -1;
+	pthread_mutex_init(&w->lock, NULL);
+	atomic_store(&w->busy, 1);
+	if((w->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+	   (w->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ||
+	   epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->efd, &ev) == -1)
+		return -1;
+	return 0;
+}
+
+int worker_start(size_t n)
+{
+	cpu_set_t cpus;
+	sigset_t all, old;
+	size_t i;
+	int rc = 0;
+
+	if(n == 0)
+		return 0;
+	if(CFG.worker_cpus[0] != '\0')
+		cpu_parse(CFG.worker_cpus, &cpus);
+	if((workers = calloc(n, sizeof(*workers))) == NULL)
+	{
+		log_error("workers: %m");
+		return -1;
+	}
+	//signals are for the main loop, never a worker
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for(i = 0; i < n && rc == 0; i++)
+	{
+		struct worker *w = &workers[i];
+
+		if(worker_init(w, CFG.worker_cpus[0] != '\0' ? cpu_nth(&cpus, i) : -1) == -1)
+			rc = errno;
+		else if((rc = pthread_create(&w->thread, NULL, worker_main, w)) == 0)
+			w->started = 1;
+		nworkers = i + 1;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if(rc != 0)
+	{
+		errno = rc;
+		log_error("workers: %m");
+		worker_stop();
+		return -1;
+	}
+	log_info("serving connections on %zu workers", n);
+	return 0;
+}
+
+void worker_stop(void)
+{
+	size_t i;
+
+	for(i = 0; i < nworkers; i++)
+	{
+		struct worker *w = &workers[i];
+
+		atomic_store(&w->stop, 1);
+		if(w->started)
+		{
+			worker_wake(w);
+			pthread_join(w->thread, NULL);
+		}
+		//connections queued but never taken over
+		for(; w->incoming_count > 0; w->incoming_count--)
+			upgrade_discard(&w->incoming[w->incoming_count - 1]);
+		free(w->incoming);
+		if(w->efd != -1)
+			close(w->efd);
+		if(w->epfd != -1)
+			close(w->epfd);
+		pthread_mutex_destroy(&w->lock);
+	}
+	free(workers);
+	workers = NULL;
+	nworkers = 0;
+}
+
+//the worker pinned to the CPU that received the connection's packets
+static struct worker *worker_pick(int fd)
+{
+#ifdef SO_INCOMING_CPU
+	int cpu;
+	socklen_t len = sizeof(cpu);
+	size_t i;
+
+	if(getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 && cpu >= 0)
+	{
+		//taking turns when more than one is pinned there
+		for(i = 0; i < nworkers; i++)
+		{
+			struct worker *w = &workers[(next_worker + i) % nworkers];
+
+			if(w->cpu == cpu)
+			{
+				next_worker += i + 1;
+				return w;
+			}
+		}
+	}
+#endif
+	return &workers[next_worker++ % nworkers];
+}
+
+int worker_assign(const struct upgrade_item *it)
+{
+	struct worker *w;
+
+	if(nworkers == 0)
+		return -1;
+	w = worker_pick(it->fds[0]);
+	pthread_mutex_lock(&w->lock);
+	if(w->incoming_count == w->incoming_cap)
+	{
+		size_t cap = w->incoming_cap ? w->incoming_cap * 2 : 16;
+		struct upgrade_item *n = realloc(w->incoming, cap * sizeof(*n));
+
+		if(n == NULL)
+		{
+			pthread_mutex_unlock(&w->lock);
+			log_error("connection from %s: %m", it->addr);
+			upgrade_discard(it);
+			return 0;
+		}
+		w->incoming = n;
+		w->incoming_cap = cap;
+	}
+	w->incoming[w->incoming_count++] = *it;
+	pthread_mutex_unlock(&w->lock);
+	worker_wake(w);
+	return 0;
+}
+
+struct worker *worker_self(void)
+{
+	return self;
+}
+
+void worker_kick(struct conn *c)
+{
+	struct worker *w = c->worker;
+
+	pthread_mutex_lock(&w->lock);
+	if(c->kick_pprev == NULL)
+	{
+		c->kick_next = w->kicked;
+		c->kick_pprev = &w->kicked;
+		if(w->kicked != NULL)
+			w->kicked->kick_pprev = &c->kick_next;
+		w->kicked = c;
+	}
+	pthread_mutex_unlock(&w->lock);
+	worker_wake(w);
+}
+
+void worker_unkick(struct conn *c)
+{
+	struct worker *w = c->worker;
+
+	if(w == NULL)
+		return;
+	pthread_mutex_lock(&w->lock);
+	kick_unlink(c);
+	pthread_mutex_unlock(&w->lock);
+}
+
+uint64_t worker_config_seen(void)
+{
+	uint64_t seen = UINT64_MAX, gen;
+	size_t i;
+
+	for(i = 0; i < nworkers; i++)
+	{
+		if((gen = atomic_load(&workers[i].config_seen)) < seen)
+			seen = gen;
+	}
+	return seen;
+}
+
+size_t worker_handoff(int sock)
+{
+	size_t i, busy = 0;
+
+	if(atomic_exchange(&handoff_sock, sock) == -1)
+	{
+		for(i = 0; i < nworkers; i++)
+			worker_wake(&workers[i]);
+	}
+	for(i = 0; i < nworkers; i++)
+		busy += atomic_load(&workers[i].busy);
+	return busy;
+}
@@ -0,0 +1,72 @@
+#ifndef AESD_WORKER_H
+#define AESD_WORKER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct conn;
+struct upgrade_item;
+struct worker;
+
+/*********************************************************************
+Worker threads for --workers. The main thread keeps the listeners, UDP
+and shared-memory rings and hands every accepted connection to a worker,
+which runs an epoll loop of its own over the connections it owns: their
+run queue and timers are per thread and only the owner touches them.
+With --worker-cpus each worker is pinned to one CPU and a connection goes
+to the worker on the CPU its packets arrive on (SO_INCOMING_CPU), else
+round robin. Connection buffers are allocated by the worker itself, so
+they come from its own malloc arena and, once touched, its NUMA node.
+Packets committed on another thread reach a worker's subscribers through
+worker_kick().
+**********************************************************************/
+
+/**
+ * Start @param n workers, pinned to the CPUs of --worker-cpus if given.
+ * @return 0 on success, -1 after logging the error.
+ */
+int worker_start(size_t n);
+
+/**
+ * Stop the workers, each closing its connections, and wait for them.
+ */
+void worker_stop(void);
+
+/**
+ * Hand the connection described by @param it to a worker; it is closed
+ * if the worker cannot queue it.
+ * @return 0 if a worker took it, -1 if there are no workers and the
+ * caller should serve it.
+ */
+int worker_assign(const struct upgrade_item *it);
+
+/**
+ * @return the worker the calling thread is, NULL on the main thread.
+ */
+struct worker *worker_self(void);
+
+/**
+ * Have the owner of subscriber @param c push it the packets just
+ * committed. Call it with the subscriber's channel locked.
+ */
+void worker_kick(struct conn *c);
+
+/**
+ * Take @param c off its owner's kick list, before it is freed.
+ */
+void worker_unkick(struct conn *c);
+
+/**
+ * @return the oldest config_generation() a worker may still be reading
+ * options of, UINT64_MAX if there are no workers.
+ */
+uint64_t worker_config_seen(void);
+
+/**
+ * Have every worker pass its connections over the upgrade socket
+ * @param sock, see conn_handoff().
+ * @return the number of workers that have not done so yet.
+ */
+size_t worker_handoff(int sock);
+
+#endif
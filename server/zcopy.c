@@ -0,0 +1,227 @@
+#define _GNU_SOURCE
+#include "zcopy.h"
+
+#include <errno.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "log.h"
+#include "mem.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+enum {
+	ZCOPY_UNTRIED,
+	ZCOPY_ON,
+	ZCOPY_OFF,
+};
+
+static __thread struct zcopy_chunk *pool;
+static __thread size_t pooled;
+
+//give back a chunk the kernel is done with
+static void chunk_put(struct zcopy *z, struct zcopy_chunk *ch)
+{
+	mem_release(MEM_REPLY, ZCOPY_CHUNK);
+	z->mem -= ZCOPY_CHUNK;
+	if(ch->done == ch->sends && pooled < ZCOPY_POOL)
+	{
+		ch->next = pool;
+		pool = ch;
+		pooled++;
+		return;
+	}
+	//the kernel may still hold the pages, they go once it lets go
+	munmap(ch->buf, ZCOPY_CHUNK);
+	free(ch);
+}
+
+int zcopy_usable(struct zcopy *z, int fd)
+{
+	int one = 1;
+
+	if(z->state == ZCOPY_UNTRIED)
+	{
+		//fails on sockets without it, such as AF_UNIX
+		z->state = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0 ?
+			ZCOPY_ON : ZCOPY_OFF;
+	}
+	if(z->state != ZCOPY_ON)
+		return 0;
+	if(z->nheld >= ZCOPY_HELD && zcopy_reap(z, fd) == -1)
+		return 0;
+	return z->nheld < ZCOPY_HELD;
+}
+
+struct zcopy_chunk *zcopy_get(struct zcopy *z)
+{
+	struct zcopy_chunk *ch;
+
+	if(mem_charge(MEM_REPLY, ZCOPY_CHUNK) == -1)
+		return NULL;
+	if((ch = pool) != NULL)
+	{
+		pool = ch->next;
+		pooled--;
+	}
+	else if((ch = malloc(sizeof(*ch))) == NULL ||
+		(ch->buf = mmap(NULL, ZCOPY_CHUNK, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+	{
+		free(ch);
+		mem_release(MEM_REPLY, ZCOPY_CHUNK);
+		errno = ENOMEM;
+		return NULL;
+	}
+	ch->off = ch->len = 0;
+	ch->first = z->next_id;
+	ch->sends = ch->done = 0;
+	ch->next = NULL;
+	z->cur = ch;
+	z->mem += ZCOPY_CHUNK;
+	return ch;
+}
+
+ssize_t zcopy_send(struct zcopy *z, int fd)
+{
+	struct zcopy_chunk *ch = z->cur;
+	ssize_t sd;
+
+	if(ch->off < ch->len)
+	{
+		sd = send(fd, ch->buf + ch->off, ch->len - ch->off, MSG_NOSIGNAL | MSG_ZEROCOPY);
+		if(sd >= 0)
+		{
+			ch->sends++;
+			z->next_id++;
+		}
+		//out of room for completions, copy this one
+		else if(errno == ENOBUFS)
+			sd = send(fd, ch->buf + ch->off, ch->len - ch->off, MSG_NOSIGNAL);
+		if(sd == -1)
+			return -1;
+		ch->off += sd;
+	}
+	else
+		sd = 0;
+	if(ch->off == ch->len)
+	{
+		z->cur = NULL;
+		if(ch->done == ch->sends)
+			chunk_put(z, ch);
+		else
+		{
+			ch->next = z->held;
+			z->held = ch;
+			z->nheld++;
+		}
+	}
+	return sd;
+}
+
+//the kernel numbers sends with 32 bits, ours do not wrap
+static uint64_t unwrap(const struct zcopy *z, uint32_t id)
+{
+	return z->next_id - (uint32_t)((uint32_t)z->next_id - id);
+}
+
+//count the sends of @ch in [@lo, @hi] as released
+static void chunk_done(struct zcopy_chunk *ch, uint64_t lo, uint64_t hi)
+{
+	uint64_t a = lo > ch->first ? lo : ch->first;
+	uint64_t b = hi < ch->first + ch->sends ? hi + 1 : ch->first + ch->sends;
+
+	if(a < b)
+		ch->done += b - a;
+}
+
+static void zcopy_done(struct zcopy *z, uint64_t lo, uint64_t hi)
+{
+	struct zcopy_chunk **pp = &z->held, *ch;
+
+	//completions may come in before a chunk is all sent
+	if(z->cur != NULL)
+		chunk_done(z->cur, lo, hi);
+	while((ch = *pp) != NULL)
+	{
+		chunk_done(ch, lo, hi);
+		if(ch->done == ch->sends)
+		{
+			*pp = ch->next;
+			z->nheld--;
+			chunk_put(z, ch);
+		}
+		else
+			pp = &ch->next;
+	}
+}
+
+int zcopy_reap(struct zcopy *z, int fd)
+{
+	char control[128];
+	int err;
+	socklen_t len = sizeof(err);
+
+	for(;;)
+	{
+		struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+		struct cmsghdr *cm;
+
+		if(recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+		{
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
+		}
+		for(cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+		{
+			struct sock_extended_err *ee = (struct sock_extended_err *)CMSG_DATA(cm);
+
+			if(!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+			     (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) ||
+			   ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY || ee->ee_errno != 0)
+				continue;
+			zcopy_done(z, unwrap(z, ee->ee_info), unwrap(z, ee->ee_data));
+			//pinning pages only to have them copied costs more than copying
+			if((ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && z->state == ZCOPY_ON)
+			{
+				log_debug("zero-copy sends are copied on this socket, copying from now on");
+				z->state = ZCOPY_OFF;
+			}
+		}
+	}
+	//what else made the socket report an error
+	if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+		return -1;
+	if(err != 0)
+	{
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+void zcopy_free(struct zcopy *z)
+{
+	struct zcopy_chunk *ch;
+
+	if(z->cur != NULL)
+		chunk_put(z, z->cur);
+	while((ch = z->held) != NULL)
+	{
+		z->held = ch->next;
+		chunk_put(z, ch);
+	}
+	z->cur = NULL;
+	z->nheld = 0;
+}
@@ -0,0 +1,88 @@
+#ifndef AESD_ZCOPY_H
+#define AESD_ZCOPY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*********************************************************************
+MSG_ZEROCOPY sends for --zerocopy. A long reply is read from the log
+into chunks of ZCOPY_CHUNK bytes and sent with MSG_ZEROCOPY, so the
+kernel transmits straight from the chunk's pages instead of copying
+them into the socket buffer. A sent chunk stays untouched until the
+completions read from the socket error queue cover every send made
+from it, then it goes back to a per-thread pool. Chunks are mapped
+pages of their own: a connection closed with sends outstanding unmaps
+them and the kernel keeps the pages alive until it is done, nothing
+else can be put there meanwhile. Sockets that cannot do it, or where
+the kernel reports it copied anyway (loopback), go back to copying.
+**********************************************************************/
+
+//bytes read from the log and sent per chunk
+#define ZCOPY_CHUNK (256 * 1024)
+//chunks a connection may have sent and not released yet
+#define ZCOPY_HELD 32
+//released chunks kept per thread for the next reply
+#define ZCOPY_POOL 16
+
+struct zcopy_chunk {
+	char *buf;
+	size_t off;
+	size_t len;
+	//sends made from it, numbered from @first, and how many of them
+	//the kernel released
+	uint64_t first;
+	uint32_t sends;
+	uint32_t done;
+	struct zcopy_chunk *next;
+};
+
+/**
+ * Zero-copy state of one connection: @cur is the chunk being sent,
+ * @held the ones sent before it that the kernel may still read from.
+ * @next_id numbers the next MSG_ZEROCOPY send, as the kernel does.
+ * @mem is what the chunks are charged to the memory budget.
+ */
+struct zcopy {
+	int state;
+	uint64_t next_id;
+	struct zcopy_chunk *cur;
+	struct zcopy_chunk *held;
+	size_t nheld;
+	size_t mem;
+};
+
+/**
+ * @return non-zero if the next chunk of a reply may go out of @param z
+ * through socket @param fd with MSG_ZEROCOPY; turns it on for the
+ * socket the first time.
+ */
+int zcopy_usable(struct zcopy *z, int fd);
+
+/**
+ * Make a free chunk the one being sent, for the caller to fill and set
+ * its @len.
+ * @return the chunk, NULL with errno set if none can be had.
+ */
+struct zcopy_chunk *zcopy_get(struct zcopy *z);
+
+/**
+ * Send what is left of the current chunk to @param fd, which is held
+ * once it is all sent.
+ * @return bytes sent, -1 with errno set on failure.
+ */
+ssize_t zcopy_send(struct zcopy *z, int fd);
+
+/**
+ * Read the completions queued on @param fd and release the chunks they
+ * cover.
+ * @return 0 on success, -1 with errno set if the socket failed.
+ */
+int zcopy_reap(struct zcopy *z, int fd);
+
+/**
+ * Drop every chunk of @param z, on close.
+ */
+void zcopy_free(struct zcopy *z);
+
+#endif